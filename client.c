@@ -1,7 +1,11 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -13,7 +17,10 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
+#include <time.h>
 #include <ctype.h> // tolower
+#include <stdint.h>
+#include <libgen.h> // basename
 
 #define TRUE 1
 #define FALSE 0
@@ -26,18 +33,159 @@
 
 #define PROMPT ": "
 
+#define MAX_SESSIONS 16
+#define MAX_GROUPS 8
+#define NAME_LEN 64
+#define MAX_REPLY 8192
+#define GATHER_TIMEOUT 2000 // ms to wait for all members of a group to reply
+#define END_OF_RESULT '\0' // sent by the Task Manager after each reply
+#define FAILED_RESULT '\x15' // sent just before END_OF_RESULT when the cmd failed
+#define UNSOLICITED '\x1e' // starts a frame that isn't a reply: watch events, broadcasts
+#define RESTARTED '\x1a' // starts the notice that the Task Manager was restarted; cmds in flight are lost
+#define TOKEN_LEN 16
+
+// put: the file is offered to the Task Manager by its key, the first 128 bits
+// of its SHA-256 in hex, and sent only if the TM answers UPLOAD_READY rather
+// than UPLOAD_SKIP (it has the file already, or won't take it). Nothing else
+// is sent to the session in between, as the file follows the cmd.
+#define UPLOAD_KEY_LEN 32
+#define UPLOAD_READY '\x06'
+#define UPLOAD_SKIP '\x18'
+
+// session states
+#define CLOSED 0
+#define CONNECTING 1
+#define OPEN 2
+#define DETACHED 3 // the connection dropped; the server keeps the session for us to resume
+
+// script mode: commands are sent this many ahead of their replies
+#define SCRIPT_WINDOW 16
+
+// ping: echoes are sent one at a time, each straight back from the TM and then
+// by way of the server, and timed along each hop
+#define MAX_PINGS 1000
+#define PING_TIMEOUT 2000 // ms to wait for each echo
+#define HOP_TM 0 // client -> TM -> client
+#define HOP_TO_SV 1 // TM -> server, timed by the TM and server
+#define HOP_FROM_SV 2 // server -> TM
+#define HOP_SV 3 // client -> TM -> server -> TM -> client
+#define HOPS 4
+
+/*
+ * A connection to one server. Connects are non-blocking; while CONNECTING,
+ * next_addr is the address currently being tried, and the ones after it
+ * are tried in turn if it fails.
+ * The first line the Task Manager sends is session <token>; the token is what
+ * resumes the session after the connection drops.
+ */
+typedef struct
+{
+	char name[NAME_LEN];
+	char host[NAME_LEN]; // unix:<path> for unix sockets
+	char port[8];
+	int fd;
+	int state;
+	struct addrinfo* addrs;
+	struct addrinfo* next_addr;
+	char token[TOKEN_LEN + 1];
+	int greeted; // TRUE once the session line has been read
+	char greeting[NAME_LEN];
+	int greeting_len;
+	int mid_frame; // TRUE once the start of the frame being read is in
+	int unsolicited; // the frame being read isn't a reply
+	char reply[MAX_REPLY]; // reply to the group cmd in progress
+	int reply_len;
+	int waiting; // TRUE while part of a group cmd that hasn't replied yet
+	int put_fd; // file offered by put, until the TM says whether to send it; -1 if none
+} session;
+
+typedef struct
+{
+	char name[NAME_LEN];
+	char members[MAX_SESSIONS][NAME_LEN];
+	int count;
+} group;
+
 void printify(const char* str, ...);
+void handle_line(char* line);
+void open_session(char* host, char* port, char* name);
+void connect_session(session* s);
+void send_greeting(session* s);
+void read_greeting(session* s, char c);
+int connect_unix(char* path);
+void try_next_addr(session* s);
+void finish_connect(session* s);
+void read_session(session* s);
+void send_line(session* s, char* line);
+int write_frame(int fd, char* line);
+int start_put(int fd, char* file, char* name);
+int send_put(int fd, int file);
+int put_answer(char* buff, int len, int sock, int* file);
+void content_key(const uint8_t* data, uint64_t len, char* key);
+void sha256(const uint8_t* data, uint64_t len, uint8_t* digest);
+void sha256_block(uint32_t* h, const uint8_t* p);
+int run_script(char* target, char* file);
+int connect_target(char* target);
+int script_reply(char* reply, int len, char** sent, int* head, int* in_flight);
+void close_session(session* s, int tell_tm);
+void detach_session(session* s);
+session* find_session(char* name);
+void list_sessions();
+void define_group(char* name);
+void group_cmd(char* target, char* cmd);
+void finish_group_cmd();
+void start_ping(char* count);
+void send_ping();
+void ping_reply(session* s);
+void finish_ping();
+void report_hop(char* hop, long long* ns, int n);
+int compare_ns(const void* a, const void* b);
+long now_ms();
+long long now_ns();
 void lower(char* str);
-void disconnect();
 void exit_gracefully();
 void exit_handler(int signo);
-void sig_conn_closed_handler();
 
-int sock;
-int connection_open = FALSE;
+session sessions[MAX_SESSIONS];
+session* current = NULL; // where commands without an @<target> go
+session* last_output = NULL; // whose output was printed last
+group groups[MAX_GROUPS];
+int group_count = 0;
+session* targets[MAX_SESSIONS]; // members of the group cmd in progress
+int target_count = 0;
+int targets_waiting = 0;
+long group_deadline;
+session* pinging = NULL; // the session of the ping in progress
+int ping_count;
+int ping_sent;
+long ping_deadline;
+long long ping_ns[HOPS][MAX_PINGS];
+int ping_got[HOPS];
 
 int main(int argc, char *argv[])
 {
+	char* target = NULL;
+	char* file = NULL;
+	int opt, bad = FALSE;
+	while ((opt = getopt(argc, argv, "s:f:")) != -1)
+	{
+		if (opt == 's')
+			target = optarg;
+		else if (opt == 'f')
+			file = optarg;
+		else
+			bad = TRUE;
+	}
+	if (bad || (file && !target) || optind < argc)
+	{
+		fprintf(stderr, "Usage: %s [-s <host>:<port> | unix:<path> [-f <command-file>]]\n", argv[0]);
+		return 2;
+	}
+	if (target)
+	{
+		signal(SIGPIPE, SIG_IGN);
+		return run_script(target, file);
+	}
 	if (signal(SIGINT, exit_handler) == SIG_ERR)
 	{
 		perror("signal: SIGINT");
@@ -48,148 +196,1141 @@ int main(int argc, char *argv[])
 		perror("signal: SIGTERM");
 		return -1;
 	}
-	struct sockaddr_in server;
-	struct hostent *hp;
-	server.sin_family = AF_INET;
+	signal(SIGPIPE, SIG_IGN);
+	int i;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		sessions[i].state = CLOSED;
+		sessions[i].fd = -1;
+		sessions[i].put_fd = -1;
+	}
 
+	printify("");
+	char pending[2 * BUFF_SIZE]; // stdin input not yet terminated by a newline
+	int pending_len = 0;
 	while(TRUE)
 	{
-		printify("");
-		char input[BUFF_SIZE];
-		int c;
-		if ((c = read(STDIN_FILENO, input, BUFF_SIZE)) < 0)
+		struct pollfd fds[MAX_SESSIONS + 1];
+		session* owners[MAX_SESSIONS + 1];
+		int nfds = 0;
+		fds[nfds].fd = STDIN_FILENO;
+		fds[nfds].events = POLLIN;
+		owners[nfds++] = NULL;
+		for (i = 0; i < MAX_SESSIONS; i++)
 		{
-			perror("Reading from stdin");
+			if (sessions[i].state == CLOSED || sessions[i].state == DETACHED)
+				continue;
+			fds[nfds].fd = sessions[i].fd;
+			fds[nfds].events = (sessions[i].state == CONNECTING) ? POLLOUT : POLLIN;
+			owners[nfds++] = &sessions[i];
 		}
-		if (c == 1)
-			continue;
-		input[c-1] = '\0';
-		lower(input);
-		char* cmd = strtok(input, " ");
-		if (!strcmp(cmd, "conn") || !strcmp(cmd, "connect"))
-		{
-			char* host = strtok(NULL, " ");
-			char* port = strtok(NULL, " ");
-			if (!(host && port))
+		int timeout = -1;
+		long deadline = targets_waiting ? group_deadline:-1;
+		if (pinging && (deadline == -1 || ping_deadline < deadline))
+			deadline = ping_deadline;
+		if (deadline != -1)
+		{
+			timeout = deadline - now_ms();
+			if (timeout < 0)
+				timeout = 0;
+		}
+
+		int r;
+		if ((r = poll(fds, nfds, timeout)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit_gracefully();
+		}
+		for (i = 1; i < nfds; i++)
+		{
+			if (!fds[i].revents || owners[i]->state == CLOSED || owners[i]->state == DETACHED)
+				continue;
+			if (owners[i]->state == CONNECTING)
+				finish_connect(owners[i]);
+			else
+				read_session(owners[i]);
+		}
+		if (targets_waiting && now_ms() >= group_deadline)
+		{
+			finish_group_cmd();
+		}
+		if (pinging && now_ms() >= ping_deadline)
+		{
+			printify("(no echo within %d ms)\n", PING_TIMEOUT);
+			finish_ping();
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP))
+		{
+			if ((r = read(STDIN_FILENO, pending + pending_len, BUFF_SIZE)) < 0)
 			{
-				printify("Usage: conn[ect] <host> <port>\n");
+				perror("Reading from stdin");
 				continue;
 			}
-			hp = gethostbyname(host);
-			if (!hp) 
+			if (r == 0)
+				exit_gracefully();
+			pending_len += r;
+			// handle every complete line; keep the rest for the next read
+			char* start = pending;
+			char* nl;
+			while ((nl = memchr(start, '\n', pending_len - (start - pending))))
 			{
-				printify("%s: unknown host\n", argv[1]);
-				continue;
+				*nl = '\0';
+				handle_line(start);
+				start = nl + 1;
 			}
-			bcopy(hp->h_addr, &server.sin_addr, hp->h_length);
-			server.sin_port = htons(atoi(port));
+			pending_len -= start - pending;
+			memmove(pending, start, pending_len);
+			if (pending_len >= BUFF_SIZE)
+			{
+				printify("Command too long.\n");
+				pending_len = 0;
+			}
+		}
+	}
+}
+
+/*
+ * Handles one line typed by the user. Client commands are handled here;
+ * @<target> <cmd> goes to a session or group; anything else goes to the
+ * current session.
+ */
+void handle_line(char* line)
+{
+	if (strlen(line) >= BUFF_SIZE)
+	{
+		printify("Command too long.\n");
+		return;
+	}
+	char copy[BUFF_SIZE];
+	strcpy(copy, line);
+	char* name;
+	// only the command is case-insensitive; hosts, names and paths are not
+	char* cmd = strtok(copy, " ");
+	if (!cmd)
+		return;
+	lower(cmd);
+	if (!strcmp(cmd, "conn") || !strcmp(cmd, "connect"))
+	{
+		char* host = strtok(NULL, " ");
+		char* port = NULL;
+		if (host && strncmp(host, "unix:", 5))
+			port = strtok(NULL, " ");
+		char* as = strtok(NULL, " ");
+		name = strtok(NULL, " ");
+		if (!host || (strncmp(host, "unix:", 5) && !port) || (as && (strcmp(as, "as") || !name)))
+		{
+			printify("Usage: conn[ect] <host> <port> | unix:<path> [as <name>]\n");
+			return;
+		}
+		open_session(host, port, name);
+	}
+	else if (!strcmp(cmd, "q") || !strcmp(cmd, "ex") || !strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
+	{
+		exit_gracefully();
+	}
+	else if (!strcmp(cmd, "sessions"))
+	{
+		list_sessions();
+	}
+	else if (!strcmp(cmd, "use"))
+	{
+		name = strtok(NULL, " ");
+		session* s = name ? find_session(name) : NULL;
+		if (!s)
+		{
+			printify("Usage: use <session>\n");
+			return;
+		}
+		current = s;
+	}
+	else if (!strcmp(cmd, "group"))
+	{
+		name = strtok(NULL, " ");
+		if (!name)
+		{
+			printify("Usage: group <name> [<session> …]\n");
+			return;
+		}
+		define_group(name);
+	}
+	else if (!strcmp(cmd, "disconnect") || !strcmp(cmd, "reattach"))
+	{
+		name = strtok(NULL, " ");
+		session* s = name ? find_session(name):current;
+		if (!s)
+		{
+			printify(name ? "%s: no such session\n":"Not connected.\n", name);
+			return;
+		}
+		if (!strcmp(cmd, "reattach"))
+		{
+			// also for a connection that looks fine, but isn't
+			if (s->state != CONNECTING)
+				detach_session(s);
+			connect_session(s);
+			return;
+		}
+		printify("Disconnected from %s.\n", s->name);
+		close_session(s, TRUE);
+	}
+	else if (!strcmp(cmd, "ping"))
+	{
+		start_ping(strtok(NULL, " "));
+	}
+	else if (pinging && pinging == current)
+	{
+		printify("Still pinging %s.\n", current->name);
+	}
+	else if (!strcmp(cmd, "put") && current && current->state == OPEN && current->put_fd == -1)
+	{
+		char* file = strtok(NULL, " ");
+		name = strtok(NULL, " ");
+		if (!file || strtok(NULL, " "))
+		{
+			printify("Usage: put <local-file> [<name>]\n");
+			return;
+		}
+		current->put_fd = start_put(current->fd, file, name);
+	}
+	else if (cmd[0] == '@')
+	{
+		char* rest = strtok(NULL, "");
+		if (!cmd[1] || !rest)
+		{
+			printify("Usage: @<session> | @<group> | @all <command>\n");
+			return;
+		}
+		// hand over the command as typed, apart from the target
+		group_cmd(cmd + 1, line + (rest - copy));
+	}
+	else if (current && current->state == OPEN)
+	{
+		send_line(current, line);
+	}
+	else if (current && current->state == CONNECTING)
+	{
+		printify("Still connecting to %s.\n", current->name);
+	}
+	else if (current && current->state == DETACHED)
+	{
+		printify("Not connected to %s; reattach %s to resume.\n", current->name, current->name);
+	}
+	else
+	{
+		printify("Not connected.\n");
+	}
+}
+
+/*
+ * Starts connecting to host:port (or to unix:<path>) without waiting for the
+ * connection to complete. Both IPv4 and IPv6 addresses are tried.
+ */
+void open_session(char* host, char* port, char* name)
+{
+	char default_name[NAME_LEN];
+	if (!name)
+	{
+		if (port)
+			snprintf(default_name, NAME_LEN, "%s:%s", host, port);
+		else
+			snprintf(default_name, NAME_LEN, "%s", host);
+		name = default_name;
+	}
+	session* s = find_session(name);
+	if (s && s->state == DETACHED)
+	{
+		connect_session(s);
+		return;
+	}
+	if (s || !strcmp(name, "all"))
+	{
+		printify("%s: session name in use\n", name);
+		return;
+	}
+	int i;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		if (sessions[i].state == CLOSED)
+		{
+			s = &sessions[i];
+			break;
+		}
+	}
+	if (!s)
+	{
+		printify("Too many sessions.\n");
+		return;
+	}
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	snprintf(s->host, sizeof(s->host), "%s", host);
+	snprintf(s->port, sizeof(s->port), "%s", port ? port:"");
+	s->waiting = FALSE;
+	s->addrs = s->next_addr = NULL;
+	s->token[0] = '\0';
+	connect_session(s);
+}
+
+/*
+ * (Re)connects a session to its server. A session with a token asks to resume
+ * it, which takes no more than the one round trip a new session does.
+ */
+void connect_session(session* s)
+{
+	s->greeted = FALSE;
+	s->greeting_len = 0;
+	s->mid_frame = FALSE;
+	if (!s->port[0])
+	{
+		if ((s->fd = connect_unix(s->host + 5)) < 0)
+			return;
+		s->state = OPEN;
+		current = s;
+		printify("Connected to %s.\n", s->name);
+		send_greeting(s);
+		return;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int e = getaddrinfo(s->host, s->port, &hints, &s->addrs);
+	if (e)
+	{
+		printify("%s: %s\n", s->host, gai_strerror(e));
+		return;
+	}
+	s->next_addr = s->addrs;
+	s->state = CONNECTING;
+	current = s;
+	try_next_addr(s);
+}
+
+void send_greeting(session* s)
+{
+	char greeting[BUFF_SIZE];
+	if (s->token[0])
+		snprintf(greeting, BUFF_SIZE, "attach %s", s->token);
+	else
+		strcpy(greeting, "hello");
+	send_line(s, greeting);
+}
 
-			if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) 
+/*
+ * Takes in the session line a character at a time.
+ */
+void read_greeting(session* s, char c)
+{
+	if (c != '\n')
+	{
+		if (s->greeting_len < NAME_LEN - 1)
+			s->greeting[s->greeting_len++] = c;
+		return;
+	}
+	s->greeting[s->greeting_len] = '\0';
+	s->greeted = TRUE;
+	char token[NAME_LEN];
+	char resumed[NAME_LEN] = "";
+	if (sscanf(s->greeting, "session %63s %63s", token, resumed) < 1)
+		return;
+	if (s->token[0] && !strcmp(resumed, "resumed"))
+		printify("Resumed session on %s.\n", s->name);
+	else if (s->token[0])
+		printify("Session on %s is gone; started a new one.\n", s->name);
+	strncpy(s->token, token, TOKEN_LEN);
+	s->token[TOKEN_LEN] = '\0';
+}
+
+/*
+ * Connects to a server listening on a unix domain socket on this host.
+ * Returns the socket, or -1 on failure.
+ */
+int connect_unix(char* path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		printify("Unix socket path too long.\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int usock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (usock < 0)
+	{
+		perror("opening unix socket");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(usock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		perror("connecting unix socket");
+		close(usock);
+		return -1;
+	}
+	return usock;
+}
+
+/*
+ * Starts a non-blocking connect to the next address of the session,
+ * skipping addresses that fail straight away. Closes the session once
+ * all of them have failed.
+ */
+void try_next_addr(session* s)
+{
+	for (; s->next_addr; s->next_addr = s->next_addr->ai_next)
+	{
+		struct addrinfo* a = s->next_addr;
+		if ((s->fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK, a->ai_protocol)) < 0)
+			continue;
+		if (connect(s->fd, a->ai_addr, a->ai_addrlen) == 0)
+		{
+			finish_connect(s);
+			return;
+		}
+		if (errno == EINPROGRESS)
+			return; // poll reports writability when it completes
+		close(s->fd);
+	}
+	printify("%s: connection failed\n", s->name);
+	if (s->token[0])
+		detach_session(s);
+	else
+		close_session(s, FALSE);
+}
+
+/*
+ * Called once the pending connect of the session completes.
+ */
+void finish_connect(session* s)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+	{
+		close(s->fd);
+		s->next_addr = s->next_addr->ai_next;
+		try_next_addr(s);
+		return;
+	}
+	// reads and writes are small; keep them simple
+	fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_NONBLOCK);
+	freeaddrinfo(s->addrs);
+	s->addrs = s->next_addr = NULL;
+	s->state = OPEN;
+	printify("Connected to %s.\n", s->name);
+	send_greeting(s);
+}
+
+/*
+ * Reads output from the Task Manager of the session. Replies to a group cmd
+ * are held back until the whole group has replied; anything else, such as
+ * frames marked UNSOLICITED, is printed right away, under the name of the
+ * session when more than one is open.
+ */
+void read_session(session* s)
+{
+	char buff[BUFF_SIZE];
+	int r;
+	if ((r = read(s->fd, buff, BUFF_SIZE)) < 0 && errno == EINTR)
+		return;
+	if (r <= 0)
+	{
+		if (s->token[0])
+		{
+			printify("Lost connection to %s; reattach %s to resume.\n", s->name, s->name);
+			detach_session(s);
+		}
+		else
+		{
+			printify("Disconnected from %s.\n", s->name);
+			close_session(s, FALSE);
+		}
+		return;
+	}
+	int start = 0;
+	while (start < r && !s->greeted)
+		read_greeting(s, buff[start++]);
+	if (s->put_fd != -1)
+		r = start + put_answer(buff + start, r - start, s->fd, &s->put_fd);
+	while (start < r)
+	{
+		if (!s->mid_frame)
+		{
+			s->mid_frame = TRUE;
+			s->unsolicited = (buff[start] == UNSOLICITED || buff[start] == RESTARTED);
+			start += s->unsolicited;
+			continue;
+		}
+		char* end = memchr(buff + start, END_OF_RESULT, r - start);
+		int len = (end ? end - buff : r) - start;
+		if (len > 0 && buff[start + len - 1] == FAILED_RESULT)
+			len--; // what failed says so itself
+		if (s == pinging && !s->unsolicited)
+		{
+			if (len > MAX_REPLY - 1 - s->reply_len)
+				len = MAX_REPLY - 1 - s->reply_len;
+			memcpy(s->reply + s->reply_len, buff + start, len);
+			s->reply_len += len;
+			if (end)
+				ping_reply(s);
+		}
+		else if (s->waiting && !s->unsolicited)
+		{
+			if (len > MAX_REPLY - s->reply_len)
+				len = MAX_REPLY - s->reply_len;
+			memcpy(s->reply + s->reply_len, buff + start, len);
+			s->reply_len += len;
+			if (end)
 			{
-				perror("opening stream socket");
-				exit(EXIT_FAILURE);
+				s->waiting = FALSE;
+				if (--targets_waiting == 0)
+					finish_group_cmd();
 			}
-			if (connect(sock, (struct sockaddr *) &server, sizeof(server)) < 0) 
+		}
+		else if (len > 0)
+		{
+			int open = 0, i;
+			for (i = 0; i < MAX_SESSIONS; i++)
+				open += (sessions[i].state == OPEN);
+			if (open > 1 && last_output != s)
+				printify("[%s]\n", s->name);
+			last_output = s;
+			if (write(STDOUT_FILENO, buff + start, len) < 0)
+				perror("stdout write");
+		}
+		if (end)
+			s->mid_frame = FALSE;
+		start = end ? (end - buff) + 1 : r;
+	}
+}
+
+/*
+ * Sends one command to the Task Manager of the session, header and all in
+ * a single write.
+ */
+void send_line(session* s, char* line)
+{
+	if (s->put_fd != -1)
+	{
+		printify("Still putting a file to %s.\n", s->name);
+		return;
+	}
+	if (write_frame(s->fd, line) < 0)
+	{
+		perror("Writing to socket");
+		printify("Failed to send command to %s.\n", s->name);
+	}
+}
+
+int write_frame(int fd, char* line)
+{
+	char frame[LENGTH_BYTES + BUFF_SIZE];
+	int len = strlen(line) + 1;
+	frame[0] = len;
+	memcpy(frame + LENGTH_BYTES, line, len);
+	return write(fd, frame, LENGTH_BYTES + len);
+}
+
+/*
+ * Offers the file to the Task Manager on fd as put <key> <size> <name>, the
+ * name defaulting to the file's. Returns the open file, for send_put() once
+ * the TM asks for it, or -1 if it couldn't be offered.
+ */
+int start_put(int fd, char* file, char* name)
+{
+	int f = open(file, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (f < 0 || fstat(f, &st) < 0)
+	{
+		perror(file);
+		if (f >= 0)
+			close(f);
+		return -1;
+	}
+	uint8_t* data = NULL;
+	if (st.st_size && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0)) == MAP_FAILED)
+	{
+		perror(file);
+		close(f);
+		return -1;
+	}
+	char key[UPLOAD_KEY_LEN + 1];
+	content_key(data, st.st_size, key);
+	if (data)
+		munmap(data, st.st_size);
+	char line[BUFF_SIZE];
+	if (snprintf(line, BUFF_SIZE, "put %s %lld %s", key, (long long) st.st_size, name ? name:basename(file)) >= BUFF_SIZE)
+	{
+		fprintf(stderr, "%s: name too long\n", file);
+		close(f);
+		return -1;
+	}
+	if (write_frame(fd, line) < 0)
+	{
+		perror("Writing to socket");
+		close(f);
+		return -1;
+	}
+	return f;
+}
+
+/*
+ * Sends the file offered by start_put() straight from the page cache, and
+ * closes it. Returns 0 if all of it went out, -1 otherwise.
+ */
+int send_put(int fd, int file)
+{
+	struct stat st;
+	off_t offset = 0;
+	int ok = (fstat(file, &st) == 0);
+	while (ok && offset < st.st_size)
+	{
+		ssize_t w = sendfile(fd, file, &offset, st.st_size - offset);
+		if (w < 0 && errno == EINTR)
+			continue;
+		ok = (w > 0);
+	}
+	if (!ok)
+		perror("put: sendfile");
+	close(file);
+	return ok ? 0:-1;
+}
+
+/*
+ * Looks for the Task Manager's answer to a put in what it sent, and sends the
+ * file if asked to. Takes the answer out of buff, and returns the length left.
+ */
+int put_answer(char* buff, int len, int sock, int* file)
+{
+	int i;
+	for (i = 0; i < len && buff[i] != UPLOAD_READY && buff[i] != UPLOAD_SKIP; i++);
+	if (i == len)
+		return len;
+	if (buff[i] == UPLOAD_READY)
+		send_put(sock, *file);
+	else
+		close(*file);
+	*file = -1;
+	memmove(buff + i, buff + i + 1, len - i - 1);
+	return len - 1;
+}
+
+/*
+ * Script mode: runs the commands in file (or stdin), one per line, in a new
+ * session on target. Up to SCRIPT_WINDOW commands are sent ahead of their
+ * replies; replies come back in order, so each is matched to the oldest
+ * command still waiting, and printed after it. Blank lines and lines starting
+ * with # are skipped. Returns the exit status: 0 if every command worked, 1 if
+ * any failed, 2 if the session couldn't be set up or was lost.
+ */
+int run_script(char* target, char* file)
+{
+	FILE* in = file ? fopen(file, "r") : stdin;
+	if (!in)
+	{
+		perror(file);
+		return 2;
+	}
+	int fd = connect_target(target);
+	if (fd < 0 || write_frame(fd, "hello") < 0)
+		return 2;
+	char* sent[SCRIPT_WINDOW]; // cmds waiting for replies, oldest at head
+	int head = 0, in_flight = 0;
+	int failures = 0, greeted = FALSE, eof = FALSE;
+	char* line = NULL;
+	size_t line_size = 0;
+	char* reply = NULL;
+	int reply_len = 0, reply_size = 0;
+	int put_fd = -1; // the file a put is waiting to send; nothing else goes out meanwhile
+	while (!eof || in_flight || !greeted)
+	{
+		while (greeted && !eof && in_flight < SCRIPT_WINDOW && put_fd == -1)
+		{
+			ssize_t n = getline(&line, &line_size, in);
+			if (n < 0)
 			{
-				perror("connecting stream socket");
+				eof = TRUE;
+				break;
+			}
+			while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+				line[--n] = '\0';
+			char* cmd = line + strspn(line, " \t");
+			if (!*cmd || *cmd == '#')
+				continue;
+			if (strlen(cmd) >= BUFF_SIZE)
+			{
+				fprintf(stderr, "Command too long: %.20s...\n", cmd);
+				failures++;
 				continue;
 			}
-			connection_open = TRUE;
-			printify("Connected.\n");
-
-			struct pollfd rfds[2];
-			rfds[0].fd = STDIN_FILENO;
-			rfds[0].events = POLLIN;
-			rfds[1].fd = sock;
-			rfds[1].events = POLLIN;
-			while(connection_open)
+			if (!strcmp(cmd, "exit") || !strcmp(cmd, "quit") || !strcmp(cmd, "q") || !strcmp(cmd, "ex"))
 			{
-				// printify("client waiting for input\n");
-				int r, w;    
-				if ((r = poll(rfds, 2, -1)) < 0)
-				{
-					if (errno == EINTR)
-						continue;
-					else
-					{
-						perror("poll");
-						exit_gracefully();
-					}
-				}
-				if (rfds[1].revents & POLLIN)
-				{
-					// printify("sock input detected\n");
-					char buff[BUFF_SIZE];
-					if ((r = read(sock, buff, BUFF_SIZE)) < 0)
-					{
-						perror("sock read");
-						continue;
-					}
-					if (r == 0)
-					{
-						// printify("Socket closed.\n");
-						connection_open = FALSE;
-						// raise(SIG_CONN_CLOSED);
-						break;
-					}
-					if (write(STDOUT_FILENO, buff, r) < 0)
-					{
-						perror("stdout write");
-						continue;
-					}
-				}
-				else if (rfds[0].revents & POLLIN)
+				eof = TRUE;
+				break;
+			}
+			if (!strncmp(cmd, "put ", 4))
+			{
+				char copy[BUFF_SIZE];
+				strcpy(copy, cmd);
+				strtok(copy, " ");
+				char* file = strtok(NULL, " ");
+				char* name = strtok(NULL, " ");
+				if (!file || strtok(NULL, " ") || (put_fd = start_put(fd, file, name)) < 0)
 				{
-					// printify("stdin input detected\n");
-					char buff[BUFF_SIZE];
-					if ((r = read(STDIN_FILENO, buff, BUFF_SIZE)) < 0)
-					{
-						perror("stdin read");
-						continue;
-					}
-					buff[r-1] = '\0';
-					char tmp[BUFF_SIZE];
-					sscanf(buff, "%s", tmp);
-					lower(tmp);
-					if (!strcmp(tmp, "q") || !strcmp(tmp, "ex") || !strcmp(tmp, "quit") || !strcmp(tmp, "exit"))
-					{
-						printify("exit cmd detected\n");
-						exit_gracefully();
-					}
-					if ((w = write(sock, &r, LENGTH_BYTES)) < 0)
-					{
-						perror("Writing to socket");
-						printify("Failed to send command size.\n");
-						continue;
-					}
-					// printify("sent cmd length %d\n", r);
-					if ((w = write(sock, buff, r)) < 0)
-					{
-						perror("Writing to socket");
-						printify("Failed to send command.\n");
-					}
-					if (w == 0)
-					{
-						printify("Zero write.\n");
-						break;
-					}
-					// printify("sent cmd %s\n", buff);
+					fprintf(stderr, "Failed: %s\n", cmd);
+					failures++;
+					continue;
 				}
 			}
-			disconnect();
+			else if (write_frame(fd, cmd) < 0)
+			{
+				perror("Writing to socket");
+				return 2;
+			}
+			sent[(head + in_flight++) % SCRIPT_WINDOW] = strdup(cmd);
 		}
-		else
+		if (greeted && eof && !in_flight)
+			break;
+		char buff[4096];
+		int r = read(fd, buff, sizeof(buff));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
 		{
-			printify("Unknown command.\n");
+			fprintf(stderr, "Lost connection to %s with %d commands unanswered.\n", target, in_flight);
+			return 2;
+		}
+		if (put_fd != -1)
+			r = put_answer(buff, r, fd, &put_fd);
+		int i;
+		for (i = 0; i < r; i++)
+		{
+			if (reply_len == reply_size)
+			{
+				reply_size = reply_size ? 2 * reply_size : 4096;
+				reply = realloc(reply, reply_size);
+			}
+			if (buff[i] != END_OF_RESULT)
+			{
+				reply[reply_len++] = buff[i];
+				continue;
+			}
+			if (!greeted)
+				greeted = TRUE; // session <token>; nothing to resume in a script
+			else
+				failures += script_reply(reply, reply_len, sent, &head, &in_flight);
+			reply_len = 0;
 		}
 	}
+	write_frame(fd, "exit");
+	close(fd);
+	free(line);
+	free(reply);
+	if (in != stdin)
+		fclose(in);
+	return failures ? 1 : 0;
 }
 
-void disconnect()
+/*
+ * Prints a reply under the cmd it answers. Output nobody asked for (watch
+ * events, broadcasts), marked UNSOLICITED, is printed as is. Returns how many
+ * cmds failed.
+ */
+int script_reply(char* reply, int len, char** sent, int* head, int* in_flight)
 {
-	printify("Disconnected.\n");
-	shutdown(sock, SHUT_RDWR);
-	close(sock);
+	int failed = (len > 0 && reply[len - 1] == FAILED_RESULT);
+	if (failed)
+		len--;
+	if (len > 0 && reply[0] == UNSOLICITED)
+	{
+		fwrite(reply + 1, 1, len - 1, stdout);
+		return 0;
+	}
+	if (len > 0 && reply[0] == RESTARTED)
+	{
+		// restarted after a crash: whatever was in flight is lost
+		fwrite(reply + 1, 1, len - 1, stderr);
+		failed = *in_flight;
+		while (*in_flight)
+		{
+			free(sent[*head]);
+			*head = (*head + 1) % SCRIPT_WINDOW;
+			(*in_flight)--;
+		}
+		return failed;
+	}
+	if (!*in_flight)
+	{
+		fwrite(reply, 1, len, stdout);
+		return 0;
+	}
+	char* cmd = sent[*head];
+	*head = (*head + 1) % SCRIPT_WINDOW;
+	(*in_flight)--;
+	printf("> %s\n", cmd);
+	fwrite(reply, 1, len, stdout);
+	fflush(stdout);
+	if (failed)
+		fprintf(stderr, "Failed: %s\n", cmd);
+	free(cmd);
+	return failed;
+}
+
+/*
+ * Connects to <host>:<port> or unix:<path>, blocking. The port is after the
+ * last colon, so IPv6 addresses work, with or without brackets.
+ */
+int connect_target(char* target)
+{
+	if (!strncmp(target, "unix:", 5))
+		return connect_unix(target + 5);
+	char host[NAME_LEN];
+	char* colon = strrchr(target, ':');
+	if (!colon || colon - target >= NAME_LEN)
+	{
+		fprintf(stderr, "%s: expected <host>:<port>\n", target);
+		return -1;
+	}
+	snprintf(host, NAME_LEN, "%.*s", (int) (colon - target), target);
+	char* h = host;
+	if (h[0] == '[' && h[strlen(h) - 1] == ']')
+	{
+		h[strlen(h) - 1] = '\0';
+		h++;
+	}
+	struct addrinfo hints;
+	struct addrinfo* addrs;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int e = getaddrinfo(h, colon + 1, &hints, &addrs);
+	if (e)
+	{
+		fprintf(stderr, "%s: %s\n", h, gai_strerror(e));
+		return -1;
+	}
+	int fd = -1;
+	struct addrinfo* a;
+	for (a = addrs; a && fd < 0; a = a->ai_next)
+	{
+		if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) < 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (fd < 0)
+		fprintf(stderr, "%s: connection failed\n", target);
+	return fd;
+}
+
+void close_session(session* s, int tell_tm)
+{
+	// in the middle of a put, the TM would take it for the file
+	if (s->state == OPEN && tell_tm && s->put_fd == -1)
+		send_line(s, "exit");
+	detach_session(s);
+	s->state = CLOSED;
+	s->token[0] = '\0';
+	if (current == s)
+		current = NULL;
+}
+
+/*
+ * Closes the connection, but keeps what it takes to resume the session.
+ */
+void detach_session(session* s)
+{
+	if (s->fd >= 0)
+	{
+		shutdown(s->fd, SHUT_RDWR);
+		close(s->fd);
+	}
+	if (s->addrs)
+		freeaddrinfo(s->addrs);
+	s->addrs = s->next_addr = NULL;
+	s->fd = -1;
+	s->state = DETACHED;
+	if (s->put_fd != -1)
+		close(s->put_fd);
+	s->put_fd = -1;
+	if (pinging == s)
+		finish_ping();
+	if (s->waiting)
+	{
+		s->waiting = FALSE;
+		if (--targets_waiting == 0)
+			finish_group_cmd();
+	}
+	if (last_output == s)
+		last_output = NULL;
+}
+
+session* find_session(char* name)
+{
+	int i;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		if (sessions[i].state != CLOSED && !strcmp(sessions[i].name, name))
+			return &sessions[i];
+	}
+	return NULL;
+}
+
+void list_sessions()
+{
+	int i, g, m;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		session* s = &sessions[i];
+		if (s->state == CLOSED)
+			continue;
+		char in_groups[BUFF_SIZE] = "";
+		for (g = 0; g < group_count; g++)
+		{
+			for (m = 0; m < groups[g].count; m++)
+			{
+				if (!strcmp(groups[g].members[m], s->name))
+				{
+					int n = strlen(in_groups);
+					snprintf(in_groups + n, BUFF_SIZE - n, "%s%s", n ? "," : "", groups[g].name);
+				}
+			}
+		}
+		printify("%c %-24s %-10s %s\n", (s == current) ? '*' : ' ', s->name,
+			(s->state == OPEN) ? "open" : (s->state == CONNECTING) ? "connecting" : "detached", in_groups);
+	}
+}
+
+/*
+ * group <name> <session> … sets the members of the group; group <name>
+ * on its own removes it. Members are kept by name, so a session that is
+ * reconnected under the same name stays in its groups.
+ */
+void define_group(char* name)
+{
+	int g;
+	for (g = 0; g < group_count; g++)
+	{
+		if (!strcmp(groups[g].name, name))
+			break;
+	}
+	if (g == group_count && group_count == MAX_GROUPS)
+	{
+		printify("Too many groups.\n");
+		return;
+	}
+	if (g == group_count)
+	{
+		strncpy(groups[g].name, name, NAME_LEN - 1);
+		groups[g].name[NAME_LEN - 1] = '\0';
+		group_count++;
+	}
+	groups[g].count = 0;
+	char* member;
+	while ((member = strtok(NULL, " ")) && groups[g].count < MAX_SESSIONS)
+	{
+		strncpy(groups[g].members[groups[g].count], member, NAME_LEN - 1);
+		groups[g].members[groups[g].count++][NAME_LEN - 1] = '\0';
+	}
+	if (groups[g].count == 0)
+	{
+		groups[g] = groups[--group_count];
+	}
+}
+
+/*
+ * Sends cmd to every open session in target (a group, a session, or all) at
+ * once. The replies are printed together, grouped by session, once all of
+ * them are in or GATHER_TIMEOUT has passed.
+ */
+void group_cmd(char* target, char* cmd)
+{
+	if (targets_waiting || pinging)
+	{
+		printify("Still waiting for replies to the previous command.\n");
+		return;
+	}
+	target_count = 0;
+	int i, g;
+	for (g = 0; g < group_count; g++)
+	{
+		if (!strcmp(groups[g].name, target))
+			break;
+	}
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		session* s = &sessions[i];
+		if (s->state != OPEN || !s->greeted)
+			continue;
+		int member = !strcmp(target, "all") || !strcmp(s->name, target);
+		int m;
+		for (m = 0; g < group_count && m < groups[g].count && !member; m++)
+			member = !strcmp(groups[g].members[m], s->name);
+		if (!member)
+			continue;
+		s->reply_len = 0;
+		s->waiting = TRUE;
+		targets[target_count++] = s;
+	}
+	if (target_count == 0)
+	{
+		printify("%s: no open sessions\n", target);
+		return;
+	}
+	targets_waiting = target_count;
+	group_deadline = now_ms() + GATHER_TIMEOUT;
+	for (i = 0; i < target_count; i++)
+	{
+		send_line(targets[i], cmd);
+	}
+}
+
+void finish_group_cmd()
+{
+	int i;
+	for (i = 0; i < target_count; i++)
+	{
+		session* s = targets[i];
+		printify("[%s]\n", s->name);
+		if (write(STDOUT_FILENO, s->reply, s->reply_len) < 0)
+			perror("stdout write");
+		if (s->waiting)
+			printify("(no reply within %d ms)\n", GATHER_TIMEOUT);
+		s->waiting = FALSE;
+	}
+	target_count = 0;
+	targets_waiting = 0;
+	last_output = NULL;
+}
+
+/*
+ * ping [count]: times count echoes from the TM of the current session, and as
+ * many by way of the server, and reports the round trips per hop.
+ */
+void start_ping(char* count)
+{
+	if (!current || current->state != OPEN || !current->greeted)
+	{
+		printify("Not connected.\n");
+		return;
+	}
+	if (pinging || targets_waiting)
+	{
+		printify("Still waiting for replies to the previous command.\n");
+		return;
+	}
+	ping_count = count ? atoi(count):10;
+	if (ping_count < 1 || ping_count > MAX_PINGS)
+	{
+		printify("Usage: ping [<count>] (1 - %d)\n", MAX_PINGS);
+		return;
+	}
+	memset(ping_got, 0, sizeof(ping_got));
+	ping_sent = 0;
+	pinging = current;
+	send_ping();
+}
+
+/*
+ * Sends the next echo, stamped with when it was sent: even ones come straight
+ * back from the TM, odd ones by way of the server.
+ */
+void send_ping()
+{
+	char line[BUFF_SIZE];
+	snprintf(line, BUFF_SIZE, "echo %lld%s", now_ns(), (ping_sent % 2) ? " server":"");
+	pinging->reply_len = 0;
+	ping_sent++;
+	ping_deadline = now_ms() + PING_TIMEOUT;
+	send_line(pinging, line);
+}
+
+/*
+ * Times the echo in s->reply, and sends the next one. Anything else (a TM
+ * that doesn't know echo) ends the ping.
+ */
+void ping_reply(session* s)
+{
+	long long now = now_ns();
+	long long stamp, to_sv, from_sv;
+	s->reply[s->reply_len] = '\0';
+	int n = sscanf(s->reply, "echo %lld %lld %lld", &stamp, &to_sv, &from_sv);
+	if (n != 1 && n != 3)
+	{
+		if (write(STDOUT_FILENO, s->reply, s->reply_len) < 0)
+			perror("stdout write");
+		finish_ping();
+		return;
+	}
+	if (n == 1)
+		ping_ns[HOP_TM][ping_got[HOP_TM]++] = now - stamp;
+	else
+	{
+		ping_ns[HOP_SV][ping_got[HOP_SV]++] = now - stamp;
+		ping_ns[HOP_TO_SV][ping_got[HOP_TO_SV]++] = to_sv;
+		ping_ns[HOP_FROM_SV][ping_got[HOP_FROM_SV]++] = from_sv;
+	}
+	if (ping_sent < 2 * ping_count)
+		send_ping();
+	else
+		finish_ping();
+}
+
+void finish_ping()
+{
+	session* s = pinging;
+	pinging = NULL;
+	s->reply_len = 0;
+	printify("ping %s: %d round trips; min / avg / p99 in ms\n", s->name, ping_got[HOP_TM]);
+	report_hop("client -> TM -> client", ping_ns[HOP_TM], ping_got[HOP_TM]);
+	report_hop("TM -> server", ping_ns[HOP_TO_SV], ping_got[HOP_TO_SV]);
+	report_hop("server -> TM", ping_ns[HOP_FROM_SV], ping_got[HOP_FROM_SV]);
+	report_hop("client -> server -> client", ping_ns[HOP_SV], ping_got[HOP_SV]);
+}
+
+void report_hop(char* hop, long long* ns, int n)
+{
+	if (n == 0)
+	{
+		printify("  %-26s -\n", hop);
+		return;
+	}
+	qsort(ns, n, sizeof(long long), compare_ns);
+	long long sum = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+	// the smallest that at least 99% of the round trips are within
+	long long p99 = ns[(n * 99 + 99) / 100 - 1];
+	printify("  %-26s %8.3f / %8.3f / %8.3f\n", hop, ns[0] / 1e6, sum / (n * 1e6), p99 / 1e6);
+}
+
+int compare_ns(const void* a, const void* b)
+{
+	long long x = *(const long long*) a, y = *(const long long*) b;
+	return (x > y) - (x < y);
+}
+
+long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 void printify(const char* str, ...)
@@ -200,7 +1341,10 @@ void printify(const char* str, ...)
 	va_start(args, str);
 
 	write(STDOUT_FILENO, PROMPT, sizeof(PROMPT));
-	if (write(STDOUT_FILENO, buff, vsprintf(buff, str, args)) == -1)
+	int len = vsnprintf(buff, BUFF_SIZE, str, args);
+	if (len >= BUFF_SIZE)
+		len = BUFF_SIZE - 1;
+	if (write(STDOUT_FILENO, buff, len) == -1)
 	{
 		perror("printify: write");
 	}
@@ -215,23 +1359,95 @@ void exit_gracefully()
 
 void exit_handler(int signo)
 {
-	int len = 4;
-	write(sock, &len, LENGTH_BYTES);
-	write(sock, "exit", 4);
-	shutdown(sock, SHUT_RDWR);
-	close(sock);
+	int i;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		if (sessions[i].state != CLOSED)
+			close_session(&sessions[i], TRUE);
+	}
 	printify("Exiting.\n");
 	exit(signo);
 }
 
+/*
+ * The cache key of the data: the first 128 bits of its SHA-256, in hex.
+ */
+void content_key(const uint8_t* data, uint64_t len, char* key)
+{
+	uint8_t digest[32];
+	sha256(data, len, digest);
+	int i;
+	for (i = 0; i < UPLOAD_KEY_LEN / 2; i++)
+		sprintf(key + 2 * i, "%02x", digest[i]);
+}
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+static const uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void sha256(const uint8_t* data, uint64_t len, uint8_t* digest)
+{
+	uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	uint64_t full = len & ~63ULL;
+	uint64_t i;
+	for (i = 0; i < full; i += 64)
+		sha256_block(h, data + i);
+	// the rest, a 1 bit, zeros, and the length in bits, to a whole block or two
+	uint8_t tail[128] = { 0 };
+	int rest = len - full;
+	if (rest)
+		memcpy(tail, data + full, rest);
+	tail[rest] = 0x80;
+	int padded = (rest < 56) ? 64:128;
+	int j;
+	for (j = 0; j < 8; j++)
+		tail[padded - 1 - j] = (len * 8) >> (8 * j);
+	sha256_block(h, tail);
+	if (padded == 128)
+		sha256_block(h, tail + 64);
+	for (j = 0; j < 32; j++)
+		digest[j] = h[j / 4] >> (24 - 8 * (j % 4));
+}
+
+void sha256_block(uint32_t* h, const uint8_t* p)
+{
+	uint32_t w[64];
+	int t;
+	for (t = 0; t < 16; t++)
+		w[t] = (uint32_t) p[4*t] << 24 | p[4*t+1] << 16 | p[4*t+2] << 8 | p[4*t+3];
+	for (t = 16; t < 64; t++)
+		w[t] = w[t-16] + (ROR(w[t-15], 7) ^ ROR(w[t-15], 18) ^ (w[t-15] >> 3)) +
+			w[t-7] + (ROR(w[t-2], 17) ^ ROR(w[t-2], 19) ^ (w[t-2] >> 10));
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+	for (t = 0; t < 64; t++)
+	{
+		uint32_t t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
 void lower(char* str)
 {
 	char* c;
 	for(c = str; *c; c++)
 		*c = tolower(*c);
 }
-
-void sig_conn_closed_handler()
-{
-	connection_open = FALSE;
-}
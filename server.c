@@ -7,15 +7,31 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h> // lstat
+#include <sys/resource.h> // getrlimit, setrlimit
+#include <sys/random.h>
 #include <sys/epoll.h>
-#include <sys/wait.h> // waitpid
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/wait.h> // waitpid, waitid
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h> // tolower
+#include <fnmatch.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #define TRUE 1
 #define FALSE 0
@@ -23,9 +39,11 @@
 #define READ_END 0
 #define WRITE_END 1
 #define EXEC_FAILED 'F'
+#define END_OF_RESULT '\0' // TM writes this after the result of each server cmd
 
 #define BUFF_SIZE 100
 #define LENGTH_BYTES 1
+#define MAX_FRAME 255 // largest length the header can hold
 
 // i/o multiplexing
 #define CL_IN           3 // sock
@@ -34,30 +52,87 @@
 #define SV_TO_TM_RESULT 6 // pipe
 #define TM_TO_SV_CMD    7 // pipe
 #define TM_TO_SV_RESULT 8 // pipe
+#define LOG_FD          9 // datagram socket, TMs' log records to the server
 
-#define MAX_CLIENTS 5
+// sessions at once. Each costs the server FDS_PER_CLIENT fds (the socket, the
+// ends of its TM's four pipes and its pidfd), so it takes fewer if the fd
+// limit doesn't leave room for this many.
+#define MAX_CLIENTS 4096
+#define FDS_PER_CLIENT 6
+#define RESERVED_FDS 64 // listening sockets, timers, the log, shards' epoll fds
+
+#define GATHER_TIMEOUT 2 // seconds
+#define REPLY_SIZE 8192
+
+// sessions: a client's first frame is either hello, for a new session, or
+// attach <token>, to resume one whose TM was kept running after the client went away
+#define TOKEN_LEN 16
+#define KEEPALIVE_IDLE 30 // seconds before a silent connection is probed
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 3
+#define STOP_TIMEOUT_MS 3000 // a TM gets this long after SIGTERM to stop its processes
+#define KILL_TIMEOUT_MS 1000 // and this long to go after SIGKILL
+#define GREETING_TIMEOUT_MS 10000 // a new connection's first frame has to be in by then
+
+// cmds from the TMs to the server (msg, echo, event, ...) are queued per
+// client and handled by deficit round-robin over the clients that have some:
+// each round, a client may have CMD_QUANTUM more bytes of them handled. On top
+// of that, each client has a token bucket of cmd_rate cmds a second, holding
+// up to a second's worth. A client out of either waits, and its pipe isn't
+// read meanwhile, so a TM flooding the server only fills its own pipe.
+#define CMD_QUEUE (4096 + LENGTH_BYTES + MAX_FRAME) // a read (URING_BUFF_SIZE), after part of a cmd
+#define CMD_QUANTUM (LENGTH_BYTES + MAX_FRAME) // any cmd fits in one round's worth
+#define CMD_RATE 1000 // cmds a second, per client, unless -q says otherwise
 
 
 #define VERTICAL_LINE "\u2502"
 #define HORIZONTAL_LINE "\u2500"
 
-typedef struct
+typedef struct task_manager
 {
 	pid_t pid;
+	int pidfd; // readable once the TM has exited
+	int reaped;
 	int cmd_from;
 	int result_from;
 	int cmd_to;
 	int result_to;
+	uint64_t kill_ns; // once it is being stopped: when it gets SIGKILL, 0 once it has
+	struct task_manager* next; // in its shard's list of TMs being stopped
 } task_manager;
 
 typedef struct
 {
-	task_manager* tm;
-	int msgsock;
+	task_manager* tm; // NULL until the client's first frame has been read
+	int msgsock; // -1 once the TM has the only copy
 	// in_addr_t ip;
 	char* ip_str;
 	int port;
-	struct sockaddr_in* info;
+	struct sockaddr_storage* info;
+	char* reply; // result of the cmd being gathered, NULL if not part of one
+	int reply_len;
+	int gather; // which gather the reply is for
+	int in_result; // part of a result has come in, the rest is still to come
+	int tagging; // reading the #<gather> tag the TM puts before a gather's result
+	int result_gather; // which gather the result coming in is for, 0 if none
+	int slot; // io_uring backend only
+	unsigned char frame[CMD_QUEUE]; // cmds read from the TM, not handled yet
+	int frame_len;
+	int busy; // has a whole cmd queued, and is in its shard's round
+	int deficit; // bytes of cmds it may still have handled this round
+	double tokens;
+	uint64_t refilled_ns;
+	uint64_t throttled_ns; // when its bucket ran dry, 0 if it hasn't
+	uint64_t unthrottle_ns; // when the bucket has a token again
+	int cmds; // handled
+	int throttles; // cmds that found its bucket dry
+	uint64_t throttled_total_ns; // time spent waiting for it to refill
+	char token[TOKEN_LEN + 1];
+	int parked; // TRUE while the TM is kept running without a client
+	int respawns;
+	char crash[64]; // why the TM last crashed
+	int gone; // removed, but events for it may still be queued
+	uint64_t greeting_deadline_ns;
 } client;
 
 typedef struct clnode
@@ -65,663 +140,3760 @@ typedef struct clnode
 	client* cl;
 	struct clnode* next;
 } clnode;
-static clnode* clist_head = NULL;
+// over all shards, so they are only changed atomically
 static int client_count = 0;
+static int greeting_count = 0; // connections that aren't in a session yet
+static int max_clients = MAX_CLIENTS;
+
+static int cmd_rate = CMD_RATE;
+
+// a TM that crashes (dies of a signal) is restarted this many times per client,
+// on the client's connection and with its session token
+static int max_respawns = 0;
+
+// -m: one TM process serves every client's session, rather than a TM per
+// client. A session is handed to it as the client's socket and the TM's end of
+// the usual pipes, over a control socket (cmd_to of shared_tm); the session
+// ends when the server closes its end of the pipes, or the TM closes its own.
+// Clients' task_managers have the shared TM's pid, and no pidfd.
+#define CONTROL_FD 3 // where the shared TM gets the control socket
+static int shared_mode = FALSE;
+static task_manager shared_tm = { .pid = -1, .pidfd = -1, .cmd_from = -1, .result_from = -1, .cmd_to = -1, .result_to = -1 };
+
+// cmd sent to several clients at once, whose results are printed together.
+// Kept by shard 0; the shards say which of their clients the cmd went to, and
+// pass each reply on as it completes.
+typedef struct
+{
+	client* cl; // on its shard; only compared, never followed here
+	char ip_str[INET_ADDRSTRLEN];
+	int port;
+	char* reply;
+	int reply_len;
+	int replied;
+} gather_target;
+static gather_target gather_targets[MAX_CLIENTS];
+static int gather_count = 0;
+static int gather_waiting = 0;
+static int gather_shards = 0; // yet to say which of their clients the cmd went to
+static int gather_active = FALSE;
+static char gather_selector[BUFF_SIZE];
+static int gather_timer = -1;
+static int gather_seq = 0; // tells gathers apart, in the trace and in messages
+
+// shard 0: connections still to send their first frame, newest first, and a
+// timerfd for the first of them to run out of time
+static clnode* greetings = NULL;
+static int greeting_timer = -1;
+
+// a console cmd that every shard answers (list, disconnect <ip>:<port>),
+// finished once all of them have
+static struct
+{
+	int type; // M_LIST or M_DISCONNECT
+	int seq;
+	int waiting; // shards yet to answer
+	int found;
+	char* rows;
+	int len;
+	char what[BUFF_SIZE];
+} query;
+
+// an always-on trace of what the event loop does: wakeups, cmds from the
+// console and from TMs, results read, cmds sent, TMs started and reaped.
+// Records go into a ring, with CLOCK_MONOTONIC stamps, and are only formatted
+// when the trace cmd or SIGUSR1 writes them out as Chrome trace JSON (for
+// chrome://tracing or Perfetto). TMs keep their own, on the same clock, so
+// the traces line up. Every shard writes to the ring, each on its own thread
+// of the trace; a record being written over as it's dumped may come out garbled.
+#define TRACE_RING 4096 // must be a power of 2
+#define TRACE_TEXT 18
+#define TR_WAKEUP 0 // arg: events ready
+#define TR_CONSOLE 1 // a span; text: the cmd
+#define TR_TM_CMD 2 // a span; text: the cmd, arg: the TM's pid
+#define TR_RESULT 3 // arg: bytes read from a TM's result pipe
+#define TR_SEND 4 // a cmd written to a TM; text: the cmd, arg: bytes
+#define TR_ACCEPT 5 // arg: the new socket
+#define TR_SPAWN 6 // a span, fork to exec of a TM; arg at the end: pid, or -1
+#define TR_REAP 7 // arg: the TM's pid
+#define TR_GATHER 8 // an async span, from sending a cmd to printing the results; arg: the gather
+#define TR_THROTTLE 9 // a client's token bucket ran dry; arg: its TM's pid
+typedef struct
+{
+	uint64_t ns;
+	int32_t arg;
+	char phase; // B(egin), E(nd), i(nstant), or b/e for async spans, as in Chrome's format
+	uint8_t type;
+	char text[TRACE_TEXT];
+	int32_t tid;
+} trace_record;
+static const char* trace_names[] = { "wakeup", "console", "tm cmd", "result", "send", "accept", "spawn", "reap", "gather", "throttle" };
+static trace_record traces[TRACE_RING];
+static uint64_t trace_head = 0; // records ever claimed
+static volatile sig_atomic_t trace_requested = FALSE;
 
 int sock;
 struct sockaddr_in server;
+int usock = -1; // optional unix domain socket for clients on this host
+char* usock_path = NULL;
+
+// logging: the event loop puts records into a ring, and a writer thread takes
+// them out and writes them to the console and the log, so neither a slow
+// terminal nor a slow disk holds up the loop. A full ring drops records.
+#define LOG_RECORDS 1024 // must be a power of 2
+#define LOG_LINE 256
+#define LOG_BATCH 16384
+#define LOG_CONSOLE 0 // console output only: tables, usage, gathered results
+#define LOG_ERROR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+typedef struct
+{
+	uint32_t seq; // == position when free to write, position + 1 when written
+	int level;
+	int len;
+	uint64_t realtime_ns;
+	char text[LOG_LINE];
+} log_record;
+typedef struct
+{
+	int fd;
+	int len;
+	char data[LOG_BATCH];
+} log_batch;
+static struct
+{
+	log_record records[LOG_RECORDS];
+	uint32_t head; // next position to be claimed by a writer of records
+	uint32_t tail; // next position to be read by the writer thread
+	uint32_t dropped;
+	int sleeping; // writer thread is waiting on wake
+	int stopping;
+	int running;
+	int wake; // eventfd
+	int tm_sock; // where the TMs' records come in
+	int tm_end; // the other end, which each TM gets as LOG_FD
+	int sink; // log file or journal socket, -1 for none
+	int journal;
+	pthread_t writer;
+} logger = { .sink = -1, .tm_sock = -1, .tm_end = -1 };
+static char* log_path = NULL;
+
+// event loop backends
+#define BACKEND_EPOLL 0
+#define BACKEND_URING 1
+static int backend = BACKEND_EPOLL;
+
+#define MAX_EVENTS 64 // taken from epoll per wakeup; the rest wait for the next
+#define EV_TM_EXIT 1 // tag on a client in epoll data: its TM has exited
+#define EV_TM_DYING 2 // epoll data of the pidfds of TMs being stopped
+
+// -t: clients are spread over shards, each a thread with its own epoll
+// instance, clients and graveyard, so that one client's TM starting, stopping
+// or flooding its pipes doesn't hold up the others. The main thread is shard
+// 0: it also accepts connections, reads their greetings and the console, and
+// keeps the gather. A client goes to a shard once its greeting is in, and
+// stays there. Anything to do with another shard's clients is posted to that
+// shard's mailbox, and answers come back to shard 0's the same way.
+#define MAX_SHARDS 16 // a session's token starts with its shard's number, in hex
+#define M_SESSION 1 // a connection past its greeting; arg: the token it attaches to, if any
+#define M_BROADCAST 2 // text: the cmd
+#define M_FAN_OUT 3 // seq: the gather; arg: the selector; text: the cmd
+#define M_GATHER_OVER 4 // seq: the gather, now printed; what's still to come goes to the console
+#define M_LIST 5 // seq: the query
+#define M_DISCONNECT 6 // seq: the query; arg, port: the client
+#define M_DISCONNECT_ALL 7
+#define M_EXIT 8 // disconnect all, and end the shard's thread
+#define M_TARGET 9 // to shard 0: seq: the gather; cl, arg, port: a client its cmd went to
+#define M_TARGETS_DONE 10 // to shard 0: seq: the gather, sent to all of the shard's matching clients
+#define M_REPLY 11 // to shard 0: seq: the gather; cl, arg, port: whose; flag: replied (text), or went away
+#define M_ANSWER 12 // to shard 0: seq: the query; flag: found; text: rows of the list
+typedef struct message
+{
+	int type;
+	int seq;
+	client* cl;
+	char arg[BUFF_SIZE];
+	int port;
+	int flag;
+	char* text; // freed once the message is handled, unless the handler keeps it
+	int len;
+	struct message* next;
+} message;
+typedef struct
+{
+	int id;
+	int tid;
+	int epfd;
+	struct epoll_event events[MAX_EVENTS];
+	clnode* clients;
+	// removed clients are freed once the events already read for them are handled
+	client** graveyard;
+	int graveyard_count;
+	int graveyard_size;
+	client** round; // clients with cmds queued, in the order they're served
+	int round_count;
+	int round_size;
+	int throttle_timer; // timerfd, for the first of its throttled clients to have a token again
+	task_manager* dying; // TMs sent SIGTERM, reaped as their pidfds become readable
+	int kill_timer; // timerfd, for the first of them to be due SIGKILL
+	message* mailbox; // newest first; any thread pushes onto it, the shard takes it whole
+	int wake; // eventfd, written after a push
+	int running;
+	int stopping;
+	pthread_t thread;
+} shard;
+static shard shards[MAX_SHARDS];
+static int shard_count = 1;
+static int next_shard = 0; // new sessions go round the shards
+static __thread shard* self; // the shard this thread runs
 
-#define MAX_EVENTS (MAX_CLIENTS + 2)
-static struct epoll_event events[MAX_EVENTS];
-int epfd;
+// io_uring backend: completions instead of readiness, so accepting, reading the
+// pipes and stdin, and writing to the TMs all share the one io_uring_enter()
+// per loop iteration
+#define URING_ENTRIES 256
+#define URING_BUFFERS 64 // must be a power of 2
+#define URING_BUFF_SIZE 4096 // a client's CMD_QUEUE has room for a read's worth
+#define URING_BGID 0
+#define MAX_QUEUED_WRITES 64
+// what a completion is for, in the low bits of user_data. For client reads, the
+// client's slot and a generation count (to drop completions for a client that
+// is gone) sit above it; for writes, the rest of user_data is the uring_write.
+#define REQ_STDIN   1
+#define REQ_ACCEPT  2
+#define REQ_TIMER   3
+#define REQ_RESULT  4
+#define REQ_CMD     5
+#define REQ_WRITE   6
+#define REQ_CANCEL  8
+#define REQ_GREETING 9 // rest of user_data is the client
+#define REQ_TM_EXIT 10
+#define REQ_SHARED_TM 11 // the shared TM has exited
+#define REQ_THROTTLE 12 // the throttle timer has expired
+#define REQ_TM_DYING 13 // a TM being stopped has exited
+#define REQ_KILL_TIMER 14 // a TM being stopped is due SIGKILL
+#define REQ_GREETING_TIMER 15 // a connection is out of time for its greeting
+#define REQ_KIND_MASK 0xF
+typedef struct
+{
+	int fd;
+	int len;
+	char data[];
+} uring_write;
+static struct
+{
+	int fd;
+	unsigned sq_entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sqe_tail; // sqes handed out so far
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	struct io_uring_buf_ring* buf_ring;
+	char* buffs;
+	unsigned short buf_tail;
+	client* clients[MAX_CLIENTS]; // by slot, which is in bits 8 - 23 of user_data
+	uint32_t gen[MAX_CLIENTS];
+	uring_write* writes[MAX_QUEUED_WRITES]; // waiting to be submitted, a linked chain per fd
+	int write_count;
+	int writes_in_flight;
+	uint64_t timer_expirations;
+	uint64_t throttle_expirations;
+	uint64_t kill_expirations;
+	uint64_t greeting_expirations;
+} ring;
 
+void epoll_loop();
+void start_shards();
+void* shard_loop(void* arg);
+void handle_client_event(struct epoll_event e);
+message* new_message(int type, int seq);
+message* client_message(int type, int seq, client* cl);
+void post(shard* to, message* m);
+void post_all(int type, int seq, char* arg, char* text, int len);
+void read_mail();
+void handle_message(message* m);
+int shard_of(char* token);
 void handle_client_input(client* cl);
+int read_cmds(client* cl);
+void queue_cmds(client* cl, char* buff, int len);
+int whole_cmd(client* cl);
+void handle_queued_cmd(client* cl);
+void serve_cmds();
+void leave_round(client* cl);
+void watch_cmds(client* cl, int on);
+int refill(client* cl, uint64_t now);
+int cmds_ready();
+void handle_client_cmd(client* cl, char* input, int len);
 void handle_stdin_input();
-void list_clients();
+void handle_console_cmd(char* input, int len);
+void console_write(const char* buff, int len);
+void send_cmd(int fd, char* cmd, int len);
+void fan_out(char* selector, char* cmd, int timeout);
+void send_to_matching(char* selector, char* cmd, int len, int seq);
+int matches(client* cl, char* selector);
+int read_tag(client* cl, char* buff, int len);
+void collect_result(client* cl, char* buff, int len);
+void drop_from_gather(client* cl);
+void let_go_of_gather(int seq);
+void add_target(message* m);
+void take_reply(message* m);
+void check_gather();
+void finish_gather();
+void print_reply(char* ip_str, int port, char* reply, int len);
+int compare_targets(const void* a, const void* b);
+void add_gather_timer();
+void add_greeting_timer();
+void start_query(int type, char* ip_str, int port);
+void take_answer(message* m);
+void finish_query();
+int list_clients(char** rows);
 void register_signal_handlers();
 void add_connection_listener();
 void add_stdin_listener();
-void add_client();
-client* make_client(task_manager* tm, int msgsock, struct sockaddr_in* cl_info);
-task_manager* make_TM(int msgsock);
+void add_client(int listener);
+void register_client(int msgsock, struct sockaddr_storage* cl_info);
+int peer_allowed(int msgsock);
+void handle_greeting(client* cl);
+void drop_greeting(client* cl);
+void tend_greetings();
+void set_greeting_timer(uint64_t at_ns);
+void start_session(client* cl);
+int resume_session(client* cl, char* token);
+int pass_socket(int fd, int msgsock);
+void make_token(char* token);
+client* make_client(task_manager* tm, int msgsock, struct sockaddr_storage* cl_info);
+task_manager* make_TM(int msgsock, char* token, int restarted);
+task_manager* share_TM(int msgsock, char* token);
+int start_shared_TM();
+void watch_shared_TM();
+void handle_shared_TM_exit();
+void handle_tm_exit(client* cl);
+int respawn_TM(client* cl);
+void describe_exit(siginfo_t* info, char* buff, int len);
+void close_TM(task_manager* tm);
+void let_TM_die(task_manager* tm);
+void tend_dying();
+void reap_dying();
+void stop_TMs(task_manager** tms, int n);
+void see_TMs_out(task_manager** tms, int n);
+int wait_for_TMs(task_manager** tms, int n, int timeout_ms);
 int add_client_listeners(client* cl);
 void add_to_client_list(client* cl);
 void initialize_server();
+void fit_fd_limit();
 void make_socket();
+void make_unix_socket(char* path);
 void bind_socket();
 void print_port();
 void free_client(client* cl);
 void disconnect_client(client* cl);
-void search_and_disconnect(char* ip_str, int port);
-void disconnect_all();
-void rm_client(clnode* node);
+int search_and_disconnect(char* ip_str, int port);
+void rm_client(client* cl);
+void bury_clients();
 void rm_all_clients();
 void rm_recurse(clnode* node);
 void printify(const char* str, ...);
-void sigchld_handler(int signo);
+void logify(int level, const char* str, ...);
+void perrorize(char* str, int eno);
+void log_put(int level, const char* text, int len);
+void log_start();
+void log_stop();
+void* log_writer(void* arg);
+int log_drain(log_batch* out, log_batch* err, log_batch* sink);
+int log_drain_tms(log_batch* err, log_batch* sink);
+void log_emit(log_batch* sink, int level, const char* source, const char* text, int len, uint64_t ns);
+void batch_add(log_batch* b, const char* data, int len);
+void batch_flush(log_batch* b);
 void exit_gracefully();
 void exit_handler(int signo);
+uint64_t monotonic_ns();
+void trace(int type, char phase, int arg, const char* text, int len);
+int dump_trace(char* path, int len);
+void check_trace_request();
+void trace_handler(int signo);
 void lower(char* str);
 void hr();
+int uring_init();
+void uring_loop();
+void uring_handle_completion(struct io_uring_cqe* cqe);
+struct io_uring_sqe* uring_get_sqe();
+int uring_enter(int wait);
+void uring_read(int fd, uint64_t user_data);
+void uring_arm_accept(int listener, int which);
+void uring_arm_timer();
+void uring_arm_greeting(client* cl);
+void uring_poll(int fd, uint64_t user_data);
+void uring_wait_on(int fd);
+void uring_recycle(int bid);
+/*
+ * Clears O_NONBLOCK on an fd the ring reads from. The kernel waits for those
+ * reads itself, but where it honours O_NONBLOCK a read with nothing to take
+ * completes with -EAGAIN straight away, and would be re-armed over and over.
+ */
+void uring_wait_on(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+uint64_t uring_client_data(int kind, int slot);
+int uring_add_client(client* cl);
+void uring_rm_client(client* cl);
+void uring_arm_throttle_timer();
+void uring_arm_kill_timer();
+void uring_arm_greeting_timer();
+void uring_queue_write(int fd, char* buff, int len);
+void uring_flush_writes();
+void uring_drain();
 
-int main()
+int main(int argc, char* argv[])
 {
+	int opt;
+	while ((opt = getopt(argc, argv, "u:e:r:l:mt:q:")) != -1)
+	{
+		if (opt == 'u')
+		{
+			usock_path = optarg;
+		}
+		else if (opt == 't' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_SHARDS)
+		{
+			shard_count = atoi(optarg);
+		}
+		else if (opt == 'm')
+		{
+			shared_mode = TRUE;
+		}
+		else if (opt == 'q' && atoi(optarg) >= 1)
+		{
+			cmd_rate = atoi(optarg);
+		}
+		else if (opt == 'l')
+		{
+			log_path = optarg;
+		}
+		else if (opt == 'r')
+		{
+			max_respawns = atoi(optarg);
+		}
+		else if (opt == 'e' && !strcmp(optarg, "epoll"))
+		{
+			backend = BACKEND_EPOLL;
+		}
+		else if (opt == 'e' && !strcmp(optarg, "uring"))
+		{
+			backend = BACKEND_URING;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-u <unix-socket-path>] [-e epoll | uring] [-r <respawns>] [-l <log-file> | journal] [-m] [-t <threads>] [-q <cmds-per-second>]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	self = &shards[0];
+	self->tid = getpid();
+	log_start();
 	register_signal_handlers();
 
 	initialize_server();
-	epfd = epoll_create1(0);
-	if (epfd == -1)
+	if (shared_mode && start_shared_TM() == -1)
+	{
+		logify(LOG_ERROR, "Failed to start the shared TM\n");
+		exit(EXIT_FAILURE);
+	}
+	gather_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	greeting_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (gather_timer == -1 || greeting_timer == -1)
 	{
-		perror("epoll_create1");
+		perrorize("timerfd_create", errno);
 		exit(EXIT_FAILURE);
 	}
+	if (backend == BACKEND_URING && uring_init() == -1)
+	{
+		logify(LOG_WARN, "io_uring unavailable, using epoll.\n");
+		backend = BACKEND_EPOLL;
+	}
+	if (backend == BACKEND_URING && shard_count > 1)
+	{
+		logify(LOG_WARN, "The io_uring loop runs on one thread; -t is for epoll.\n");
+		shard_count = 1;
+	}
+	if (backend == BACKEND_URING)
+		uring_loop();
+	else
+		epoll_loop();
+	exit_gracefully();
+	return 0;
+}
+
+void epoll_loop()
+{
+	start_shards();
 	add_connection_listener();
 	add_stdin_listener();
+	add_gather_timer();
+	add_greeting_timer();
+	if (shared_mode)
+		watch_shared_TM();
 	while (TRUE)
 	{
-		int nr = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		int nr = epoll_wait(self->epfd, self->events, MAX_EVENTS, cmds_ready() ? 0:-1);
+		trace(TR_WAKEUP, 'i', nr, NULL, 0);
+		check_trace_request();
 		if (nr < 0)
 		{
 			if (errno == EINTR)
 				continue;
 			else
 			{
-				perror("epoll_wait");
+				perrorize("epoll_wait", errno);
 				exit_gracefully();
 			}
 		}
 		for (int i = 0; i < nr; ++i)
 		{
-			struct epoll_event e = events[i];
-			if (e.events == EPOLLIN)
+			struct epoll_event e = self->events[i];
+			if (e.events & (EPOLLIN | EPOLLHUP))
 			{
 				if (e.data.fd == STDIN_FILENO) //TODO
 				{
 					// printify("Such interactivity. Much wow.\n");
 					handle_stdin_input();
 				}
-				else if ((e.data.fd == sock) && (client_count < MAX_CLIENTS))
+				else if (e.data.fd == sock || e.data.fd == usock)
 				{
-					add_client();
+					add_client(e.data.fd);
 					// printify("Client added.\n");
 				}
-				else //TODO
+				else if (e.data.fd == gather_timer)
+				{
+					uint64_t expirations;
+					read(gather_timer, &expirations, sizeof(expirations));
+					if (gather_active)
+						finish_gather();
+				}
+				else if (e.data.fd == greeting_timer)
+				{
+					uint64_t expirations;
+					read(greeting_timer, &expirations, sizeof(expirations));
+					tend_greetings();
+				}
+				else if (e.data.fd == self->wake)
+				{
+					read_mail();
+				}
+				else if (e.data.fd == self->throttle_timer)
+				{
+					uint64_t expirations;
+					read(self->throttle_timer, &expirations, sizeof(expirations));
+				}
+				else if (e.data.fd == self->kill_timer)
+				{
+					uint64_t expirations;
+					read(self->kill_timer, &expirations, sizeof(expirations));
+					tend_dying();
+				}
+				else if (shared_mode && e.data.fd == shared_tm.pidfd)
+				{
+					handle_shared_TM_exit();
+				}
+				else
 				{
-					// printify("Client input detected.\n");
-					client* cl = (client*) e.data.ptr;
-					// printify("Client %d.\n", cl->tm->pid);
-					handle_client_input(cl);
+					handle_client_event(e);
 				}
 			}
 		}
+		serve_cmds();
+		bury_clients();
 	}
-	exit_gracefully();
-	return 0;
 }
 
-void handle_client_input(client* cl)
+/*
+ * Makes each shard's epoll instance and mailbox, and starts the threads of all
+ * but shard 0, which is this one.
+ */
+void start_shards()
 {
-	assert(cl != NULL);
-	assert(cl->tm != NULL);
-	char buff[BUFF_SIZE];
-	int r;
-	// printify("Reading result pipe\n");
-	while ((r = read(cl->tm->result_from, buff, BUFF_SIZE)) > 0)
+	int i;
+	for (i = 0; i < shard_count; i++)
 	{
-		write(STDOUT_FILENO, buff, r);
+		shard* s = &shards[i];
+		s->id = i;
+		s->epfd = epoll_create1(EPOLL_CLOEXEC);
+		s->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		s->throttle_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		s->kill_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		struct epoll_event mail, timer, kill_timer;
+		mail.data.u64 = 0;
+		mail.data.fd = s->wake;
+		mail.events = EPOLLIN;
+		timer.data.u64 = 0;
+		timer.data.fd = s->throttle_timer;
+		timer.events = EPOLLIN;
+		kill_timer.data.u64 = 0;
+		kill_timer.data.fd = s->kill_timer;
+		kill_timer.events = EPOLLIN;
+		if (s->epfd == -1 || s->wake == -1 || s->throttle_timer == -1 || s->kill_timer == -1 ||
+			epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake, &mail) == -1 ||
+			epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->throttle_timer, &timer) == -1 ||
+			epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->kill_timer, &kill_timer) == -1)
+		{
+			perrorize("start_shards", errno);
+			exit(EXIT_FAILURE);
+		}
 	}
-	// printify("Reading cmd pipe\n");
-	// input length
-	int len = 0;
-	r = read(cl->tm->cmd_from, &len, LENGTH_BYTES);
-	if (r <= 0) // no input at the moment
+	// signals are for shard 0
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 1; i < shard_count; i++)
 	{
-		return;
+		int err = pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i]);
+		if (err)
+		{
+			perrorize("start_shards: pthread_create", err);
+			exit(EXIT_FAILURE);
+		}
+		shards[i].running = TRUE;
 	}
-	assert(len <= BUFF_SIZE);
-	// actual input
-	char input[BUFF_SIZE];
-	r = read(cl->tm->cmd_from, input, len);
-	if (r == -1)
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * The event loop of a shard other than 0: its clients' pipes and pidfds, and
+ * its mailbox. Runs until M_EXIT.
+ */
+void* shard_loop(void* arg)
+{
+	self = arg;
+	self->tid = syscall(SYS_gettid);
+	while (!self->stopping)
 	{
-		perror("SV read cmd");
-		return;
+		int nr = epoll_wait(self->epfd, self->events, MAX_EVENTS, cmds_ready() ? 0:-1);
+		trace(TR_WAKEUP, 'i', nr, NULL, 0);
+		if (nr < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perrorize("epoll_wait", errno);
+			break;
+		}
+		for (int i = 0; i < nr; ++i)
+		{
+			struct epoll_event e = self->events[i];
+			if (!(e.events & (EPOLLIN | EPOLLHUP)))
+				continue;
+			if (e.data.fd == self->wake)
+			{
+				read_mail();
+			}
+			else if (e.data.fd == self->throttle_timer)
+			{
+				uint64_t expirations;
+				read(self->throttle_timer, &expirations, sizeof(expirations));
+			}
+			else if (e.data.fd == self->kill_timer)
+			{
+				uint64_t expirations;
+				read(self->kill_timer, &expirations, sizeof(expirations));
+				tend_dying();
+			}
+			else
+			{
+				handle_client_event(e);
+			}
+		}
+		serve_cmds();
+		bury_clients();
+	}
+	return NULL;
+}
+
+void handle_client_event(struct epoll_event e)
+{
+	if (e.data.u64 == EV_TM_DYING)
+	{
+		tend_dying();
 	}
-	if (r < len)
+	else if (e.data.u64 & EV_TM_EXIT)
 	{
-		printify("Incomplete read. len: %d, r: %d\n", len, r);
-		return;
+		client* cl = (client*) (uintptr_t) (e.data.u64 & ~(uint64_t) EV_TM_EXIT);
+		if (!cl->gone)
+			handle_tm_exit(cl);
 	}
-	char* cmd = strtok(input, " ");
-	if (!strcmp(cmd, "msg"))
+	else //TODO
 	{
-		char* msg = strtok(NULL, "");
-		if (!msg)
-			return;
-		printify("Client %d says: %s\n", cl->tm->pid, msg);
+		// printify("Client input detected.\n");
+		client* cl = (client*) e.data.ptr;
+		// printify("Client %d.\n", cl->tm->pid);
+		if (!cl->gone)
+			handle_client_input(cl);
 	}
-	// printify("Done reading from client\n");
 }
 
-void handle_stdin_input()
+message* new_message(int type, int seq)
 {
-	char input[BUFF_SIZE];
-	int r;
-	// printify("Reading stdin\n");
-	r = read(STDIN_FILENO, input, BUFF_SIZE);
-	if (r <= 0)
+	message* m = calloc(1, sizeof(*m));
+	m->type = type;
+	m->seq = seq;
+	return m;
+}
+
+/*
+ * A message about one of this shard's clients, for shard 0.
+ */
+message* client_message(int type, int seq, client* cl)
+{
+	message* m = new_message(type, seq);
+	m->cl = cl;
+	snprintf(m->arg, sizeof(m->arg), "%s", cl->ip_str);
+	m->port = cl->port;
+	return m;
+}
+
+/*
+ * Pushes the message onto the shard's mailbox and wakes it up, or handles it
+ * right away if it's for this shard. Never blocks; any thread may call this.
+ */
+void post(shard* to, message* m)
+{
+	if (to == self)
 	{
-		perror("stdin read");
+		handle_message(m);
+		free(m->text);
+		free(m);
 		return;
 	}
-	input[r-1] = '\0';
-	lower(input);
-	// keep a copy of the original input
-	int original_len = strlen(input) + 1;
-	char original[original_len];
-	memcpy(original, input, original_len);
+	m->next = __atomic_load_n(&to->mailbox, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&to->mailbox, &m->next, m, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	uint64_t one = 1;
+	write(to->wake, &one, sizeof(one));
+}
 
-	char* cmd = strtok(input, " ");
-	if (!strcmp(cmd, "broadcast")) // broadcast
+/*
+ * Posts a message to every shard, each with its own copy of arg and text.
+ */
+void post_all(int type, int seq, char* arg, char* text, int len)
+{
+	int i;
+	for (i = 0; i < shard_count; i++)
 	{
-		clnode* clptr;
-		for (clptr = clist_head; clptr; clptr = clptr->next)
+		message* m = new_message(type, seq);
+		if (arg)
+			snprintf(m->arg, sizeof(m->arg), "%s", arg);
+		if (text)
 		{
-			write(clptr->cl->tm->cmd_to, &original_len, LENGTH_BYTES);
-			write(clptr->cl->tm->cmd_to, original, original_len);
+			m->text = malloc(len);
+			memcpy(m->text, text, len);
+			m->len = len;
 		}
+		post(&shards[i], m);
 	}
-	else if (!strcmp(cmd, "q") || !strcmp(cmd, "ex") || !strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
+}
+
+/*
+ * Takes everything in the shard's mailbox, and handles it in the order it was posted.
+ */
+void read_mail()
+{
+	uint64_t count;
+	read(self->wake, &count, sizeof(count));
+	message* m = __atomic_exchange_n(&self->mailbox, NULL, __ATOMIC_ACQUIRE);
+	message* oldest = NULL;
+	while (m)
 	{
-		exit_gracefully();
+		message* next = m->next;
+		m->next = oldest;
+		oldest = m;
+		m = next;
 	}
-	else if (!strcmp(cmd, "list"))
+	while (oldest)
 	{
-		list_clients();
+		m = oldest;
+		oldest = m->next;
+		handle_message(m);
+		free(m->text);
+		free(m);
 	}
-	else if (!strcmp(cmd, "cl"))
-	{
-		// printify("cl-ing\n");
-		char* ip_str = strtok(NULL, " :");
-		int port = atoi(strtok(NULL, " :"));
-		if (!ip_str || !port)
-		{
-			printify("Usage: disconnect <client-ip>:<client-port>");
-			return;
-		}
-		char* cmd_to_fwd = strtok(NULL, "");
-		int len = strlen(cmd_to_fwd) + 1;
+}
 
+void handle_message(message* m)
+{
+	if (m->type == M_SESSION)
+	{
+		if (!m->arg[0] || !resume_session(m->cl, m->arg))
+			start_session(m->cl);
+		// counted as a client, if it is one, by now
+		__atomic_sub_fetch(&greeting_count, 1, __ATOMIC_RELAXED);
+	}
+	else if (m->type == M_BROADCAST)
+	{
 		clnode* clptr;
-		for (clptr = clist_head; clptr; clptr = clptr->next)
-		{
-			client* cl = clptr->cl;
-			if (!strcmp(cl->ip_str, ip_str) && (cl->port == port))
-			{
-				write(cl->tm->cmd_to, &len, LENGTH_BYTES);
-				write(cl->tm->cmd_to, cmd_to_fwd, len);
-			}
-		}
-		return;
+		for (clptr = self->clients; clptr; clptr = clptr->next)
+			send_cmd(clptr->cl->tm->cmd_to, m->text, m->len);
 	}
-	else if (!strcmp(cmd, "disconnect"))
+	else if (m->type == M_FAN_OUT)
 	{
-		// printify("disconnecting\n");
-		char* arg1 = strtok(NULL, " :");
-		if (!arg1)
-		{
-			printify("Usage: disconnect all %s * %s <client-ip>:<client-port>", VERTICAL_LINE);
-			return;
-		}
-		if (!strcmp(arg1, "all") || !strcmp(arg1, "*"))
-		{
-			disconnect_all();
-			return;
-		}
-		char* ip_str = arg1;
-		int port = atoi(strtok(NULL, " :"));
-		if (!ip_str || !port)
-		{
-			printify("Usage: disconnect <client-ip>:<client-port>");
-			return;
-		}
-		search_and_disconnect(ip_str, port);
+		send_to_matching(m->arg, m->text, m->len, m->seq);
+	}
+	else if (m->type == M_GATHER_OVER)
+	{
+		let_go_of_gather(m->seq);
+	}
+	else if (m->type == M_LIST || m->type == M_DISCONNECT)
+	{
+		message* answer = new_message(M_ANSWER, m->seq);
+		if (m->type == M_LIST)
+			answer->len = list_clients(&answer->text);
+		else
+			answer->flag = search_and_disconnect(m->arg, m->port);
+		post(&shards[0], answer);
+	}
+	else if (m->type == M_DISCONNECT_ALL || m->type == M_EXIT)
+	{
+		rm_all_clients();
+		self->stopping = (m->type == M_EXIT);
+		if (self->stopping)
+			reap_dying();
+	}
+	else if (m->type == M_TARGET)
+	{
+		add_target(m);
+	}
+	else if (m->type == M_TARGETS_DONE)
+	{
+		if (gather_active && m->seq == gather_seq)
+			gather_shards--;
+		check_gather();
+	}
+	else if (m->type == M_REPLY)
+	{
+		take_reply(m);
+	}
+	else if (m->type == M_ANSWER)
+	{
+		take_answer(m);
 	}
-	// printify("Done reading from client\n");
 }
 
-void list_clients()
+/*
+ * The shard whose number a session's token starts with, or 0.
+ */
+int shard_of(char* token)
 {
-	hr();
-	printify(" %-6s %s %-11s %s %-5s\n", "PID", VERTICAL_LINE, "IP", VERTICAL_LINE, "PORT");
-	hr();
-	clnode* clptr;
-	for(clptr = clist_head; clptr; clptr = clptr->next)
-	{
-		client* cl = clptr->cl;
-		printify(" %-6d %s %-11s %s %-5d\n", cl->tm->pid, VERTICAL_LINE, cl->ip_str, VERTICAL_LINE, cl->port);
-	}
-	hr();
+	char digit[2] = { token[0], '\0' };
+	int id = strtol(digit, NULL, 16);
+	return (id < shard_count) ? id:0;
 }
 
-void register_signal_handlers()
+void handle_client_input(client* cl)
 {
-	if (signal(SIGCHLD, sigchld_handler) == SIG_ERR)
+	assert(cl != NULL);
+	if (!cl->tm)
 	{
-		perror("signal: SIGCHLD");
-		exit(EXIT_FAILURE);
+		handle_greeting(cl);
+		return;
 	}
-	if (signal(SIGINT, exit_handler) == SIG_ERR)
+	char buff[BUFF_SIZE];
+	int r;
+	// printify("Reading result pipe\n");
+	while ((r = read(cl->tm->result_from, buff, BUFF_SIZE)) > 0)
 	{
-		perror("signal: SIGINT");
-		exit(EXIT_FAILURE);
+		collect_result(cl, buff, r);
 	}
-	if (signal(SIGTERM, exit_handler) == SIG_ERR)
+	if (r == 0 && cl->tm->pidfd == -1)
 	{
-		perror("signal: SIGTERM");
-		exit(EXIT_FAILURE);
+		// the shared TM has ended the session (or died)
+		rm_client(cl);
+		return;
 	}
+	// printify("Reading cmd pipe\n");
+	if (!cl->busy)
+		read_cmds(cl);
 }
 
-void add_connection_listener()
+/*
+ * Reads as much of the TM's cmds as the client's queue has room for. Returns
+ * what read() did.
+ */
+int read_cmds(client* cl)
 {
-	struct epoll_event incoming_connection_event;
-	incoming_connection_event.data.fd = sock;
-	incoming_connection_event.events = EPOLLIN;
-	int r = epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &incoming_connection_event);
-	if (r == -1)
-	{
-		perror("add_connection_listener: epoll_ctl");
-		exit(EXIT_FAILURE);
-	}
+	char buff[CMD_QUEUE];
+	int r = read(cl->tm->cmd_from, buff, CMD_QUEUE - cl->frame_len);
+	if (r > 0)
+		queue_cmds(cl, buff, r);
+	return r;
 }
 
-void add_stdin_listener()
+/*
+ * Adds what was read from the TM's cmd pipe to the client's queue, which may
+ * end in part of a cmd. A client with a whole cmd queued joins its shard's
+ * round, and its pipe isn't read again until the queue has been worked off.
+ */
+void queue_cmds(client* cl, char* buff, int len)
 {
-	struct epoll_event user_input;
-	user_input.data.fd = STDIN_FILENO;
-	user_input.events = EPOLLIN;
-	int r = epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &user_input);
-	if (r == -1)
+	int n = sizeof(cl->frame) - cl->frame_len;
+	n = (len < n) ? len:n;
+	memcpy(cl->frame + cl->frame_len, buff, n);
+	cl->frame_len += n;
+	if (cl->busy || !whole_cmd(cl))
+		return;
+	cl->busy = TRUE;
+	cl->deficit = 0;
+	if (self->round_count == self->round_size)
 	{
-		perror("add_stdin_listener: epoll_ctl");
-		exit(EXIT_FAILURE);
+		self->round_size = self->round_size ? 2 * self->round_size:64;
+		self->round = realloc(self->round, self->round_size * sizeof(client*));
 	}
+	self->round[self->round_count++] = cl;
+	watch_cmds(cl, FALSE);
 }
 
-void add_client()
+int whole_cmd(client* cl)
 {
-	struct sockaddr_in* cl_info = malloc(sizeof(*cl_info));
-	socklen_t length = sizeof(*cl_info);
+	return cl->frame_len >= LENGTH_BYTES && cl->frame_len >= LENGTH_BYTES + cl->frame[0];
+}
 
-	int msgsock = accept(sock, (struct sockaddr *) cl_info, &length);
+/*
+ * Takes the cmd at the front of the client's queue off it, and handles it.
+ */
+void handle_queued_cmd(client* cl)
+{
+	int len = cl->frame[0];
+	char input[MAX_FRAME + 1];
+	memcpy(input, cl->frame + LENGTH_BYTES, len);
+	cl->frame_len -= LENGTH_BYTES + len;
+	memmove(cl->frame, cl->frame + LENGTH_BYTES + len, cl->frame_len);
+	cl->cmds++;
+	trace(TR_TM_CMD, 'B', cl->tm->pid, input, len);
+	handle_client_cmd(cl, input, len);
+	trace(TR_TM_CMD, 'E', cl->tm->pid, NULL, 0);
+}
+
+/*
+ * A round of deficit round-robin over the shard's clients with cmds queued.
+ * Each one's deficit grows by CMD_QUANTUM, and it has cmds handled while the
+ * next fits in it and its bucket has tokens. A client whose queue runs out
+ * leaves the round, and its pipe is read again; one whose bucket runs dry
+ * sits the rounds out until the throttle timer says it has a token again.
+ */
+void serve_cmds()
+{
+	uint64_t now = monotonic_ns();
+	uint64_t wake = 0; // when the first throttled client may go on
+	int i, kept = 0;
+	for (i = 0; i < self->round_count; i++)
+	{
+		client* cl = self->round[i];
+		if (refill(cl, now))
+		{
+			cl->deficit += CMD_QUANTUM;
+			while (whole_cmd(cl) && LENGTH_BYTES + cl->frame[0] <= cl->deficit)
+			{
+				if (cl->tokens < 1)
+				{
+					cl->throttled_ns = now;
+					cl->unthrottle_ns = now + (uint64_t) ((1 - cl->tokens) * 1e9 / cmd_rate);
+					if (cl->throttles++ == 0)
+						logify(LOG_WARN, "%s:%d is sending the server more than %d cmds a second; throttled.\n",
+							cl->ip_str, cl->port, cmd_rate);
+					trace(TR_THROTTLE, 'i', cl->tm->pid, NULL, 0);
+					break;
+				}
+				cl->tokens--;
+				cl->deficit -= LENGTH_BYTES + cl->frame[0];
+				handle_queued_cmd(cl);
+			}
+		}
+		if (!whole_cmd(cl))
+		{
+			cl->busy = FALSE;
+			cl->deficit = 0;
+			watch_cmds(cl, TRUE);
+			continue;
+		}
+		if (cl->throttled_ns && (!wake || cl->unthrottle_ns < wake))
+			wake = cl->unthrottle_ns;
+		self->round[kept++] = cl;
+	}
+	self->round_count = kept;
+	if (wake)
+	{
+		struct itimerspec at = { .it_value = { .tv_sec = wake / 1000000000ULL, .tv_nsec = wake % 1000000000ULL } };
+		if (timerfd_settime(self->throttle_timer, TFD_TIMER_ABSTIME, &at, NULL) == -1)
+			perrorize("serve_cmds: timerfd_settime", errno);
+	}
+}
+
+/*
+ * Takes a client that is going away, or whose queue is being thrown away, out
+ * of the round.
+ */
+void leave_round(client* cl)
+{
+	int i;
+	for (i = 0; i < self->round_count && self->round[i] != cl; i++);
+	if (i < self->round_count)
+		self->round[i] = self->round[--self->round_count];
+	cl->busy = FALSE;
+}
+
+/*
+ * Starts or stops reading the TM's cmd pipe.
+ */
+void watch_cmds(client* cl, int on)
+{
+	if (backend == BACKEND_URING)
+	{
+		if (on && cl->slot >= 0)
+			uring_read(cl->tm->cmd_from, uring_client_data(REQ_CMD, cl->slot));
+		return;
+	}
+	struct epoll_event cl_input;
+	cl_input.data.ptr = cl;
+	cl_input.events = on ? EPOLLIN:0;
+	epoll_ctl(self->epfd, EPOLL_CTL_MOD, cl->tm->cmd_from, &cl_input);
+}
+
+/*
+ * Tops up the client's token bucket for the time since it was last. Returns
+ * FALSE while the client is throttled.
+ */
+int refill(client* cl, uint64_t now)
+{
+	cl->tokens += (now - cl->refilled_ns) * (double) cmd_rate / 1e9;
+	if (cl->tokens > cmd_rate)
+		cl->tokens = cmd_rate;
+	cl->refilled_ns = now;
+	if (!cl->throttled_ns)
+		return TRUE;
+	if (now < cl->unthrottle_ns)
+		return FALSE;
+	cl->throttled_total_ns += now - cl->throttled_ns;
+	cl->throttled_ns = 0;
+	return TRUE;
+}
+
+/*
+ * TRUE if a client in the round can have cmds handled without waiting, in
+ * which case the event loop shouldn't block.
+ */
+int cmds_ready()
+{
+	int i;
+	for (i = 0; i < self->round_count; i++)
+	{
+		if (!self->round[i]->throttled_ns)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Handles a cmd the TM has forwarded to the server. input holds len bytes,
+ * and has room for one more.
+ */
+void handle_client_cmd(client* cl, char* input, int len)
+{
+	input[len] = '\0';
+	// shards run this at the same time, so strtok's hidden state won't do
+	char* save;
+	char* cmd = strtok_r(input, " ", &save);
+	if (!cmd)
+		return;
+	if (!strcmp(cmd, "msg"))
+	{
+		char* msg = strtok_r(NULL, "", &save);
+		if (!msg)
+			return;
+		logify(LOG_INFO, "Client %d says: %s\n", cl->tm->pid, msg);
+	}
+	else if (!strcmp(cmd, "detached"))
+	{
+		// the TM has closed its copy of the socket
+		if (cl->msgsock != -1)
+			close(cl->msgsock);
+		cl->msgsock = -1;
+		cl->parked = TRUE;
+		logify(LOG_INFO, "%s:%d detached; session kept.\n", cl->ip_str, cl->port);
+	}
+	else if (!strcmp(cmd, "attached"))
+	{
+		cl->parked = FALSE;
+	}
+	else if (!strcmp(cmd, "event")) // the server is watching this TM (cl <client> watch)
+	{
+		char* rest = strtok_r(NULL, "", &save);
+		logify(LOG_INFO, "%s:%d event %s\n", cl->ip_str, cl->port, rest ? rest:"");
+	}
+	else if (!strcmp(cmd, "echo")) // a client's ping, by way of the server
+	{
+		// sent straight back, with when it got here added
+		char* rest = strtok_r(NULL, "", &save);
+		char reply[BUFF_SIZE];
+		int n = snprintf(reply, sizeof(reply), "echo %s %llu", rest ? rest:"",
+			(unsigned long long) monotonic_ns()) + 1;
+		if (n <= BUFF_SIZE)
+			send_cmd(cl->tm->cmd_to, reply, n);
+	}
+	// printify("Done reading from client\n");
+}
+
+void handle_stdin_input()
+{
+	char input[BUFF_SIZE];
+	int r;
+	// printify("Reading stdin\n");
+	r = read(STDIN_FILENO, input, BUFF_SIZE);
+	if (r == 0)
+	{
+		// no console; keep serving without one, as the io_uring loop does
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+		return;
+	}
+	if (r < 0)
+	{
+		perrorize("stdin read", errno);
+		return;
+	}
+	trace(TR_CONSOLE, 'B', 0, input, r);
+	handle_console_cmd(input, r);
+	trace(TR_CONSOLE, 'E', 0, NULL, 0);
+}
+
+/*
+ * Handles a line typed on the server console. input holds r bytes, the last
+ * of which is the newline.
+ */
+void handle_console_cmd(char* input, int r)
+{
+	input[r-1] = '\0';
+	// keep a copy of the original input
+	int original_len = strlen(input) + 1;
+	char original[original_len];
+	memcpy(original, input, original_len);
+
+	char* cmd = strtok(input, " ");
+	if (!cmd)
+		return;
+	// only the keyword and the selector; what cl forwards keeps its case
+	lower(cmd);
+	if (!strcmp(cmd, "broadcast")) // broadcast
+	{
+		post_all(M_BROADCAST, 0, NULL, original, original_len);
+	}
+	else if (!strcmp(cmd, "q") || !strcmp(cmd, "ex") || !strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
+	{
+		exit_gracefully();
+	}
+	else if (!strcmp(cmd, "list"))
+	{
+		start_query(M_LIST, "", 0);
+	}
+	else if (!strcmp(cmd, "trace"))
+	{
+		char path[64];
+		int n = dump_trace(path, sizeof(path));
+		if (n >= 0)
+			printify("Wrote %d trace events to %s.\n", n, path);
+	}
+	else if (!strcmp(cmd, "cl"))
+	{
+		// printify("cl-ing\n");
+		int timeout = GATHER_TIMEOUT;
+		char* selector = strtok(NULL, " ");
+		if (selector && !strcasecmp(selector, "-t"))
+		{
+			char* secs = strtok(NULL, " ");
+			timeout = secs ? atoi(secs):0;
+			selector = strtok(NULL, " ");
+		}
+		if (selector)
+			lower(selector);
+		char* cmd_to_fwd = strtok(NULL, "");
+		if (!selector || !cmd_to_fwd || timeout <= 0)
+		{
+			printify("Usage: cl [-t <seconds>] all %s <ip>[:<port>] <command>\n", VERTICAL_LINE);
+			return;
+		}
+		fan_out(selector, cmd_to_fwd, timeout);
+		return;
+	}
+	else if (!strcmp(cmd, "disconnect"))
+	{
+		// printify("disconnecting\n");
+		char* arg1 = strtok(NULL, " :");
+		if (!arg1)
+		{
+			printify("Usage: disconnect all %s * %s <client-ip>:<client-port>", VERTICAL_LINE);
+			return;
+		}
+		lower(arg1);
+		if (!strcmp(arg1, "all") || !strcmp(arg1, "*"))
+		{
+			post_all(M_DISCONNECT_ALL, 0, NULL, NULL, 0);
+			return;
+		}
+		char* ip_str = arg1;
+		int port = atoi(strtok(NULL, " :"));
+		if (!ip_str || !port)
+		{
+			printify("Usage: disconnect <client-ip>:<client-port>");
+			return;
+		}
+		start_query(M_DISCONNECT, ip_str, port);
+	}
+	// printify("Done reading from client\n");
+}
+
+/*
+ * Writes the length header and the cmd with a single write, so that the TM
+ * never sees one without the other.
+ */
+void send_cmd(int fd, char* cmd, int len)
+{
+	trace(TR_SEND, 'i', len, cmd, len);
+	char frame[LENGTH_BYTES + MAX_FRAME];
+	frame[0] = len;
+	memcpy(frame + LENGTH_BYTES, cmd, len);
+	if (backend == BACKEND_URING)
+		uring_queue_write(fd, frame, LENGTH_BYTES + len);
+	else if (write(fd, frame, LENGTH_BYTES + len) == -1)
+		perrorize("send_cmd: write", errno);
+}
+
+/*
+ * Sends cmd to the TM of every client matching selector at once. The results
+ * are gathered until all of them have replied or timeout seconds have passed,
+ * and then printed together, sorted by host.
+ */
+void fan_out(char* selector, char* cmd, int timeout)
+{
+	if (gather_active)
+		finish_gather();
+
+	int len = strlen(cmd) + 1;
+	gather_active = TRUE;
+	gather_shards = shard_count;
+	snprintf(gather_selector, sizeof(gather_selector), "%s", selector);
+	trace(TR_GATHER, 'b', ++gather_seq, cmd, len);
+	struct itimerspec deadline = { .it_value = { .tv_sec = timeout } };
+	if (timerfd_settime(gather_timer, 0, &deadline, NULL) == -1)
+		perrorize("fan_out: timerfd_settime", errno);
+	post_all(M_FAN_OUT, gather_seq, selector, cmd, len);
+}
+
+/*
+ * Sends cmd to the TMs of the shard's clients that match selector, and tells
+ * shard 0 which ones, before any of their replies. The cmd goes as #<seq> <cmd>,
+ * and the TM puts #<seq> before its result, so a result that comes in late
+ * isn't taken for the reply to a later gather.
+ */
+void send_to_matching(char* selector, char* cmd, int len, int seq)
+{
+	char tagged[MAX_FRAME];
+	int n = snprintf(tagged, sizeof(tagged), "#%d %.*s", seq, len, cmd) + 1;
+	if (n > MAX_FRAME)
+		n = MAX_FRAME;
+	clnode* clptr;
+	for (clptr = self->clients; clptr; clptr = clptr->next)
+	{
+		client* cl = clptr->cl;
+		if (!matches(cl, selector))
+			continue;
+		free(cl->reply);
+		cl->reply = malloc(REPLY_SIZE);
+		cl->reply_len = 0;
+		cl->gather = seq;
+		post(&shards[0], client_message(M_TARGET, seq, cl));
+		send_cmd(cl->tm->cmd_to, tagged, n);
+	}
+	post(&shards[0], new_message(M_TARGETS_DONE, seq));
+}
+
+/*
+ * selector is all, *, or a shell-style pattern for <ip> or <ip>:<port>.
+ */
+int matches(client* cl, char* selector)
+{
+	if (!strcmp(selector, "all") || !strcmp(selector, "*"))
+		return TRUE;
+	char addr[INET_ADDRSTRLEN + 7];
+	snprintf(addr, sizeof(addr), "%s:%d", cl->ip_str, cl->port);
+	return !fnmatch(selector, addr, 0) || !fnmatch(selector, cl->ip_str, 0);
+}
+
+/*
+ * Reads what there is of the #<gather> tag at the start of a result, which
+ * may come in pieces. Returns how many bytes of buff it took.
+ */
+int read_tag(client* cl, char* buff, int len)
+{
+	int i = 0;
+	if (!cl->in_result)
+	{
+		cl->in_result = TRUE;
+		cl->result_gather = 0;
+		cl->tagging = (buff[0] == '#');
+		i = cl->tagging;
+	}
+	for (; cl->tagging && i < len; i++)
+	{
+		if (isdigit((unsigned char) buff[i]))
+			cl->result_gather = cl->result_gather * 10 + buff[i] - '0';
+		else
+		{
+			cl->tagging = FALSE;
+			if (buff[i] != ' ') // the space after it is part of the tag
+				break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Handles output from a client's result pipe: buffers it if it is the reply to
+ * the gather the client is part of, and prints it right away otherwise. A
+ * complete reply goes to shard 0.
+ */
+void collect_result(client* cl, char* buff, int len)
+{
+	trace(TR_RESULT, 'i', len, NULL, 0);
+	while (len > 0)
+	{
+		int tag = read_tag(cl, buff, len);
+		buff += tag;
+		len -= tag;
+		if (!len)
+			break;
+		char* end = memchr(buff, END_OF_RESULT, len);
+		int n = end ? end - buff:len;
+		if (cl->reply && cl->result_gather == cl->gather)
+		{
+			int room = REPLY_SIZE - cl->reply_len;
+			memcpy(cl->reply + cl->reply_len, buff, (n < room) ? n:room);
+			cl->reply_len += (n < room) ? n:room;
+			if (end)
+			{
+				message* m = client_message(M_REPLY, cl->gather, cl);
+				m->flag = TRUE;
+				m->text = cl->reply;
+				m->len = cl->reply_len;
+				cl->reply = NULL;
+				post(&shards[0], m);
+			}
+		}
+		else if (n > 0)
+		{
+			console_write(buff, n);
+		}
+		if (end)
+		{
+			n++;
+			cl->in_result = FALSE;
+		}
+		buff += n;
+		len -= n;
+	}
+}
+
+/*
+ * Takes a client that is going away out of the gather in progress.
+ */
+void drop_from_gather(client* cl)
+{
+	if (!cl->reply)
+		return;
+	logify(LOG_WARN, "%s:%d disconnected before replying.\n", cl->ip_str, cl->port);
+	free(cl->reply);
+	cl->reply = NULL;
+	post(&shards[0], client_message(M_REPLY, cl->gather, cl));
+}
+
+/*
+ * The gather has been printed without the replies of some of the shard's
+ * clients: what they have sent so far is printed now, and the rest as it comes.
+ */
+void let_go_of_gather(int seq)
+{
+	clnode* clptr;
+	for (clptr = self->clients; clptr; clptr = clptr->next)
+	{
+		client* cl = clptr->cl;
+		if (!cl->reply || cl->gather != seq)
+			continue;
+		print_reply(cl->ip_str, cl->port, cl->reply, cl->reply_len);
+		free(cl->reply);
+		cl->reply = NULL;
+	}
+}
+
+/*
+ * Shard 0: a client the gather's cmd went to.
+ */
+void add_target(message* m)
+{
+	if (!gather_active || m->seq != gather_seq || gather_count == MAX_CLIENTS)
+		return;
+	gather_target* t = &gather_targets[gather_count++];
+	t->cl = m->cl;
+	snprintf(t->ip_str, sizeof(t->ip_str), "%.*s", (int) sizeof(t->ip_str) - 1, m->arg);
+	t->port = m->port;
+	t->reply = NULL;
+	t->reply_len = 0;
+	t->replied = FALSE;
+	gather_waiting++;
+}
+
+/*
+ * Shard 0: a target has replied, or gone away. A reply too late for its gather
+ * is printed on its own.
+ */
+void take_reply(message* m)
+{
+	int i;
+	for (i = 0; gather_active && m->seq == gather_seq && i < gather_count; i++)
+	{
+		gather_target* t = &gather_targets[i];
+		if (t->cl != m->cl)
+			continue;
+		gather_waiting--;
+		if (m->flag)
+		{
+			t->reply = m->text;
+			t->reply_len = m->len;
+			t->replied = TRUE;
+			m->text = NULL;
+		}
+		else
+		{
+			*t = gather_targets[--gather_count];
+		}
+		check_gather();
+		return;
+	}
+	if (m->flag)
+		print_reply(m->arg, m->port, m->text, m->len);
+}
+
+/*
+ * Shard 0: finishes the gather once every shard has sent the cmd, and every
+ * target has replied.
+ */
+void check_gather()
+{
+	if (gather_active && !gather_shards && !gather_waiting)
+		finish_gather();
+}
+
+/*
+ * Prints the gathered results, each line prefixed by the client it came from.
+ */
+void finish_gather()
+{
+	trace(TR_GATHER, 'e', gather_seq, NULL, 0);
+	struct itimerspec disarm = { 0 };
+	timerfd_settime(gather_timer, 0, &disarm, NULL);
+	gather_active = FALSE;
+	if (!gather_count)
+		printify("Couldn't find client %s\n", gather_selector);
+
+	qsort(gather_targets, gather_count, sizeof(gather_target), compare_targets);
+	int i;
+	for (i = 0; i < gather_count; i++)
+	{
+		gather_target* t = &gather_targets[i];
+		print_reply(t->ip_str, t->port, t->reply, t->reply_len);
+		if (!t->replied)
+		{
+			char host[INET_ADDRSTRLEN + 7];
+			snprintf(host, sizeof(host), "%s:%d", t->ip_str, t->port);
+			printify("%-21s %s (no reply within the deadline)\n", host, VERTICAL_LINE);
+		}
+		free(t->reply);
+		t->reply = NULL;
+	}
+	// some shards still have replies coming in for it
+	if (gather_shards || gather_waiting)
+		post_all(M_GATHER_OVER, gather_seq, NULL, NULL, 0);
+	gather_count = 0;
+	gather_waiting = 0;
+	gather_shards = 0;
+}
+
+/*
+ * Prints a reply, each line prefixed by the client it came from.
+ */
+void print_reply(char* ip_str, int port, char* reply, int len)
+{
+	char host[INET_ADDRSTRLEN + 7];
+	snprintf(host, sizeof(host), "%s:%d", ip_str, port);
+	char* line = reply;
+	char* end = reply + len;
+	while (line < end)
+	{
+		char* eol = memchr(line, '\n', end - line);
+		char* next = eol ? eol + 1:end;
+		printify("%-21s %s ", host, VERTICAL_LINE);
+		console_write(line, next - line);
+		if (!eol)
+			console_write("\n", 1);
+		line = next;
+	}
+}
+
+int compare_targets(const void* a, const void* b)
+{
+	const gather_target* t1 = a;
+	const gather_target* t2 = b;
+	struct in_addr ip1, ip2;
+	int v1 = (inet_pton(AF_INET, t1->ip_str, &ip1) == 1);
+	int v2 = (inet_pton(AF_INET, t2->ip_str, &ip2) == 1);
+	// addresses in numeric order, then whatever isn't one ("unix") by name
+	if (v1 != v2)
+		return (v1) ? -1:1;
+	if (v1 && ip1.s_addr != ip2.s_addr)
+		return (ntohl(ip1.s_addr) < ntohl(ip2.s_addr)) ? -1:1;
+	if (!v1)
+	{
+		int r = strcmp(t1->ip_str, t2->ip_str);
+		if (r)
+			return r;
+	}
+	return t1->port - t2->port;
+}
+
+/*
+ * Asks every shard about its clients, for list or for disconnect <ip>:<port>.
+ * The outcome is printed once all of them have answered.
+ */
+void start_query(int type, char* ip_str, int port)
+{
+	if (query.waiting)
+		finish_query();
+	query.type = type;
+	query.waiting = shard_count;
+	query.found = FALSE;
+	query.len = 0;
+	query.seq++;
+	snprintf(query.what, sizeof(query.what), "%s:%d", ip_str, port);
+	int i;
+	for (i = 0; i < shard_count; i++)
+	{
+		message* m = new_message(type, query.seq);
+		snprintf(m->arg, sizeof(m->arg), "%s", ip_str);
+		m->port = port;
+		post(&shards[i], m);
+	}
+}
+
+/*
+ * Shard 0: a shard's answer to the query.
+ */
+void take_answer(message* m)
+{
+	if (!query.waiting || m->seq != query.seq)
+		return;
+	query.found |= m->flag;
+	if (m->len)
+	{
+		query.rows = realloc(query.rows, query.len + m->len);
+		memcpy(query.rows + query.len, m->text, m->len);
+		query.len += m->len;
+	}
+	if (--query.waiting == 0)
+		finish_query();
+}
+
+void finish_query()
+{
+	query.waiting = 0;
+	if (query.type == M_LIST)
+	{
+		hr();
+		printify(" %-6s %s %-11s %s %-5s\n", "PID", VERTICAL_LINE, "IP", VERTICAL_LINE, "PORT");
+		hr();
+		console_write(query.rows, query.len);
+		hr();
+	}
+	else if (!query.found)
+	{
+		printify("Couldn't find client %s\n", query.what);
+	}
+}
+
+/*
+ * Formats a row of the list for each of the shard's clients. Returns the
+ * length of the rows, which are in *rows for the caller to free.
+ */
+int list_clients(char** rows)
+{
+	int len = 0;
+	*rows = NULL;
+	clnode* clptr;
+	for(clptr = self->clients; clptr; clptr = clptr->next)
+	{
+		client* cl = clptr->cl;
+		char restarts[BUFF_SIZE] = "";
+		if (cl->respawns)
+			snprintf(restarts, BUFF_SIZE, " restarted %dx, last: %s", cl->respawns, cl->crash);
+		char throttled[BUFF_SIZE] = "";
+		if (cl->throttles)
+			snprintf(throttled, BUFF_SIZE, " %d cmds, %d throttled, %.1fs waiting%s", cl->cmds, cl->throttles,
+				cl->throttled_total_ns / 1e9, cl->throttled_ns ? " (throttled)":"");
+		char row[LOG_LINE];
+		int n = snprintf(row, sizeof(row), " %-6d %s %-11s %s %-5d%s%s%s\n", cl->tm->pid, VERTICAL_LINE, cl->ip_str,
+			VERTICAL_LINE, cl->port, cl->parked ? " (detached)":"", restarts, throttled);
+		if (n >= sizeof(row))
+			n = sizeof(row) - 1;
+		*rows = realloc(*rows, len + n);
+		memcpy(*rows + len, row, n);
+		len += n;
+	}
+	return len;
+}
+
+void register_signal_handlers()
+{
+	// TMs are reaped through their pidfds, not in a SIGCHLD handler
+	if (signal(SIGINT, exit_handler) == SIG_ERR)
+	{
+		perrorize("signal: SIGINT", errno);
+		exit(EXIT_FAILURE);
+	}
+	if (signal(SIGTERM, exit_handler) == SIG_ERR)
+	{
+		perrorize("signal: SIGTERM", errno);
+		exit(EXIT_FAILURE);
+	}
+	if (signal(SIGUSR1, trace_handler) == SIG_ERR)
+	{
+		perrorize("signal: SIGUSR1", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void add_connection_listener()
+{
+	struct epoll_event incoming_connection_event;
+	incoming_connection_event.data.fd = sock;
+	incoming_connection_event.events = EPOLLIN;
+	int r = epoll_ctl(self->epfd, EPOLL_CTL_ADD, sock, &incoming_connection_event);
+	if (r == -1)
+	{
+		perrorize("add_connection_listener: epoll_ctl", errno);
+		exit(EXIT_FAILURE);
+	}
+	if (usock == -1)
+		return;
+	incoming_connection_event.data.fd = usock;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, usock, &incoming_connection_event) == -1)
+	{
+		perrorize("add_connection_listener: epoll_ctl", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void add_stdin_listener()
+{
+	struct epoll_event user_input;
+	user_input.data.fd = STDIN_FILENO;
+	user_input.events = EPOLLIN;
+	int r = epoll_ctl(self->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &user_input);
+	if (r == -1)
+	{
+		perrorize("add_stdin_listener: epoll_ctl", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void add_gather_timer()
+{
+	struct epoll_event timeout;
+	timeout.data.fd = gather_timer;
+	timeout.events = EPOLLIN;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, gather_timer, &timeout) == -1)
+	{
+		perrorize("add_gather_timer: epoll_ctl", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void add_greeting_timer()
+{
+	struct epoll_event timeout;
+	timeout.data.fd = greeting_timer;
+	timeout.events = EPOLLIN;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, greeting_timer, &timeout) == -1)
+	{
+		perrorize("add_greeting_timer: epoll_ctl", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void add_client(int listener)
+{
+	struct sockaddr_storage* cl_info = malloc(sizeof(*cl_info));
+	socklen_t length = sizeof(*cl_info);
+
+	int msgsock = accept4(listener, (struct sockaddr *) cl_info, &length, SOCK_CLOEXEC);
 	if (msgsock == -1)
 	{
-		perror("accept");
-		free(cl_info);
-		return;
+		perrorize("accept", errno);
+		free(cl_info);
+		return;
+	}
+	if (__atomic_load_n(&client_count, __ATOMIC_RELAXED) + __atomic_load_n(&greeting_count, __ATOMIC_RELAXED) >= max_clients)
+	{
+		// turned away; left in the backlog, it would keep the listener readable
+		close(msgsock);
+		free(cl_info);
+		return;
+	}
+	register_client(msgsock, cl_info);
+}
+
+/*
+ * Starts listening for the first frame of a newly accepted connection, which
+ * decides whether it gets a new TM or resumes a session.
+ */
+void register_client(int msgsock, struct sockaddr_storage* cl_info)
+{
+	trace(TR_ACCEPT, 'i', msgsock, NULL, 0);
+	if (cl_info->ss_family == AF_UNIX && !peer_allowed(msgsock))
+	{
+		close(msgsock);
+		free(cl_info);
+		return;
+	}
+	if (cl_info->ss_family != AF_UNIX)
+	{
+		// so that a client that has dropped off the network is noticed, and its session kept
+		int on = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, count = KEEPALIVE_COUNT;
+		setsockopt(msgsock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+		setsockopt(msgsock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		setsockopt(msgsock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+		setsockopt(msgsock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+		// a reply goes out in several small writes, ending with its terminator;
+		// Nagle would hold that back until the client's delayed ACK, ~40ms later
+		setsockopt(msgsock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+
+	client* cl = make_client(NULL, msgsock, cl_info);
+	if (backend == BACKEND_URING)
+	{
+		uring_arm_greeting(cl);
+	}
+	else
+	{
+		struct epoll_event cl_input;
+		cl_input.data.ptr = cl;
+		cl_input.events = EPOLLIN;
+		if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, msgsock, &cl_input) == -1)
+		{
+			perrorize("register_client: epoll_ctl", errno);
+			close(msgsock);
+			free_client(cl);
+			return;
+		}
+	}
+	__atomic_add_fetch(&greeting_count, 1, __ATOMIC_RELAXED);
+	cl->greeting_deadline_ns = monotonic_ns() + GREETING_TIMEOUT_MS * 1000000ULL;
+	clnode* node = malloc(sizeof(*node));
+	node->cl = cl;
+	node->next = greetings;
+	if (!greetings)
+		set_greeting_timer(cl->greeting_deadline_ns);
+	greetings = node;
+}
+
+/*
+ * Only lets in local clients running as the same user as the server, or as root.
+ */
+int peer_allowed(int msgsock)
+{
+	struct ucred cred;
+	socklen_t length = sizeof(cred);
+	if (getsockopt(msgsock, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1)
+	{
+		perrorize("getsockopt: SO_PEERCRED", errno);
+		return FALSE;
+	}
+	if (cred.uid != 0 && cred.uid != getuid())
+	{
+		logify(LOG_WARN, "Refused local connection from pid %d (uid %d).\n", cred.pid, cred.uid);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Reads the first frame of a connection, without taking it off the socket until
+ * it is known to be hello or attach <token>; anything else is a client that
+ * doesn't do sessions, and is left for its TM. The connection then goes to the
+ * shard of the session it attaches to, or to the next one round.
+ */
+void handle_greeting(client* cl)
+{
+	unsigned char frame[LENGTH_BYTES + MAX_FRAME + 1];
+	int r = recv(cl->msgsock, frame, LENGTH_BYTES + MAX_FRAME, MSG_PEEK | MSG_DONTWAIT);
+	int waiting = (r == -1 && (errno == EAGAIN || errno == EINTR)) || (r > 0 && r < LENGTH_BYTES + frame[0]);
+	if (waiting && monotonic_ns() < cl->greeting_deadline_ns)
+	{
+		// wait for it, or the rest of it
+		if (backend == BACKEND_URING)
+			uring_arm_greeting(cl);
+		return;
+	}
+	drop_greeting(cl);
+	if (backend == BACKEND_EPOLL)
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, cl->msgsock, NULL);
+	if (r <= 0 || waiting)
+	{
+		__atomic_sub_fetch(&greeting_count, 1, __ATOMIC_RELAXED);
+		logify(LOG_INFO, "%s:%d disconnected.\n", cl->ip_str, cl->port);
+		close(cl->msgsock);
+		free_client(cl);
+		return;
+	}
+	char* greeting = (char*) frame + LENGTH_BYTES;
+	greeting[frame[0]] = '\0';
+	if (!strcmp(greeting, "hello") || !strncmp(greeting, "attach ", 7))
+		recv(cl->msgsock, frame, LENGTH_BYTES + frame[0], MSG_DONTWAIT);
+	message* m = new_message(M_SESSION, 0);
+	m->cl = cl;
+	shard* to = &shards[next_shard];
+	if (!strncmp(greeting, "attach ", 7))
+	{
+		snprintf(m->arg, sizeof(m->arg), "%.*s", TOKEN_LEN, greeting + 7);
+		to = &shards[shard_of(m->arg)];
+	}
+	else
+	{
+		next_shard = (next_shard + 1) % shard_count;
+	}
+	post(to, m);
+}
+
+/*
+ * Takes the connection off the list of those waiting to send their greeting.
+ */
+void drop_greeting(client* cl)
+{
+	clnode** link;
+	for (link = &greetings; *link; link = &(*link)->next)
+	{
+		if ((*link)->cl == cl)
+		{
+			clnode* node = *link;
+			*link = node->next;
+			free(node);
+			return;
+		}
+	}
+}
+
+/*
+ * Shuts down the connections whose greeting isn't in after GREETING_TIMEOUT_MS,
+ * which has handle_greeting() close them, and sets the timer for the next one
+ * due. A connection that never sends anything would otherwise keep its place
+ * under max_clients for good.
+ */
+void tend_greetings()
+{
+	uint64_t now = monotonic_ns(), next = 0;
+	clnode** link = &greetings;
+	while (*link)
+	{
+		clnode* node = *link;
+		if (now >= node->cl->greeting_deadline_ns)
+		{
+			logify(LOG_INFO, "%s:%d didn't send a greeting in time.\n", node->cl->ip_str, node->cl->port);
+			shutdown(node->cl->msgsock, SHUT_RDWR);
+			*link = node->next;
+			free(node);
+			continue;
+		}
+		if (!next || node->cl->greeting_deadline_ns < next)
+			next = node->cl->greeting_deadline_ns;
+		link = &node->next;
+	}
+	set_greeting_timer(next);
+}
+
+/*
+ * Arms the greeting timer for at_ns on the monotonic clock, or disarms it for 0.
+ */
+void set_greeting_timer(uint64_t at_ns)
+{
+	struct itimerspec at = { .it_value = { .tv_sec = at_ns / 1000000000ULL, .tv_nsec = at_ns % 1000000000ULL } };
+	if (timerfd_settime(greeting_timer, TFD_TIMER_ABSTIME, &at, NULL) == -1)
+		perrorize("set_greeting_timer: timerfd_settime", errno);
+}
+
+/*
+ * Starts a TM for the client and starts listening to it, on this shard.
+ */
+void start_session(client* cl)
+{
+	make_token(cl->token);
+	cl->token[0] = "0123456789abcdef"[self->id];
+	task_manager* tm = make_TM(cl->msgsock, cl->token, FALSE);
+	if (!tm)
+	{
+		logify(LOG_ERROR, "Failed to start TM\n");
+		close(cl->msgsock);
+		free_client(cl);
+		return;
+	}
+	cl->tm = tm;
+	// printify("TM started.\n");
+
+	if (add_client_listeners(cl) != 0)
+	{
+		perrorize("cl_input: epoll_ctl", errno);
+		free_client(cl);
+		return;
+	}
+	// printify("Client-listener added.\n");
+
+	add_to_client_list(cl);
+}
+
+/*
+ * Hands the client's socket to the TM of the session with the given token, which
+ * takes over from there. Returns FALSE if there is no such session.
+ */
+int resume_session(client* cl, char* token)
+{
+	clnode* clptr;
+	for (clptr = self->clients; clptr; clptr = clptr->next)
+	{
+		if (!strcmp(clptr->cl->token, token))
+			break;
+	}
+	if (!clptr || !pass_socket(clptr->cl->tm->cmd_to, cl->msgsock))
+		return FALSE;
+	client* session = clptr->cl;
+	logify(LOG_INFO, "%s:%d resumed the session of %s:%d.\n", cl->ip_str, cl->port, session->ip_str, session->port);
+	// the TM closes the old connection, if it's still there, when it switches over.
+	// Our copy of the new one is for restarting the TM on it if it crashes.
+	if (session->msgsock != -1)
+		close(session->msgsock);
+	session->msgsock = cl->msgsock;
+	free(session->info);
+	free(session->ip_str);
+	session->info = cl->info;
+	session->ip_str = cl->ip_str;
+	session->port = cl->port;
+	free(cl);
+	return TRUE;
+}
+
+/*
+ * Sends the attach cmd to a TM, with msgsock attached.
+ */
+int pass_socket(int fd, int msgsock)
+{
+	char frame[] = { sizeof("attach"), 'a', 't', 't', 'a', 'c', 'h', '\0' };
+	struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &msgsock, sizeof(int));
+	if (sendmsg(fd, &msg, 0) == -1)
+	{
+		perrorize("pass_socket: sendmsg", errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void make_token(char* token)
+{
+	unsigned char bytes[TOKEN_LEN / 2];
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+	{
+		// not secret then, but still unique enough to tell sessions apart
+		uint64_t x = ((uint64_t) getpid() << 32) ^ (uint64_t) time(NULL) ^ (uintptr_t) token;
+		memcpy(bytes, &x, sizeof(bytes));
+	}
+	int i;
+	for (i = 0; i < TOKEN_LEN / 2; i++)
+		sprintf(token + 2 * i, "%02x", bytes[i]);
+}
+
+client* make_client(task_manager* tm, int msgsock, struct sockaddr_storage* cl_info)
+{
+	client* cl = malloc(sizeof(*cl));
+
+	char* ipbuf = malloc(INET_ADDRSTRLEN);
+	cl->tm = tm;
+	cl->msgsock = msgsock;
+	cl->ip_str = ipbuf;
+	if (cl_info->ss_family == AF_UNIX)
+	{
+		// local clients are told apart by their pid
+		struct ucred cred;
+		socklen_t length = sizeof(cred);
+		getsockopt(msgsock, SOL_SOCKET, SO_PEERCRED, &cred, &length);
+		strcpy(ipbuf, "unix");
+		cl->port = cred.pid;
+	}
+	else
+	{
+		struct sockaddr_in* addr = (struct sockaddr_in*) cl_info;
+		inet_ntop(AF_INET, &((addr->sin_addr).s_addr), ipbuf, INET_ADDRSTRLEN);
+		// cl->ip = ((addr->sin_addr).s_addr);
+		cl->port = ntohs(addr->sin_port);
+	}
+	cl->info = cl_info;
+	cl->reply = NULL;
+	cl->reply_len = 0;
+	cl->gather = 0;
+	cl->in_result = FALSE;
+	cl->tagging = FALSE;
+	cl->result_gather = 0;
+	cl->slot = -1;
+	cl->frame_len = 0;
+	cl->busy = FALSE;
+	cl->deficit = 0;
+	cl->tokens = cmd_rate;
+	cl->refilled_ns = monotonic_ns();
+	cl->throttled_ns = 0;
+	cl->unthrottle_ns = 0;
+	cl->cmds = 0;
+	cl->throttles = 0;
+	cl->throttled_total_ns = 0;
+	cl->token[0] = '\0';
+	cl->parked = FALSE;
+	cl->respawns = 0;
+	cl->crash[0] = '\0';
+	cl->gone = FALSE;
+	logify(LOG_INFO, "%s:%d has connected.\n", cl->ip_str, cl->port);
+	return cl;
+}
+
+task_manager* make_TM(int msgsock, char* token, int restarted)
+{
+	if (shared_mode)
+		return share_TM(msgsock, token);
+	int p2c_cmd[2];
+	int p2c_res[2];
+	int c2p_cmd[2];
+	int c2p_res[2];
+	int exec_check_pipe[2];
+	// close-on-exec, so that TMs don't hold on to each other's pipes; dup2 clears
+	// the flag on the copies a TM gets
+	// cmds go over a socket, so that the socket of a resuming client can go with them
+	if ((pipe2(exec_check_pipe, O_CLOEXEC) == -1) ||
+		(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, p2c_cmd) == -1) ||
+		(pipe2(p2c_res, O_NONBLOCK | O_CLOEXEC) == -1) || (pipe2(c2p_cmd, O_NONBLOCK | O_CLOEXEC) == -1) ||
+		(pipe2(c2p_res, O_NONBLOCK | O_CLOEXEC) == -1))
+	{
+		perrorize("pipe", errno);
+		return NULL;
+	}
+	trace(TR_SPAWN, 'B', 0, NULL, 0);
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		trace(TR_SPAWN, 'E', -1, NULL, 0);
+		perrorize("add_process: fork", errno);
+		shutdown(msgsock, SHUT_RDWR);
+		close(msgsock);
+		return NULL;
+	}
+	if (pid > 0) // parent
+	{
+		close(exec_check_pipe[WRITE_END]);
+		close(p2c_cmd[READ_END]);
+		close(p2c_res[READ_END]);
+		close(c2p_cmd[WRITE_END]);
+		close(c2p_res[WRITE_END]);
+		char c = 0;
+		if (read(exec_check_pipe[READ_END], &c, 1) == -1)
+		{
+			trace(TR_SPAWN, 'E', -1, NULL, 0);
+			perrorize("pipe read", errno);
+			close(exec_check_pipe[READ_END]);
+			close(p2c_cmd[WRITE_END]);
+			close(p2c_res[WRITE_END]);
+			close(c2p_cmd[READ_END]);
+			close(c2p_res[READ_END]);
+			return NULL;
+		}
+		if (c == EXEC_FAILED)
+		{
+			trace(TR_SPAWN, 'E', -1, NULL, 0);
+			logify(LOG_ERROR, "exec failed\n");
+			waitpid(pid, NULL, 0);
+			close(exec_check_pipe[READ_END]);
+			close(p2c_cmd[WRITE_END]);
+			close(p2c_res[WRITE_END]);
+			close(c2p_cmd[READ_END]);
+			close(c2p_res[READ_END]);
+			return NULL;
+		}
+		close(exec_check_pipe[READ_END]);
+		trace(TR_SPAWN, 'E', pid, NULL, 0);
+	}
+	else // child
+	{
+		close(exec_check_pipe[READ_END]);
+		close(p2c_cmd[WRITE_END]);
+		close(p2c_res[WRITE_END]);
+		close(c2p_cmd[READ_END]);
+		close(c2p_res[READ_END]);
+		char c = EXEC_FAILED;
+		// keep the exec check pipe out of the way of the fds being replaced
+		int exec_check = fcntl(exec_check_pipe[WRITE_END], F_DUPFD_CLOEXEC, LOG_FD + 1);
+		close(exec_check_pipe[WRITE_END]);
+		// forked from a shard's thread, which has every signal blocked
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		// replace fds
+		close(STDIN_FILENO);
+		if ((dup2(msgsock, CL_IN) == -1) || (dup2(msgsock, CL_OUT) == -1) || 
+			(dup2(p2c_cmd[READ_END], SV_TO_TM_CMD) == -1) || (dup2(c2p_cmd[WRITE_END], TM_TO_SV_CMD) == -1) || 
+			(dup2(p2c_res[READ_END], SV_TO_TM_RESULT) == -1) || (dup2(c2p_res[WRITE_END], TM_TO_SV_RESULT) == -1) ||
+			(dup2(logger.tm_end, LOG_FD) == -1))
+		{
+			perror("dup2");
+			write(exec_check, &c, 1);
+			_exit(EXIT_FAILURE);
+		}
+		// launch the task manager
+		if (execl("./tm", "tm", token, restarted ? "restarted":NULL, NULL) == -1)
+		{
+			perror("exec");
+			write(exec_check, &c, 1);
+		}
+		_exit(EXIT_FAILURE);
+	}
+	task_manager* tm = malloc(sizeof(*tm));
+	tm->pid = pid;
+	tm->pidfd = syscall(__NR_pidfd_open, pid, 0);
+	tm->reaped = FALSE;
+	tm->cmd_from = c2p_cmd[READ_END];
+	tm->result_from = c2p_res[READ_END];
+	tm->cmd_to = p2c_cmd[WRITE_END];
+	tm->result_to = p2c_res[WRITE_END];
+	return tm;
+}
+
+/*
+ * -m: hands the client's session to the shared TM, instead of starting a TM
+ * for it. The session gets the same pipes as a TM of its own, so the rest of
+ * the server doesn't tell the two apart; the shared TM gets "session <token>"
+ * with the client's socket and its ends of the pipes attached.
+ */
+task_manager* share_TM(int msgsock, char* token)
+{
+	int p2c_cmd[2];
+	int p2c_res[2];
+	int c2p_cmd[2];
+	int c2p_res[2];
+	if ((socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, p2c_cmd) == -1) ||
+		(pipe2(p2c_res, O_NONBLOCK | O_CLOEXEC) == -1) || (pipe2(c2p_cmd, O_NONBLOCK | O_CLOEXEC) == -1) ||
+		(pipe2(c2p_res, O_NONBLOCK | O_CLOEXEC) == -1))
+	{
+		perrorize("pipe", errno);
+		return NULL;
+	}
+	char text[TOKEN_LEN + 16];
+	int len = snprintf(text, sizeof(text), "session %s", token);
+	int fds[] = { msgsock, p2c_cmd[READ_END], p2c_res[READ_END], c2p_cmd[WRITE_END], c2p_res[WRITE_END] };
+	struct iovec iov = { .iov_base = text, .iov_len = len };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	int r = sendmsg(shared_tm.cmd_to, &msg, MSG_NOSIGNAL);
+	int eno = errno;
+	close(p2c_cmd[READ_END]);
+	close(p2c_res[READ_END]);
+	close(c2p_cmd[WRITE_END]);
+	close(c2p_res[WRITE_END]);
+	if (r == -1)
+	{
+		perrorize("share_TM: sendmsg", eno);
+		close(p2c_cmd[WRITE_END]);
+		close(p2c_res[WRITE_END]);
+		close(c2p_cmd[READ_END]);
+		close(c2p_res[READ_END]);
+		return NULL;
+	}
+	task_manager* tm = malloc(sizeof(*tm));
+	tm->pid = shared_tm.pid;
+	tm->pidfd = -1;
+	tm->reaped = FALSE;
+	tm->cmd_from = c2p_cmd[READ_END];
+	tm->result_from = c2p_res[READ_END];
+	tm->cmd_to = p2c_cmd[WRITE_END];
+	tm->result_to = p2c_res[WRITE_END];
+	return tm;
+}
+
+/*
+ * -m: starts the TM that serves every session, on a control socket the
+ * sessions are handed over on. Returns -1 if it couldn't be started.
+ */
+int start_shared_TM()
+{
+	int ctl[2];
+	int exec_check_pipe[2];
+	if ((pipe2(exec_check_pipe, O_CLOEXEC) == -1) ||
+		(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) == -1))
+	{
+		perrorize("pipe", errno);
+		return -1;
+	}
+	trace(TR_SPAWN, 'B', 0, NULL, 0);
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		trace(TR_SPAWN, 'E', -1, NULL, 0);
+		perrorize("start_shared_TM: fork", errno);
+		close(exec_check_pipe[READ_END]);
+		close(exec_check_pipe[WRITE_END]);
+		close(ctl[0]);
+		close(ctl[1]);
+		return -1;
+	}
+	if (pid == 0) // child
+	{
+		close(exec_check_pipe[READ_END]);
+		char c = EXEC_FAILED;
+		int exec_check = fcntl(exec_check_pipe[WRITE_END], F_DUPFD_CLOEXEC, LOG_FD + 1);
+		close(exec_check_pipe[WRITE_END]);
+		close(STDIN_FILENO);
+		if ((dup2(ctl[1], CONTROL_FD) == -1) || (dup2(logger.tm_end, LOG_FD) == -1))
+		{
+			perror("dup2");
+			write(exec_check, &c, 1);
+			_exit(EXIT_FAILURE);
+		}
+		if (execl("./tm", "tm", "--shared", NULL) == -1)
+		{
+			perror("exec");
+			write(exec_check, &c, 1);
+		}
+		_exit(EXIT_FAILURE);
+	}
+	close(exec_check_pipe[WRITE_END]);
+	close(ctl[1]);
+	char c = 0;
+	if (read(exec_check_pipe[READ_END], &c, 1) == -1 || c == EXEC_FAILED)
+	{
+		trace(TR_SPAWN, 'E', -1, NULL, 0);
+		waitpid(pid, NULL, 0);
+		close(exec_check_pipe[READ_END]);
+		close(ctl[0]);
+		return -1;
+	}
+	close(exec_check_pipe[READ_END]);
+	trace(TR_SPAWN, 'E', pid, NULL, 0);
+	shared_tm.pid = pid;
+	shared_tm.pidfd = syscall(__NR_pidfd_open, pid, 0);
+	shared_tm.reaped = FALSE;
+	if (shared_tm.cmd_to != -1)
+	{
+		// shards may be handing sessions over on it right now: a restarted
+		// TM's control socket takes the place of the old one, on the same fd
+		dup3(ctl[0], shared_tm.cmd_to, O_CLOEXEC);
+		close(ctl[0]);
+	}
+	else
+	{
+		shared_tm.cmd_to = ctl[0];
+	}
+	logify(LOG_INFO, "Sessions are served by TM %d.\n", pid);
+	return 0;
+}
+
+/*
+ * Has the event loop tell us when the shared TM exits.
+ */
+void watch_shared_TM()
+{
+	if (backend == BACKEND_URING)
+	{
+		uring_poll(shared_tm.pidfd, REQ_SHARED_TM);
+		return;
+	}
+	struct epoll_event tm_exit;
+	tm_exit.data.u64 = 0;
+	tm_exit.data.fd = shared_tm.pidfd;
+	tm_exit.events = EPOLLIN;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, shared_tm.pidfd, &tm_exit) == -1)
+		perrorize("watch_shared_TM: epoll_ctl", errno);
+}
+
+/*
+ * The shared TM has exited, and taken every session with it; each client goes
+ * as its pipes reach EOF. New connections get a new shared TM.
+ */
+void handle_shared_TM_exit()
+{
+	siginfo_t info;
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_PIDFD, shared_tm.pidfd, &info, WEXITED | WNOHANG) == -1 || info.si_pid == 0)
+		return;
+	trace(TR_REAP, 'i', info.si_pid, NULL, 0);
+	char why[64];
+	describe_exit(&info, why, sizeof(why));
+	logify(LOG_ERROR, "Shared TM %d %s; its sessions are gone.\n", shared_tm.pid, why);
+	if (backend == BACKEND_EPOLL)
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, shared_tm.pidfd, NULL);
+	close(shared_tm.pidfd);
+	shared_tm.pidfd = -1;
+	if (start_shared_TM() == -1)
+	{
+		logify(LOG_ERROR, "Failed to restart the shared TM\n");
+		exit_gracefully();
+	}
+	watch_shared_TM();
+}
+
+int add_client_listeners(client* cl)
+{
+	if (backend == BACKEND_URING)
+		return uring_add_client(cl);
+	struct epoll_event cl_input;
+	cl_input.data.ptr = cl;
+	cl_input.events = EPOLLIN;
+	struct epoll_event tm_exit;
+	tm_exit.data.u64 = (uintptr_t) cl | EV_TM_EXIT;
+	tm_exit.events = EPOLLIN;
+	return  epoll_ctl(self->epfd, EPOLL_CTL_ADD, cl->tm->cmd_from, &cl_input) +
+			epoll_ctl(self->epfd, EPOLL_CTL_ADD, cl->tm->result_from, &cl_input) +
+			((cl->tm->pidfd == -1) ? 0:epoll_ctl(self->epfd, EPOLL_CTL_ADD, cl->tm->pidfd, &tm_exit));
+}
+
+void rm_client_listeners(client* cl)
+{
+	if (backend == BACKEND_URING)
+	{
+		uring_rm_client(cl);
+		return;
+	}
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, cl->tm->cmd_from, NULL);
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, cl->tm->result_from, NULL);
+	if (cl->tm->pidfd != -1)
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, cl->tm->pidfd, NULL);
+	// printify("listener removed\n");
+}
+
+void add_to_client_list(client* cl)
+{
+	clnode* new_node = malloc(sizeof(*new_node));
+	new_node->cl = cl;
+	new_node->next = self->clients;
+	self->clients = new_node;
+	__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED);
+}
+
+void initialize_server()
+{
+	fit_fd_limit();
+	make_socket();
+	bind_socket();
+	print_port();
+	listen(sock, SOMAXCONN);
+	if (usock_path)
+		make_unix_socket(usock_path);
+}
+
+/*
+ * Raises the fd limit as far as MAX_CLIENTS needs, or as far as it goes, and
+ * takes no more clients than the fds allow, so that accept never fails for
+ * want of one.
+ */
+void fit_fd_limit()
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	rlim_t want = RESERVED_FDS + (rlim_t) MAX_CLIENTS * FDS_PER_CLIENT;
+	if (rl.rlim_cur < want)
+	{
+		rl.rlim_cur = (rl.rlim_max < want) ? rl.rlim_max:want;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur < want)
+	{
+		max_clients = (rl.rlim_cur > RESERVED_FDS) ? (rl.rlim_cur - RESERVED_FDS) / FDS_PER_CLIENT:1;
+		logify(LOG_WARN, "The fd limit (%llu) leaves room for %d clients.\n", (unsigned long long) rl.rlim_cur, max_clients);
+	}
+}
+
+void make_socket()
+{
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) 
+	{
+		perrorize("opening stream socket", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void make_unix_socket(char* path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Unix socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	usock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (usock < 0)
+	{
+		perrorize("opening unix socket", errno);
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	// a socket left behind by a previous run; anything else there is kept, and bind fails
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(usock, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		perrorize("binding unix socket", errno);
+		exit(EXIT_FAILURE);
+	}
+	listen(usock, SOMAXCONN);
+	logify(LOG_INFO, "Unix socket at %s\n", path);
+}
+
+void print_port()
+{
+	socklen_t length = sizeof(server);
+	if (getsockname(sock, (struct sockaddr *) &server, &length)) 
+	{
+		perrorize("getting socket name", errno);
+		exit(1);
+	}
+	logify(LOG_INFO, "Socket has port #%d\n", ntohs(server.sin_port));
+}
+
+void bind_socket()
+{
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = INADDR_ANY;
+	server.sin_port = 0;
+	if (bind(sock, (struct sockaddr *) &server, sizeof(server))) 
+	{
+		perrorize("binding stream socket", errno);
+		exit(EXIT_FAILURE);
+	}	
+}
+
+void free_client(client* cl)
+{
+	assert(cl != NULL);
+	free(cl->tm);
+	free(cl->info);
+	free(cl->ip_str);
+	free(cl);
+}
+
+void disconnect_client(client* cl)
+{
+	assert(cl != NULL);
+	assert(cl->tm != NULL);
+	if (cl->msgsock != -1)
+	{
+		shutdown(cl->msgsock, SHUT_RDWR);
+		close(cl->msgsock);
+	}
+	close_TM(cl->tm);
+	cl->tm = NULL;
+	logify(LOG_INFO, "%s:%d disconnected.\n", cl->ip_str, cl->port);
+}
+
+/*
+ * Closes everything that leads to the TM, and frees it, once it has exited if
+ * it hasn't yet. A session of the shared TM ends when its pipes close.
+ */
+void close_TM(task_manager* tm)
+{
+	close(tm->cmd_from);
+	close(tm->cmd_to);
+	close(tm->result_from);
+	close(tm->result_to);
+	if (tm->pidfd != -1 && !tm->reaped)
+	{
+		let_TM_die(tm);
+		return;
+	}
+	if (tm->pidfd != -1)
+		close(tm->pidfd);
+	free(tm);
+}
+
+/*
+ * Sends the TM SIGTERM and leaves the rest to the event loop, which reaps it
+ * once its pidfd is readable, and sends SIGKILL if it is still around after
+ * STOP_TIMEOUT_MS. Nothing waits for it meanwhile.
+ */
+void let_TM_die(task_manager* tm)
+{
+	kill(tm->pid, SIGTERM);
+	tm->kill_ns = monotonic_ns() + STOP_TIMEOUT_MS * 1000000ULL;
+	tm->next = self->dying;
+	self->dying = tm;
+	if (backend == BACKEND_URING)
+	{
+		uring_poll(tm->pidfd, REQ_TM_DYING);
+	}
+	else
+	{
+		struct epoll_event dying;
+		dying.data.u64 = EV_TM_DYING;
+		dying.events = EPOLLIN;
+		if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, tm->pidfd, &dying) == -1)
+			perrorize("let_TM_die: epoll_ctl", errno);
+	}
+	tend_dying();
+}
+
+/*
+ * Reaps the shard's TMs being stopped that have exited, sends SIGKILL to those
+ * whose time is up, and sets the kill timer for the next one due.
+ */
+void tend_dying()
+{
+	uint64_t now = monotonic_ns(), next = 0;
+	task_manager** link = &self->dying;
+	while (*link)
+	{
+		task_manager* tm = *link;
+		siginfo_t info;
+		memset(&info, 0, sizeof(info));
+		if (waitid(P_PIDFD, tm->pidfd, &info, WEXITED | WNOHANG) == -1 || info.si_pid != 0)
+		{
+			trace(TR_REAP, 'i', tm->pid, NULL, 0);
+			*link = tm->next;
+			close(tm->pidfd); // takes it out of the epoll set too
+			free(tm);
+			continue;
+		}
+		if (tm->kill_ns && now >= tm->kill_ns)
+		{
+			logify(LOG_WARN, "TM %d didn't exit in time; killing it\n", tm->pid);
+			kill(tm->pid, SIGKILL);
+			tm->kill_ns = 0;
+		}
+		if (tm->kill_ns && (!next || tm->kill_ns < next))
+			next = tm->kill_ns;
+		link = &tm->next;
+	}
+	struct itimerspec at = { .it_value = { .tv_sec = next / 1000000000ULL, .tv_nsec = next % 1000000000ULL } };
+	if (timerfd_settime(self->kill_timer, TFD_TIMER_ABSTIME, &at, NULL) == -1)
+		perrorize("tend_dying: timerfd_settime", errno);
+}
+
+/*
+ * On the way out: waits for the shard's TMs being stopped.
+ */
+void reap_dying()
+{
+	int n = 0;
+	task_manager* tm;
+	for (tm = self->dying; tm; tm = tm->next)
+		n++;
+	task_manager** tms = malloc((n ? n:1) * sizeof(*tms));
+	n = 0;
+	for (tm = self->dying; tm; tm = tm->next)
+		tms[n++] = tm;
+	see_TMs_out(tms, n);
+	self->dying = NULL;
+	while (n--)
+	{
+		close(tms[n]->pidfd);
+		free(tms[n]);
+	}
+	free(tms);
+}
+
+/*
+ * Asks all of the TMs to exit at once, then waits for them together.
+ */
+void stop_TMs(task_manager** tms, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		if (!tms[i]->reaped)
+			kill(tms[i]->pid, SIGTERM);
+	}
+	see_TMs_out(tms, n);
+}
+
+/*
+ * Waits for TMs that have been sent SIGTERM. Those that are still around after
+ * STOP_TIMEOUT_MS get SIGKILL, so this never takes more than STOP_TIMEOUT_MS +
+ * KILL_TIMEOUT_MS, however many TMs there are. A second SIGTERM would make a TM
+ * give up on stopping its processes, so they don't get another.
+ */
+void see_TMs_out(task_manager** tms, int n)
+{
+	int i;
+	if (wait_for_TMs(tms, n, STOP_TIMEOUT_MS) == 0)
+		return;
+	for (i = 0; i < n; i++)
+	{
+		if (!tms[i]->reaped)
+		{
+			logify(LOG_WARN, "TM %d didn't exit in time; killing it\n", tms[i]->pid);
+			kill(tms[i]->pid, SIGKILL);
+		}
+	}
+	wait_for_TMs(tms, n, KILL_TIMEOUT_MS);
+}
+
+/*
+ * Polls the pidfds of the TMs that haven't been reaped, and a timerfd for the
+ * deadline, reaping each TM as it exits. Returns how many are left.
+ */
+int wait_for_TMs(task_manager** tms, int n, int timeout_ms)
+{
+	struct pollfd* fds = malloc((n + 1) * sizeof(*fds));
+	task_manager** polled = malloc((n + 1) * sizeof(*polled));
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec deadline = { .it_value = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L } };
+	if (timer == -1 || timerfd_settime(timer, 0, &deadline, NULL) == -1)
+	{
+		perrorize("timerfd", errno);
+		if (timer != -1)
+			close(timer);
+		free(fds);
+		free(polled);
+		return n;
+	}
+	int left;
+	for (;;)
+	{
+		int i;
+		left = 0;
+		for (i = 0; i < n; i++)
+		{
+			if (tms[i]->reaped)
+				continue;
+			siginfo_t info;
+			memset(&info, 0, sizeof(info));
+			if (waitid(P_PIDFD, tms[i]->pidfd, &info, WEXITED | WNOHANG) == -1 || info.si_pid != 0)
+			{
+				tms[i]->reaped = TRUE;
+				continue;
+			}
+			fds[left].fd = tms[i]->pidfd;
+			fds[left].events = POLLIN;
+			polled[left++] = tms[i];
+		}
+		if (left == 0)
+			break;
+		fds[left].fd = timer;
+		fds[left].events = POLLIN;
+		if (poll(fds, left + 1, -1) == -1 && errno != EINTR)
+			break;
+		if (fds[left].revents & POLLIN)
+			break;
+	}
+	close(timer);
+	// the last batch may have exited just as time ran out
+	int still = 0, i;
+	for (i = 0; i < left; i++)
+	{
+		siginfo_t info;
+		memset(&info, 0, sizeof(info));
+		if (waitid(P_PIDFD, polled[i]->pidfd, &info, WEXITED | WNOHANG) == -1 || info.si_pid != 0)
+			polled[i]->reaped = TRUE;
+		else
+			still++;
+	}
+	free(fds);
+	free(polled);
+	return still;
+}
+
+/*
+ * Disconnects the shard's client at ip_str:port. Returns FALSE if it has none.
+ */
+int search_and_disconnect(char* ip_str, int port)
+{	
+	clnode* clptr;
+	for (clptr = self->clients; clptr; clptr = clptr->next)
+	{
+		client* cl = clptr->cl;
+		assert(cl != NULL);
+		if (!strcmp(cl->ip_str, ip_str) && (cl->port == port))
+		{
+			rm_client(cl);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Takes the client out of the list and disconnects it. Freeing it waits for
+ * bury_clients(), as events for it may still be on their way.
+ */
+void rm_client(client* cl)
+{
+	assert(cl != NULL);
+	clnode** link;
+	for (link = &self->clients; *link && (*link)->cl != cl; link = &(*link)->next);
+	assert(*link != NULL);
+	clnode* node = *link;
+	*link = node->next;
+	free(node);
+	__atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+
+	leave_round(cl);
+	drop_from_gather(cl);
+	rm_client_listeners(cl);
+	disconnect_client(cl);
+	cl->gone = TRUE;
+	if (self->graveyard_count == self->graveyard_size)
+	{
+		self->graveyard_size = self->graveyard_size ? 2 * self->graveyard_size:64;
+		self->graveyard = realloc(self->graveyard, self->graveyard_size * sizeof(client*));
+	}
+	self->graveyard[self->graveyard_count++] = cl;
+}
+
+void bury_clients()
+{
+	while (self->graveyard_count)
+		free_client(self->graveyard[--self->graveyard_count]);
+}
+
+/*
+ * Disconnects all of the shard's clients. Their TMs are all sent SIGTERM
+ * together, and reaped from the event loop.
+ */
+void rm_all_clients()
+{
+	rm_recurse(self->clients);
+	bury_clients();
+}
+
+void rm_recurse(clnode* node)
+{
+	// printify("recurse\n");
+	if (node == NULL)
+		return;
+	clnode* nxt = node->next;
+	rm_client(node->cl);
+	rm_recurse(nxt);
+}
+
+/*
+ * Called once the TM's pidfd is readable. A TM that has crashed is restarted
+ * on the same connection if the respawn policy allows; otherwise, and for a TM
+ * that has exited, the client goes.
+ */
+void handle_tm_exit(client* cl)
+{
+	siginfo_t info;
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_PIDFD, cl->tm->pidfd, &info, WEXITED | WNOHANG) == -1 || info.si_pid == 0)
+		return;
+	cl->tm->reaped = TRUE;
+	trace(TR_REAP, 'i', info.si_pid, NULL, 0);
+	// whatever it managed to say before it went, however fast it said it
+	handle_client_input(cl);
+	do
+	{
+		while (whole_cmd(cl))
+			handle_queued_cmd(cl);
+	} while (read_cmds(cl) > 0);
+	if (info.si_code != CLD_KILLED && info.si_code != CLD_DUMPED)
+	{
+		rm_client(cl);
+		return;
+	}
+	describe_exit(&info, cl->crash, sizeof(cl->crash));
+	logify(LOG_WARN, "TM %d of %s:%d crashed: %s.\n", cl->tm->pid, cl->ip_str, cl->port, cl->crash);
+	if (cl->respawns < max_respawns && cl->msgsock != -1 && respawn_TM(cl))
+		return;
+	rm_client(cl);
+}
+
+/*
+ * Starts a new TM on the client's connection and session token in place of
+ * the one that crashed. The client doesn't have to reconnect.
+ */
+int respawn_TM(client* cl)
+{
+	task_manager* tm = make_TM(cl->msgsock, cl->token, TRUE);
+	if (!tm)
+		return FALSE;
+	drop_from_gather(cl);
+	leave_round(cl);
+	rm_client_listeners(cl);
+	close_TM(cl->tm);
+	cl->tm = tm;
+	cl->frame_len = 0;
+	cl->in_result = FALSE;
+	cl->tagging = FALSE;
+	cl->parked = FALSE;
+	cl->respawns++;
+	if (add_client_listeners(cl) != 0)
+	{
+		perrorize("respawn_TM: epoll_ctl", errno);
+		rm_client(cl);
+		return TRUE;
+	}
+	logify(LOG_INFO, "Restarted the TM of %s:%d as %d.\n", cl->ip_str, cl->port, tm->pid);
+	return TRUE;
+}
+
+void describe_exit(siginfo_t* info, char* buff, int len)
+{
+	if (info->si_code == CLD_EXITED)
+		snprintf(buff, len, "exited with status %d", info->si_status);
+	else
+		snprintf(buff, len, "killed by signal %d (%s)%s", info->si_status, strsignal(info->si_status),
+			(info->si_code == CLD_DUMPED) ? ", core dumped":"");
+}
+
+void printify(const char* str, ...)
+{
+	char buff[LOG_LINE];
+
+	va_list args;
+	va_start(args, str);
+
+	int len = vsnprintf(buff, LOG_LINE, str, args);
+	log_put(LOG_CONSOLE, buff, (len < LOG_LINE) ? len:LOG_LINE - 1);
+
+	va_end(args);
+}
+
+/*
+ * Prints like printify(), and also puts it in the log, with a timestamp and level.
+ */
+void logify(int level, const char* str, ...)
+{
+	char buff[LOG_LINE];
+
+	va_list args;
+	va_start(args, str);
+
+	int len = vsnprintf(buff, LOG_LINE, str, args);
+	log_put(level, buff, (len < LOG_LINE) ? len:LOG_LINE - 1);
+
+	va_end(args);
+}
+
+void perrorize(char* str, int eno)
+{
+	logify(LOG_ERROR, "%s: %s\n", str, strerror(eno));
+}
+
+/*
+ * Writes to the server console, a record at a time.
+ */
+void console_write(const char* buff, int len)
+{
+	while (len > 0)
+	{
+		int n = (len < LOG_LINE) ? len:LOG_LINE;
+		log_put(LOG_CONSOLE, buff, n);
+		buff += n;
+		len -= n;
+	}
+}
+
+/*
+ * Claims the next free record in the ring, fills it in and publishes it. Any
+ * thread may call this; only the writer thread takes records out. If the ring
+ * is full, the record is dropped and counted, rather than waited for.
+ */
+void log_put(int level, const char* text, int len)
+{
+	if (!logger.running) // before log_start()
+	{
+		write((level == LOG_ERROR) ? STDERR_FILENO:STDOUT_FILENO, text, len);
+		return;
+	}
+	uint32_t pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	log_record* r;
+	while (TRUE)
+	{
+		r = &logger.records[pos & (LOG_RECORDS - 1)];
+		int32_t diff = (int32_t) (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0 && __atomic_compare_exchange_n(&logger.head, &pos, pos + 1, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		if (diff < 0)
+		{
+			__atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (diff > 0)
+			pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->level = level;
+	r->len = len;
+	memcpy(r->text, text, len);
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_SEQ_CST);
+	// the writer thread only needs waking if it has gone to sleep
+	if (__atomic_load_n(&logger.sleeping, __ATOMIC_SEQ_CST))
+	{
+		uint64_t one = 1;
+		write(logger.wake, &one, sizeof(one));
+	}
+}
+
+/*
+ * Opens the log (-l), the socket the TMs log to, and starts the writer thread.
+ * Records still in the ring are written out at exit.
+ */
+void log_start()
+{
+	int i;
+	for (i = 0; i < LOG_RECORDS; i++)
+		logger.records[i].seq = i;
+	if (log_path && !strcmp(log_path, "journal"))
+	{
+		struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = "/run/systemd/journal/socket" };
+		logger.sink = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (logger.sink != -1 && connect(logger.sink, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+		{
+			close(logger.sink);
+			logger.sink = -1;
+		}
+		logger.journal = TRUE;
+	}
+	else if (log_path)
+	{
+		logger.sink = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	}
+	if (log_path && logger.sink == -1)
+	{
+		perror(log_path);
+		exit(EXIT_FAILURE);
+	}
+	int tm_socks[2];
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, tm_socks) == -1 ||
+		(logger.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		perror("log_start");
+		exit(EXIT_FAILURE);
+	}
+	logger.tm_sock = tm_socks[0];
+	// out of the way of the fds a TM's are put on before exec
+	logger.tm_end = fcntl(tm_socks[1], F_DUPFD_CLOEXEC, LOG_FD + 1);
+	close(tm_socks[1]);
+	// signals are for the event loop's thread
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	int err = pthread_create(&logger.writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+	{
+		fprintf(stderr, "log_start: pthread_create: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+	logger.running = TRUE;
+	atexit(log_stop);
+}
+
+/*
+ * Has the writer thread write out what's left and waits for it.
+ */
+void log_stop()
+{
+	if (!logger.running)
+		return;
+	__atomic_store_n(&logger.stopping, TRUE, __ATOMIC_SEQ_CST);
+	uint64_t one = 1;
+	write(logger.wake, &one, sizeof(one));
+	pthread_join(logger.writer, NULL);
+	logger.running = FALSE;
+}
+
+void* log_writer(void* arg)
+{
+	static log_batch out, err, sink;
+	out.fd = STDOUT_FILENO;
+	err.fd = STDERR_FILENO;
+	sink.fd = logger.sink;
+	while (TRUE)
+	{
+		int n = log_drain(&out, &err, &sink) + log_drain_tms(&err, &sink);
+		uint32_t dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+		if (dropped)
+		{
+			char note[64];
+			int len = snprintf(note, sizeof(note), "%u log records dropped\n", dropped);
+			batch_add(&err, note, len);
+			log_emit(&sink, LOG_WARN, "server", note, len, 0);
+		}
+		batch_flush(&out);
+		batch_flush(&err);
+		batch_flush(&sink);
+		if (n)
+			continue;
+		if (__atomic_load_n(&logger.stopping, __ATOMIC_SEQ_CST))
+			break;
+		// go to sleep, unless a record came in since the ring was last looked at
+		__atomic_store_n(&logger.sleeping, TRUE, __ATOMIC_SEQ_CST);
+		log_record* r = &logger.records[logger.tail & (LOG_RECORDS - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_SEQ_CST) != logger.tail + 1)
+		{
+			struct pollfd fds[2] = { { .fd = logger.wake, .events = POLLIN }, { .fd = logger.tm_sock, .events = POLLIN } };
+			poll(fds, 2, -1);
+			uint64_t count;
+			read(logger.wake, &count, sizeof(count));
+		}
+		__atomic_store_n(&logger.sleeping, FALSE, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+/*
+ * Takes the records that are ready out of the ring, in order. Returns how many.
+ */
+int log_drain(log_batch* out, log_batch* err, log_batch* sink)
+{
+	int n = 0;
+	while (TRUE)
+	{
+		log_record* r = &logger.records[logger.tail & (LOG_RECORDS - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != logger.tail + 1)
+			break;
+		batch_add((r->level == LOG_ERROR) ? err:out, r->text, r->len);
+		if (r->level != LOG_CONSOLE)
+			log_emit(sink, r->level, "server", r->text, r->len, r->realtime_ns);
+		__atomic_store_n(&r->seq, logger.tail + LOG_RECORDS, __ATOMIC_RELEASE);
+		logger.tail++;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Reads the records the TMs have sent: a level digit, then the text. Errors
+ * also go to the console.
+ */
+int log_drain_tms(log_batch* err, log_batch* sink)
+{
+	char buff[LOG_LINE + 1];
+	int n = 0, r;
+	while ((r = recv(logger.tm_sock, buff, sizeof(buff), MSG_DONTWAIT)) > 1)
+	{
+		int level = buff[0] - '0';
+		if (level < LOG_ERROR || level > LOG_INFO)
+			level = LOG_INFO;
+		if (level == LOG_ERROR)
+			batch_add(err, buff + 1, r - 1);
+		log_emit(sink, level, NULL, buff + 1, r - 1, 0);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Formats a record for the log: a line with the time and level for a file, or
+ * the fields of the journal's native protocol. source NULL means the text
+ * says where it is from.
+ */
+void log_emit(log_batch* sink, int level, const char* source, const char* text, int len, uint64_t ns)
+{
+	static const char* names[] = { "", "ERROR", "WARN", "INFO" };
+	static const int priorities[] = { 6, 3, 4, 6 }; // syslog's err, warning, info
+	char line[LOG_LINE + 128];
+	if (sink->fd == -1)
+		return;
+	while (len > 0 && text[len - 1] == '\n')
+		len--;
+	if (logger.journal)
+	{
+		int n = snprintf(line, sizeof(line), "PRIORITY=%d\nSYSLOG_IDENTIFIER=task-manager\nMESSAGE=%s%s%.*s\n",
+			priorities[level], source ? source:"", source ? ": ":"", len, text);
+		if (n >= sizeof(line))
+			n = sizeof(line) - 1;
+		// one datagram per entry, and newlines would end the message early
+		char* c;
+		char* msg = strstr(line, "MESSAGE=");
+		for (c = msg; c < line + n - 1; c++)
+			if (*c == '\n')
+				*c = ' ';
+		send(sink->fd, line, n, MSG_DONTWAIT);
+		return;
+	}
+	if (ns == 0)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	time_t secs = ns / 1000000000ULL;
+	struct tm tm;
+	localtime_r(&secs, &tm);
+	int n = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S", &tm);
+	n += snprintf(line + n, sizeof(line) - n, ".%03d %-5s %s%s%.*s\n", (int) (ns / 1000000 % 1000), names[level],
+		source ? source:"", source ? ": ":"", len, text);
+	batch_add(sink, line, (n < sizeof(line)) ? n:sizeof(line) - 1);
+}
+
+void batch_add(log_batch* b, const char* data, int len)
+{
+	if (b->fd == -1)
+		return;
+	if (b->len + len > LOG_BATCH)
+		batch_flush(b);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+void batch_flush(log_batch* b)
+{
+	int sent = 0;
+	while (sent < b->len)
+	{
+		int r = write(b->fd, b->data + sent, b->len - sent);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break; // nowhere to write it to; drop it
+		sent += r;
+	}
+	b->len = 0;
+}
+
+void exit_gracefully()
+{
+	exit_handler(0);
+}
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Adds a record to the trace ring, over the oldest once it's full. text, if
+ * any, is len bytes, of which only the first word is kept.
+ */
+void trace(int type, char phase, int arg, const char* text, int len)
+{
+	trace_record* t = &traces[__atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED) & (TRACE_RING - 1)];
+	t->ns = monotonic_ns();
+	t->tid = self->tid;
+	t->arg = arg;
+	t->phase = phase;
+	t->type = type;
+	int i;
+	for (i = 0; text && i < len && i < TRACE_TEXT - 1 && text[i] && !isspace((unsigned char) text[i]); i++)
+		t->text[i] = (text[i] == '"' || text[i] == '\\' || iscntrl((unsigned char) text[i])) ? '?':text[i];
+	t->text[i] = '\0';
+}
+
+/*
+ * Writes the trace ring out as Chrome trace JSON, to trace-server-<pid>.json
+ * in the working directory, oldest record first. Returns the number of records
+ * written, or -1, and the file's name in path.
+ */
+int dump_trace(char* path, int len)
+{
+	snprintf(path, len, "trace-server-%d.json", getpid());
+	FILE* f = fopen(path, "w");
+	if (!f)
+	{
+		perrorize("trace: fopen", errno);
+		return -1;
+	}
+	int pid = getpid();
+	uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+	uint64_t i = (head > TRACE_RING) ? head - TRACE_RING:0;
+	int n = 0;
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (; i < head; i++, n++)
+	{
+		trace_record* t = &traces[i & (TRACE_RING - 1)];
+		char extra[48] = "";
+		if (t->phase == 'i')
+			snprintf(extra, sizeof(extra), "\"s\":\"t\",");
+		else if (t->phase == 'b' || t->phase == 'e')
+			snprintf(extra, sizeof(extra), "\"cat\":\"%s\",\"id\":%d,", trace_names[t->type], t->arg);
+		fprintf(f, "%s{\"name\":\"%s%s%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d,%s\"args\":{\"arg\":%d}}\n",
+			n ? ",":"", trace_names[t->type], t->text[0] ? " ":"", t->text, t->phase,
+			(unsigned long long) t->ns / 1000, (unsigned long long) t->ns % 1000, pid, t->tid, extra, t->arg);
+	}
+	fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+	fclose(f);
+	return n;
+}
+
+/*
+ * Writes the trace out if SIGUSR1 asked for it.
+ */
+void check_trace_request()
+{
+	if (!trace_requested)
+		return;
+	trace_requested = FALSE;
+	char path[64];
+	int n = dump_trace(path, sizeof(path));
+	if (n >= 0)
+		logify(LOG_INFO, "Wrote %d trace events to %s.\n", n, path);
+}
+
+void trace_handler(int signo)
+{
+	trace_requested = TRUE;
+}
+
+void exit_handler(int signo)
+{
+	// the shards disconnect their clients alongside this one
+	int i;
+	for (i = 1; i < shard_count; i++)
+	{
+		if (shards[i].running)
+			post(&shards[i], new_message(M_EXIT, 0));
+	}
+	rm_all_clients();
+	reap_dying();
+	for (i = 1; i < shard_count; i++)
+	{
+		if (shards[i].running)
+			pthread_join(shards[i].thread, NULL);
+		shards[i].running = FALSE;
 	}
-
-	task_manager* tm = make_TM(msgsock);
-	if (!tm)
+	if (shared_mode && shared_tm.pidfd != -1)
 	{
-		printify("Failed to start TM\n");
-		return;
+		// it exits once its control socket closes; the SIGTERM is in case it doesn't notice
+		task_manager* tm = &shared_tm;
+		close(shared_tm.cmd_to);
+		stop_TMs(&tm, 1);
 	}
-	// printify("TM started.\n");
-	
-	client* cl = make_client(tm, msgsock, cl_info);
-	// printify("Client created.\n");
-
-	if (add_client_listeners(cl) != 0)
+	close(sock);
+	if (usock != -1)
 	{
-		perror("cl_input: epoll_ctl");
-		free_client(cl);
-		return;
+		close(usock);
+		unlink(usock_path);
 	}
-	// printify("Client-listener added.\n");
+	if (backend == BACKEND_URING)
+		uring_drain();
+	exit(signo);
+}
 
-	add_to_client_list(cl);
+void lower(char* str)
+{
+	char* c;
+	for(c = str; *c; c++)
+		*c = tolower(*c);
 }
 
-client* make_client(task_manager* tm, int msgsock, struct sockaddr_in* cl_info)
+void hr()
 {
-	client* cl = malloc(sizeof(*cl));
+	int i;
+	for(i = 0; i < 76; ++i)
+		printify("%s", HORIZONTAL_LINE);
+	printify("\n");
+}
 
-	char* ipbuf = malloc(INET_ADDRSTRLEN);
-	inet_ntop(AF_INET, &((cl_info->sin_addr).s_addr), ipbuf, INET_ADDRSTRLEN);
-	cl->tm = tm;
-	cl->msgsock = msgsock;
-	cl->ip_str = ipbuf;
-	// cl->ip = ((cl_info->sin_addr).s_addr);
-	cl->port = ntohs(cl_info->sin_port);
-	cl->info = cl_info;
-	printf("%s:%d has connected.\n", cl->ip_str, cl->port);
-	return cl;
+/*
+ * Sets up the rings and the provided buffers, and arms the reads that are always
+ * there: connections, stdin and the gather timer. Returns -1 if io_uring can't be used.
+ */
+int uring_init()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring.fd == -1)
+	{
+		perrorize("io_uring_setup", errno);
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+	{
+		close(ring.fd);
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = (sq_size > cq_size) ? sq_size:cq_size;
+	char* rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (rings == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		perrorize("io_uring mmap", errno);
+		close(ring.fd);
+		return -1;
+	}
+	ring.sq_entries = params.sq_entries;
+	ring.sq_head = (unsigned*) (rings + params.sq_off.head);
+	ring.sq_tail = (unsigned*) (rings + params.sq_off.tail);
+	ring.sq_mask = (unsigned*) (rings + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (rings + params.sq_off.array);
+	ring.sqe_tail = *ring.sq_tail;
+	ring.cq_head = (unsigned*) (rings + params.cq_off.head);
+	ring.cq_tail = (unsigned*) (rings + params.cq_off.tail);
+	ring.cq_mask = (unsigned*) (rings + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+
+	// buffers the kernel picks from for every read, so idle clients hold none
+	ring.buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring.buffs = malloc(URING_BUFFERS * URING_BUFF_SIZE);
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) ring.buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+	if (ring.buf_ring == MAP_FAILED || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		perrorize("io_uring_register: IORING_REGISTER_PBUF_RING", errno);
+		close(ring.fd);
+		return -1;
+	}
+	ring.buf_tail = 0;
+	int i;
+	for (i = 0; i < URING_BUFFERS; i++)
+		uring_recycle(i);
+
+	uring_arm_accept(sock, 0);
+	if (usock != -1)
+		uring_arm_accept(usock, 1);
+	uring_read(STDIN_FILENO, REQ_STDIN);
+	uring_wait_on(gather_timer);
+	uring_arm_timer();
+	uring_wait_on(greeting_timer);
+	uring_arm_greeting_timer();
+	self->throttle_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (self->throttle_timer == -1)
+	{
+		perrorize("timerfd_create", errno);
+		close(ring.fd);
+		return -1;
+	}
+	uring_arm_throttle_timer();
+	self->kill_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (self->kill_timer == -1)
+	{
+		perrorize("timerfd_create", errno);
+		close(ring.fd);
+		return -1;
+	}
+	uring_arm_kill_timer();
+	if (shared_mode)
+		watch_shared_TM();
+	return 0;
 }
 
-task_manager* make_TM(int msgsock)
+void uring_loop()
 {
-	int p2c_cmd[2];
-	int p2c_res[2];
-	int c2p_cmd[2];
-	int c2p_res[2];
-	int exec_check_pipe[2];
-	if ((pipe2(exec_check_pipe, O_CLOEXEC) == -1) || (pipe2(p2c_cmd, O_NONBLOCK) == -1) || (pipe2(p2c_res, O_NONBLOCK) == -1) ||
-		(pipe2(c2p_cmd, O_NONBLOCK) == -1) || (pipe2(c2p_res, O_NONBLOCK) == -1))
+	while (TRUE)
 	{
-		perror("pipe");
-		return NULL;
+		uring_flush_writes();
+		if (uring_enter(!cmds_ready()) == -1)
+		{
+			perrorize("io_uring_enter", errno);
+			exit_gracefully();
+		}
+		unsigned head = *ring.cq_head;
+		trace(TR_WAKEUP, 'i', __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - head, NULL, 0);
+		check_trace_request();
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+			__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+			uring_handle_completion(&cqe);
+		}
+		serve_cmds();
+		bury_clients();
 	}
-	pid_t pid = fork();
-	if (pid == -1)
+}
+
+/*
+ * Passes completed reads to the same handlers the epoll loop uses, and re-arms them.
+ */
+void uring_handle_completion(struct io_uring_cqe* cqe)
+{
+	int kind = cqe->user_data & REQ_KIND_MASK;
+	int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT):-1;
+	char* data = (bid >= 0) ? ring.buffs + bid * URING_BUFF_SIZE:NULL;
+	int res = cqe->res;
+	// reads that found nothing to do try again, the rest stop at errors or EOF
+	int retry = (res == -ENOBUFS || res == -EAGAIN || res == -EINTR);
+
+	if (kind == REQ_STDIN)
 	{
-		perror("add_process: fork");
-		shutdown(msgsock, SHUT_RDWR);
-		close(msgsock);
-		return NULL;
+		if (res > 0)
+		{
+			char input[BUFF_SIZE];
+			int len = (res < BUFF_SIZE) ? res:BUFF_SIZE;
+			memcpy(input, data, len);
+			uring_recycle(bid);
+			trace(TR_CONSOLE, 'B', 0, input, len);
+			handle_console_cmd(input, len);
+			trace(TR_CONSOLE, 'E', 0, NULL, 0);
+		}
+		if (res > 0 || retry)
+			uring_read(STDIN_FILENO, REQ_STDIN);
 	}
-	if (pid > 0) // parent
+	else if (kind == REQ_ACCEPT)
 	{
-		close(exec_check_pipe[WRITE_END]);
-		close(p2c_cmd[READ_END]);
-		close(p2c_res[READ_END]);
-		close(c2p_cmd[WRITE_END]);
-		close(c2p_res[WRITE_END]);
-		char c;
-		if (read(exec_check_pipe[READ_END], &c, 1) == -1)
+		int listener = (cqe->user_data >> 8) ? usock:sock;
+		if (res >= 0 && __atomic_load_n(&client_count, __ATOMIC_RELAXED) + __atomic_load_n(&greeting_count, __ATOMIC_RELAXED) < max_clients)
 		{
-			perror("pipe read");
-			close(exec_check_pipe[READ_END]);
-			close(p2c_cmd[WRITE_END]);
-			close(p2c_res[WRITE_END]);
-			close(c2p_cmd[READ_END]);
-			close(c2p_res[READ_END]);
-			return NULL;
+			struct sockaddr_storage* cl_info = malloc(sizeof(*cl_info));
+			socklen_t length = sizeof(*cl_info);
+			getpeername(res, (struct sockaddr *) cl_info, &length);
+			register_client(res, cl_info);
 		}
-		if (c == EXEC_FAILED)
+		else if (res >= 0)
 		{
-			printify("exec failed\n");
-			waitpid(pid, NULL, 0);
-			close(exec_check_pipe[READ_END]);
-			close(p2c_cmd[WRITE_END]);
-			close(p2c_res[WRITE_END]);
-			close(c2p_cmd[READ_END]);
-			close(c2p_res[READ_END]);
-			return NULL;
+			close(res); // full, as add_client() does
 		}
-		close(exec_check_pipe[READ_END]);
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_arm_accept(listener, cqe->user_data >> 8);
 	}
-	else // child
+	else if (kind == REQ_TIMER)
 	{
-		close(exec_check_pipe[READ_END]);
-		close(p2c_cmd[WRITE_END]);
-		close(p2c_res[WRITE_END]);
-		close(c2p_cmd[READ_END]);
-		close(c2p_res[READ_END]);
-		char c = EXEC_FAILED;
-		// replace fds
-		close(STDIN_FILENO);
-		if ((dup2(msgsock, CL_IN) == -1) || (dup2(msgsock, CL_OUT) == -1) || 
-			(dup2(p2c_cmd[READ_END], SV_TO_TM_CMD) == -1) || (dup2(c2p_cmd[WRITE_END], TM_TO_SV_CMD) == -1) || 
-			(dup2(p2c_res[READ_END], SV_TO_TM_RESULT) == -1) || (dup2(c2p_res[WRITE_END], TM_TO_SV_RESULT) == -1))
+		if (res > 0)
+			finish_gather();
+		uring_arm_timer();
+	}
+	else if (kind == REQ_THROTTLE)
+	{
+		// serve_cmds() takes it from here
+		uring_arm_throttle_timer();
+	}
+	else if (kind == REQ_TM_DYING)
+	{
+		tend_dying();
+	}
+	else if (kind == REQ_KILL_TIMER)
+	{
+		tend_dying();
+		uring_arm_kill_timer();
+	}
+	else if (kind == REQ_GREETING_TIMER)
+	{
+		tend_greetings();
+		uring_arm_greeting_timer();
+	}
+	else if (kind == REQ_RESULT || kind == REQ_CMD)
+	{
+		int slot = (cqe->user_data >> 8) & 0xFFFF;
+		client* cl = ring.clients[slot];
+		int current = (cl && cqe->user_data == uring_client_data(kind, slot));
+		if (current && res > 0)
 		{
-			perror("dup2");
-			write(exec_check_pipe[WRITE_END], &c, 1);
-			exit(EXIT_FAILURE);
+			if (kind == REQ_RESULT)
+				collect_result(cl, data, res);
+			else
+				queue_cmds(cl, data, res);
 		}
-		// launch the task manager
-		if (execl("./tm", "tm", NULL) == -1)
+		if (bid >= 0)
+			uring_recycle(bid);
+		if (current && kind == REQ_RESULT && res == 0 && cl->tm->pidfd == -1)
 		{
-			perror("exec");
-			write(exec_check_pipe[WRITE_END], &c, 1);
+			// the shared TM has ended the session (or died)
+			rm_client(cl);
+			return;
 		}
-		exit(EXIT_FAILURE);
+		// collect_result() may have finished a gather, but never removes clients.
+		// The cmd pipe is read again once serve_cmds() has worked off the queue.
+		if (current && (res > 0 || retry) && (kind == REQ_RESULT || !cl->busy))
+			uring_read((kind == REQ_RESULT) ? cl->tm->result_from:cl->tm->cmd_from, cqe->user_data);
+	}
+	else if (kind == REQ_TM_EXIT)
+	{
+		int slot = (cqe->user_data >> 8) & 0xFFFF;
+		client* cl = ring.clients[slot];
+		if (cl && cqe->user_data == uring_client_data(kind, slot) && res >= 0)
+			handle_tm_exit(cl);
+	}
+	else if (kind == REQ_SHARED_TM)
+	{
+		if (res >= 0)
+			handle_shared_TM_exit();
+	}
+	else if (kind == REQ_GREETING)
+	{
+		handle_greeting((client*) (uintptr_t) (cqe->user_data & ~(uint64_t) REQ_KIND_MASK));
+	}
+	else if (kind == REQ_WRITE)
+	{
+		uring_write* w = (uring_write*) (uintptr_t) (cqe->user_data & ~(uint64_t) REQ_KIND_MASK);
+		if (res < 0)
+			logify(LOG_ERROR, "write to fd %d: %s\n", w->fd, strerror(-res));
+		free(w);
+		ring.writes_in_flight--;
 	}
-	task_manager* tm = malloc(sizeof(*tm));
-	tm->pid = pid;
-	tm->cmd_from = c2p_cmd[READ_END];
-	tm->result_from = c2p_res[READ_END];
-	tm->cmd_to = p2c_cmd[WRITE_END];
-	tm->result_to = p2c_res[WRITE_END];
-	return tm;
 }
 
-int add_client_listeners(client* cl)
+struct io_uring_sqe* uring_get_sqe()
 {
-	struct epoll_event cl_input;
-	cl_input.data.ptr = cl;
-	cl_input.events = EPOLLIN;
-	return  epoll_ctl(epfd, EPOLL_CTL_ADD, cl->tm->cmd_from, &cl_input) +
-			epoll_ctl(epfd, EPOLL_CTL_ADD, cl->tm->result_from, &cl_input);
+	if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+		uring_enter(FALSE);
+	unsigned idx = ring.sqe_tail & *ring.sq_mask;
+	struct io_uring_sqe* sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	ring.sqe_tail++;
+	return sqe;
 }
 
-void rm_client_listeners(client* cl)
+/*
+ * Submits the queued sqes, and if wait is set, waits for at least one completion.
+ */
+int uring_enter(int wait)
 {
-	epoll_ctl(epfd, EPOLL_CTL_DEL, cl->tm->cmd_from, NULL);
-	epoll_ctl(epfd, EPOLL_CTL_DEL, cl->tm->result_from, NULL);
-	// printify("listener removed\n");
+	__atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	int r = syscall(__NR_io_uring_enter, ring.fd, to_submit, wait ? 1:0, wait ? IORING_ENTER_GETEVENTS:0, NULL, 0);
+	if (r == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+		return 0;
+	return r;
 }
 
-void add_to_client_list(client* cl)
+void uring_read(int fd, uint64_t user_data)
 {
-	clnode* new_node = malloc(sizeof(*new_node));
-	new_node->cl = cl;
-	new_node->next = clist_head;
-	clist_head = new_node;
-	client_count++;
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->len = URING_BUFF_SIZE;
+	sqe->off = -1;
+	sqe->user_data = user_data;
 }
 
-void initialize_server()
+/*
+ * One multishot accept per listener keeps producing connections until it fails.
+ */
+void uring_arm_accept(int listener, int which)
 {
-	make_socket();
-	bind_socket();
-	print_port();
-	listen(sock, MAX_CLIENTS);
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = ((uint64_t) which << 8) | REQ_ACCEPT;
 }
 
-void make_socket()
+void uring_arm_timer()
 {
-	sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock < 0) 
-	{
-		perror("opening stream socket");
-		exit(EXIT_FAILURE);
-	}
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = gather_timer;
+	sqe->addr = (uint64_t) &ring.timer_expirations;
+	sqe->len = sizeof(ring.timer_expirations);
+	sqe->off = -1;
+	sqe->user_data = REQ_TIMER;
 }
 
-void print_port()
+void uring_arm_throttle_timer()
 {
-	socklen_t length = sizeof(server);
-	if (getsockname(sock, (struct sockaddr *) &server, &length)) 
-	{
-		perror("getting socket name");
-		exit(1);
-	}
-	printify("Socket has port #%d\n", ntohs(server.sin_port));
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = self->throttle_timer;
+	sqe->addr = (uint64_t) &ring.throttle_expirations;
+	sqe->len = sizeof(ring.throttle_expirations);
+	sqe->off = -1;
+	sqe->user_data = REQ_THROTTLE;
 }
 
-void bind_socket()
+void uring_arm_kill_timer()
 {
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = INADDR_ANY;
-	server.sin_port = 0;
-	if (bind(sock, (struct sockaddr *) &server, sizeof(server))) 
-	{
-		perror("binding stream socket");
-		exit(EXIT_FAILURE);
-	}	
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = self->kill_timer;
+	sqe->addr = (uint64_t) &ring.kill_expirations;
+	sqe->len = sizeof(ring.kill_expirations);
+	sqe->off = -1;
+	sqe->user_data = REQ_KILL_TIMER;
 }
 
-void free_client(client* cl)
+void uring_arm_greeting_timer()
 {
-	assert(cl != NULL);
-	free(cl->tm);
-	free(cl->info);
-	free(cl->ip_str);
-	free(cl);
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = greeting_timer;
+	sqe->addr = (uint64_t) &ring.greeting_expirations;
+	sqe->len = sizeof(ring.greeting_expirations);
+	sqe->off = -1;
+	sqe->user_data = REQ_GREETING_TIMER;
 }
 
-void disconnect_client(client* cl)
+/*
+ * Waits for the first frame of a connection; the frame itself is read by
+ * handle_greeting(), which may leave it where it is.
+ */
+void uring_arm_greeting(client* cl)
 {
-	assert(cl != NULL);
-	assert(cl->tm != NULL);
-	shutdown(cl->msgsock, SHUT_RDWR);
-	close(cl->msgsock);
-	close(cl->tm->cmd_from);
-	close(cl->tm->cmd_to);
-	close(cl->tm->result_from);
-	close(cl->tm->result_to);
-	kill(cl->tm->pid, SIGTERM);
-	waitpid(cl->tm->pid, NULL, 0);
-	printf("%s:%d disconnected.\n", cl->ip_str, cl->port);
-}
-
-void search_and_disconnect(char* ip_str, int port)
-{	
-	clnode* clptr1;
-	clnode* clptr2;
-	clptr1 = clptr2 = clist_head;
-	for (; clptr2; clptr2 = clptr2->next, clptr1 = clptr2)
-	{
-		client* cl = clptr2->cl;
-		assert(cl != NULL);
-		if (!strcmp(cl->ip_str, ip_str) && (cl->port == port))
-		{
-			// printify("found child\n");
-			if ((clptr1 == clptr2) && (clptr1 == clist_head))
-			{
-				if (client_count == 1)
-					clist_head = NULL;
-				else
-					clist_head = clptr2->next;
-			}
-			rm_client(clptr2);
-			printf("%s:%d disconnected.\n", cl->ip_str, cl->port);
-			return;
-		}
-	}
-	printify("Couldn't find client %s:%d\n", ip_str, port);
+	uring_poll(cl->msgsock, (uint64_t) (uintptr_t) cl | REQ_GREETING);
 }
 
-void disconnect_all()
+void uring_poll(int fd, uint64_t user_data)
 {
-	rm_all_clients();
+	struct io_uring_sqe* sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = user_data;
 }
 
-void rm_client(clnode* node)
+/*
+ * Hands a provided buffer back to the kernel.
+ */
+void uring_recycle(int bid)
 {
-	assert(node != NULL);
-	client* cl = node->cl;
-	rm_client_listeners(cl);
-	disconnect_client(cl);
-	free_client(cl);
-	free(node);
-	client_count--;
+	struct io_uring_buf* b = &ring.buf_ring->bufs[ring.buf_tail & (URING_BUFFERS - 1)];
+	b->addr = (uint64_t) (ring.buffs + bid * URING_BUFF_SIZE);
+	b->len = URING_BUFF_SIZE;
+	b->bid = bid;
+	ring.buf_tail++;
+	__atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
 }
 
-void rm_all_clients()
+uint64_t uring_client_data(int kind, int slot)
 {
-	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
-	{
-		perror("rm_all_clients: signal: SIGCHLD(SIG_IGN)");
-		exit(EXIT_FAILURE);
-	}
-	// assert(signal(SIGCHLD, SIG_IGN) == SIG_IGN);
-	rm_recurse(clist_head);
+	return ((uint64_t) ring.gen[slot] << 24) | (slot << 8) | kind;
+}
+
+int uring_add_client(client* cl)
+{
+	int slot;
+	for (slot = 0; slot < MAX_CLIENTS && ring.clients[slot]; slot++);
+	if (slot == MAX_CLIENTS)
+		return -1;
+	ring.clients[slot] = cl;
+	cl->slot = slot;
+	uring_wait_on(cl->tm->result_from);
+	uring_wait_on(cl->tm->cmd_from);
+	uring_read(cl->tm->result_from, uring_client_data(REQ_RESULT, slot));
+	uring_read(cl->tm->cmd_from, uring_client_data(REQ_CMD, slot));
+	if (cl->tm->pidfd != -1)
+		uring_poll(cl->tm->pidfd, uring_client_data(REQ_TM_EXIT, slot));
+	return 0;
+}
 
-	if (signal(SIGCHLD, sigchld_handler) == SIG_ERR)
+/*
+ * Cancels the client's reads. Completions still on their way are recognised
+ * by the old generation and dropped.
+ */
+void uring_rm_client(client* cl)
+{
+	int slot = cl->slot;
+	if (slot < 0 || ring.clients[slot] != cl)
+		return;
+	int kinds[] = { REQ_RESULT, REQ_CMD, REQ_TM_EXIT };
+	int i;
+	for (i = 0; i < 3; i++)
 	{
-		perror("rm_all_clients: signal: SIGCHLD");
-		exit(EXIT_FAILURE);
+		struct io_uring_sqe* sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = uring_client_data(kinds[i], slot);
+		sqe->user_data = REQ_CANCEL;
 	}
-	clist_head = NULL;
+	ring.gen[slot]++;
+	ring.clients[slot] = NULL;
+	cl->slot = -1;
 }
 
-void rm_recurse(clnode* node)
+/*
+ * Queues a write to a TM. Queued writes go out together, those to the same pipe
+ * as a hard-linked chain, so they keep their order; a write that fails cancels
+ * only the ones after it to the same TM.
+ */
+void uring_queue_write(int fd, char* buff, int len)
 {
-	// printify("recurse\n");
-	if (node == NULL)
-		return;
-	clnode* nxt = node->next;
-	rm_client(node);
-	rm_recurse(nxt);
+	if (ring.write_count == MAX_QUEUED_WRITES)
+		uring_flush_writes();
+	uring_write* w = malloc(sizeof(*w) + len);
+	w->fd = fd;
+	w->len = len;
+	memcpy(w->data, buff, len);
+	ring.writes[ring.write_count++] = w;
 }
 
-void sigchld_handler(int signo)
+void uring_flush_writes()
 {
-	pid_t pid;
-	pid = waitpid(-1, NULL, 0);
-	if (pid < 0)
+	if (!ring.write_count)
 		return;
-	// printify("killing child %d\n", pid);
-	clnode* clptr1;
-	clnode* clptr2;
-	clptr1 = clptr2 = clist_head;
-	for (; clptr2; clptr2 = clptr2->next, clptr1 = clptr2)
+	// a chain has to be contiguous in the submission queue
+	if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) + ring.write_count > ring.sq_entries)
+		uring_enter(FALSE);
+	int i, j, next;
+	for (i = 0; i < ring.write_count; i++)
 	{
-		assert(clptr2->cl != NULL);
-		assert(clptr2->cl->tm != NULL);
-		if (clptr2->cl->tm->pid == pid)
+		if (!ring.writes[i])
+			continue; // already in the chain of its fd
+		int fd = ring.writes[i]->fd;
+		for (j = i; j < ring.write_count; j = next)
 		{
-			// printify("found child\n");
-			if ((clptr1 == clptr2) && (clptr1 == clist_head))
-			{
-				if (client_count == 1)
-					clist_head = NULL;
-				else
-					clist_head = clptr2->next;
-			}
-			rm_client(clptr2);
-			printify("%d removed.\n", pid);
-			return;
+			uring_write* w = ring.writes[j];
+			ring.writes[j] = NULL;
+			for (next = j + 1; next < ring.write_count && (!ring.writes[next] || ring.writes[next]->fd != fd); next++);
+			struct io_uring_sqe* sqe = uring_get_sqe();
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = w->fd;
+			sqe->addr = (uint64_t) w->data;
+			sqe->len = w->len;
+			sqe->off = -1;
+			sqe->flags = (next < ring.write_count) ? IOSQE_IO_HARDLINK:0;
+			sqe->user_data = (uint64_t) (uintptr_t) w | REQ_WRITE;
 		}
 	}
+	ring.writes_in_flight += ring.write_count;
+	ring.write_count = 0;
 }
 
-void printify(const char* str, ...)
+/*
+ * Waits for the pending writes to finish. Used on the way out.
+ */
+void uring_drain()
 {
-	char buff[BUFF_SIZE];
-
-	va_list args;
-	va_start(args, str);
-
-	if (write(STDOUT_FILENO, buff, vsprintf(buff, str, args)) == -1)
+	uring_flush_writes();
+	while (ring.writes_in_flight > 0)
 	{
-		perror("Server: printify: write");
-		if (errno == EBADF)
+		if (uring_enter(TRUE) == -1)
+			break;
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
 		{
-			exit(EXIT_FAILURE);
+			struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+			__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+			int kind = cqe.user_data & REQ_KIND_MASK;
+			if (kind == REQ_WRITE)
+				uring_handle_completion(&cqe);
 		}
 	}
-
-	va_end(args);
-	fsync(STDOUT_FILENO);
-}
-
-void exit_gracefully()
-{
-	exit_handler(0);
-}
-
-void exit_handler(int signo)
-{
-	rm_all_clients();
-	close(sock);
-	exit(signo);
-}
-
-void lower(char* str)
-{
-	char* c;
-	for(c = str; *c; c++)
-		*c = tolower(*c);
-}
-
-void hr()
-{
-	int i;
-	for(i = 0; i < 76; ++i)
-		printify("%s", HORIZONTAL_LINE);
-	printify("\n");
+	backend = BACKEND_EPOLL;
 }
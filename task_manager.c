@@ -6,14 +6,25 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/wait.h> // waitpid
+#include <sys/resource.h> // setpriority
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h> // shutdown
+#include <sys/mman.h>
+#include <sys/file.h> // flock
+#include <sys/timerfd.h>
+#include <sys/syscall.h> // pidfd_open
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> // inet_ntop
+#include <stdint.h>
 #include <string.h>
+#include <strings.h> // strcasecmp
 #include <stdarg.h>
 #include <time.h>
 #include <ctype.h> // isspace, tolower
+#include <sched.h> // sched_setscheduler
 
 #define TRUE 1
 #define FALSE 0
@@ -21,179 +32,826 @@
 #define READ_END 0
 #define WRITE_END 1
 #define EXEC_FAILED 'F'
+#define END_OF_RESULT '\0' // marks the end of the reply to a client or server cmd
+#define FAILED_RESULT '\x15' // comes just before END_OF_RESULT when a client cmd failed
+#define UNSOLICITED '\x1e' // starts a frame to the client that isn't a reply: watch events, broadcasts
+#define RESTARTED '\x1a' // starts the notice that the TM was restarted, and the client's cmds in flight are lost
 #define BUFF_SIZE 500
 #define LENGTH_BYTES 1
 
 #define MAX_INPUT 100
+#define MAX_ARGS (MAX_INPUT / 2)
 #define MAX_PROCESSES 10
+#define KILL_GRACE_MS 1000 // between SIGTERM and SIGKILL
+#define MAX_EXEC_TIMEOUT (365 * 24 * 3600) // seconds; far short of what the ns deadline holds
+#define MAX_PENDING 256
 #define ALIVE 1
 #define DEAD 0
 #define VERTICAL_LINE "\u2502"
 #define HORIZONTAL_LINE "\u2500"
 
-// processes
+// priorities
+typedef struct
+{
+	char* name;
+	int nice;
+	int policy;
+} priority_class;
+#define PRIORITY_HIGH   0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_LOW    2
+#define PRIORITY_BATCH  3
+static const priority_class priorities[] = {
+	{ "high",   -10, SCHED_OTHER }, // needs CAP_SYS_NICE, best effort otherwise
+	{ "normal",   0, SCHED_OTHER },
+	{ "low",     10, SCHED_OTHER },
+	{ "batch",   19, SCHED_BATCH }
+};
+#define PRIORITY_COUNT ((int) (sizeof(priorities) / sizeof(priorities[0])))
+
+// running processes; a process leaves the table for the history once it's reaped
 typedef struct
 {
 	pid_t pid;
 	char* name;
-	int status;
-	struct tm* start;
-	struct tm* end;
+	int status; // DEAD once it has been sent SIGTERM, until it is reaped
+	int priority;
+	uint64_t start_ns; // CLOCK_REALTIME
+	uint64_t start_mono_ns; // CLOCK_MONOTONIC, for how long it ran
+	uint64_t kill_deadline_ns; // CLOCK_MONOTONIC; SIGKILL if it's still there by then
+	int service; // index into services, or -1
+	int array; // index into arrays, or -1
+	int array_pos; // position of its index in the array
+	int capture; // bytes of its output kept, 0 if it isn't captured
+	uint64_t timeout_ns; // CLOCK_MONOTONIC; sent SIGTERM then if it's still running, 0 for never
 } process;
-static process* processes[MAX_PROCESSES];
-static int process_count = 0;
+
+// captured output: a process started while capture is on writes its stdout and
+// stderr straight into a file of its own, ./tm-<ip>-<pid>.out, so the kernel
+// does the writing and none of it passes through the TM. The file is kept to
+// about the last capture bytes by punching out what's older (it's sparse, so
+// only the tail takes up space), once a second while the process runs and once
+// more when it's reaped. A file goes when its process drops out of the history.
+#define CAPTURE_DIR HISTORY_DIR
+#define CAPTURE_SIZE (64 * 1024)
+#define CAPTURE_MAX (1024 * 1024)
+#define CAPTURE_TRIM_NS 1000000000ULL
+#define CAPTURE_FAILED 'C'
+#define TAIL_LINES 10
+
+// uploads (put): files are kept in a cache keyed by the first 128 bits of their
+// SHA-256, as CACHE_DIR/objects/<key>, and named by links in a bin dir per
+// client address, CACHE_DIR/bin/<host>, which comes last on the PATH of the
+// processes started for that address, so run finds them without them standing
+// in for the host's own programs, or for another client's. A client sends
+// put <key> <size> <name>; if the key is cached, the TM answers with
+// UPLOAD_SKIP and nothing is sent. Otherwise it answers UPLOAD_READY, and the
+// next size bytes from the client are the file's, spliced from the socket into
+// a staging file without going through the TM's memory, hashed chunk by chunk
+// from the page cache as they land, then checked against the key and moved
+// into the cache. Either byte comes before the reply text.
+#define CACHE_DIR "tm-cache"
+#define UPLOAD_KEY_LEN 32 // hex digits
+#define UPLOAD_NAME_LEN 32
+#define UPLOAD_MAX (1024ULL * 1024 * 1024)
+#define UPLOAD_CHUNK 65536 // bytes spliced per wakeup, a pipe's worth
+#define UPLOAD_READY '\x06'
+#define UPLOAD_SKIP '\x18'
+// exec: a process the client waits on. The reply to the cmd is sent once it has
+// been reaped, and until then the client's next cmds wait, so that replies keep
+// coming in the order of the cmds.
+typedef struct
+{
+	pid_t pid; // 0 if there is none
+	int done; // reaped, with the rest filled in
+	int status; // as returned by waitpid
+	int timed_out;
+	uint64_t elapsed_ns;
+	uint64_t cpu_us;
+} exec_call;
+
+typedef struct
+{
+	uint32_t h[8];
+	uint8_t block[64]; // what hasn't made up a whole block yet
+	uint64_t len;
+} sha256_ctx;
+
+typedef struct
+{
+	int fd; // the staging file, -1 if there is no upload in progress
+	int pipe[2]; // what splice() moves the bytes through
+	uint64_t size;
+	uint64_t left;
+	uint64_t start_ns; // CLOCK_MONOTONIC
+	int error; // errno of a failed write; the rest of the file is let go
+	sha256_ctx hash; // of what has come in so far
+	char key[UPLOAD_KEY_LEN + 1];
+	char name[UPLOAD_NAME_LEN + 1];
+	char staging[128];
+} upload;
+
+// finished processes, kept in a fixed-size ring in an mmap'd file, so that the
+// history outlives the TM without growing. Several TMs serving the same client
+// address share the file, hence the atomics.
+#define HISTORY_DIR "."
+#define HISTORY_MAGIC 0x48534954 // "TISH"
+#define HISTORY_VERSION 3
+#define HISTORY_CAPACITY 1024
+#define HISTORY_NAME_LEN 32
+typedef struct
+{
+	uint64_t seq; // index + 1 once the record is completely written, 0 while it's being written
+	uint64_t start_ns; // CLOCK_REALTIME
+	uint64_t end_ns;
+	uint64_t elapsed_ns; // CLOCK_MONOTONIC, so it holds across clock changes
+	uint64_t utime_us;
+	uint64_t stime_us;
+	int32_t pid;
+	int32_t exit_status; // as returned by waitpid
+	int32_t maxrss_kb;
+	uint8_t priority;
+	uint8_t killed;
+	char name[HISTORY_NAME_LEN]; // truncated
+} history_record;
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint64_t head; // number of records ever appended
+	history_record records[HISTORY_CAPACITY];
+} history_file;
+
+// jobs waiting for a free slot, ordered by priority, then by submission
+typedef struct
+{
+	char name[MAX_INPUT+1];
+	int priority;
+	int count; // instances still to be started
+} job;
+
+// programs kept running at a given number of instances. Instances that exit are
+// restarted from the event loop, right away if they had been running for a while,
+// otherwise after a backoff that doubles with every quick exit.
+#define MAX_SERVICES 8
+#define BACKOFF_START_MS 100
+#define BACKOFF_MAX_MS 30000
+#define STABLE_NS 10000000000ULL // running this long resets the backoff
+typedef struct
+{
+	char name[MAX_INPUT+1];
+	int priority;
+	int keep; // 0 once it's no longer kept running
+	int restarts;
+	int backoff_ms; // delay before restarting the next quick exit; 0 while it's healthy
+	uint64_t next_start_ns; // CLOCK_MONOTONIC
+	int last_status; // waitpid status of the last instance to exit, -1 if none has
+} service;
+
+// process lifecycle events, numbered, in a ring that watchers are sent from.
+// A watcher that falls behind by more than the ring is told what it missed,
+// and can ask for events from a given number on, while they're still there.
+#define EVENT_RING 128
+#define EVENT_LINE (MAX_INPUT + 64)
+#define EV_START  0
+#define EV_TERM   1 // sent SIGTERM
+#define EV_KILL   2 // sent SIGKILL, after ignoring SIGTERM
+#define EV_EXIT   3
+typedef struct
+{
+	uint64_t seq;
+	int type;
+	pid_t pid;
+	int status; // waitpid status, for EV_EXIT
+	char name[MAX_INPUT+1];
+} event;
+#define WATCH_CLIENT 0
+#define WATCH_SERVER 1
+typedef struct
+{
+	int active;
+	uint64_t next; // number of the next event to send
+} watcher;
+
+// scratch memory for handling one cmd: the cmd, its copy, and names cut to
+// fit a table. It's all given back before each cmd and each session's turn in
+// the event loop, so nothing on the cmd path needs freeing, or can leak on an
+// early return, and a shared TM's sessions don't add up in it.
+// Large enough for list all at its longest (a name per row of the history).
+#define ARENA_SIZE (64 * 1024)
+static char arena[ARENA_SIZE];
+static int arena_used = 0;
+
+// an always-on trace of what the TM does: wakeups, cmds, process starts and
+// reaps, output forwarded and flushed. Records go into a ring, with CLOCK_MONOTONIC
+// stamps, and are only formatted when the trace cmd or SIGUSR1 writes them
+// out as Chrome trace JSON (for chrome://tracing or Perfetto). The server
+// stamps its trace with the same clock, so the two line up.
+#define TRACE_RING 4096 // must be a power of 2
+#define TRACE_TEXT 18
+#define TR_WAKEUP 0 // arg: fds ready, or -1 for a signal
+#define TR_CMD 1 // a span; text: the cmd, arg: 0 from the client, 1 from the server, then whether it failed
+#define TR_SPAWN 2 // a span, fork to exec; text: the program, arg at the end: pid, or -errno
+#define TR_REAP 3 // arg: pid
+#define TR_FORWARD 4 // a server result passed on to the client; arg: bytes
+#define TR_FLUSH 5 // queued output sent; arg: bytes
+#define TR_UPLOAD 6 // part of a file being put spliced in; arg: bytes
+typedef struct
+{
+	uint64_t ns;
+	int32_t arg;
+	char phase; // B(egin), E(nd) or i(nstant), as in Chrome's format
+	uint8_t type;
+	char text[TRACE_TEXT];
+} trace_record;
+static const char* trace_names[] = { "wakeup", "cmd", "spawn", "reap", "forward", "flush", "upload" };
+static trace_record traces[TRACE_RING];
+static uint64_t trace_head = 0; // records ever written
+static volatile sig_atomic_t trace_requested = FALSE;
+static volatile sig_atomic_t term_requested = FALSE;
 
 // i/o multiplexing
 static int infd, outfd, errfd;
-#define CL_IN           3 // sock
-#define CL_OUT          4 // sock
-#define SV_TO_TM_CMD    5 // pipe
-#define SV_TO_TM_RESULT 6 // pipe
-#define TM_TO_SV_CMD    7 // pipe
-#define TM_TO_SV_RESULT 8 // pipe
-static fd_set rfds;
-static int numfds;
+static int cmd_failed; // set while handling a cmd that went wrong
+// the reply to the current cmd is ended elsewhere: an echo by way of the server
+// is ended when the server's echo comes back, which is no cmd to answer itself
+static int reply_elsewhere;
+// the fds of the session being served; with a TM of its own, they are 3 - 8
+#define CL_IN           (cur->cl_in) // sock
+#define CL_OUT          (cur->cl_out) // sock
+#define SV_TO_TM_CMD    (cur->sv_to_tm_cmd) // socket
+#define SV_TO_TM_RESULT (cur->sv_to_tm_result) // pipe
+#define TM_TO_SV_CMD    (cur->tm_to_sv_cmd) // pipe
+#define TM_TO_SV_RESULT (cur->tm_to_sv_result) // pipe
+#define CONTROL_FD      3 // --shared: socket the server hands new sessions over
+#define LOG_FD          9 // datagram socket to the server's log
+static sigset_t unblocked_mask; // signal mask to use while waiting in ppoll()
+
+// detachable sessions: when the client goes away, the TM keeps running and
+// buffers the client's output in a pipe (read end on CL_IN, write end on CL_OUT)
+// until the server hands it the socket of a client resuming the session
+#define PARK_BUFFER 65536 // output kept while detached; the rest is dropped
+
+// output to the client is sent without blocking; what the socket won't take is
+// queued and sent as it drains, so a client that stops reading never holds up
+// the TM. Above OUTQ_HIGH the TM stops taking cmds from the client and holds
+// back watch events; past OUTQ_LIMIT, further output is dropped or the client
+// is disconnected (its session kept, as if it had gone away), as set by the
+// overflow cmd.
+#define OUTQ_HIGH (256 * 1024)
+#define OUTQ_LIMIT (1024 * 1024)
+#define OVERFLOW_DROP 0
+#define OVERFLOW_DISCONNECT 1
+
+// job arrays (run --array): an instance of a program per index of a range or
+// list, with {i} in its args replaced by the index, and TM_ARRAY_ID and
+// TM_ARRAY_INDEX in its environment. Instances are started in order as slots
+// free up, at most max_parallel at a time and within the concurrency limit,
+// and each index keeps how its instance ended, for list array.
+#define MAX_ARRAYS 8
+#define ARRAY_MAX_INDICES 100000
+#define ARRAY_QUEUED -3 // status of an index that hasn't been started yet
+#define ARRAY_DROPPED -4 // cancelled, or its instance couldn't be started
+typedef struct
+{
+	int id; // 0 for a free slot
+	char name[MAX_INPUT+1];
+	char args[MAX_INPUT+1];
+	int priority;
+	int max_parallel;
+	int count;
+	int* indices;
+	int* status; // per index: ARRAY_QUEUED, -2 while running, -1 if killed, ARRAY_DROPPED, or a waitpid status
+	int next; // position of the next index to start
+	int running;
+} job_array;
+
+// everything that belongs to one client's session. A TM normally serves a
+// single session, on the fds the server dup'd onto 3 - 8. Started with
+// --shared, one TM serves all of the server's sessions from one event loop:
+// the server sends each new session's socket and pipes over CONTROL_FD, and
+// a session costs this struct rather than a process. Processes are children
+// of the one TM either way, so the SIGCHLD handler finds their session by pid.
+typedef struct session
+{
+	int id;
+	int cl_in, cl_out, sv_to_tm_cmd, sv_to_tm_result, tm_to_sv_cmd, tm_to_sv_result;
+	process* processes[MAX_PROCESSES];
+	int process_count;
+	history_file* history;
+	int history_fd;
+	char host[INET6_ADDRSTRLEN]; // the client's address, naming its files
+	int capture_size; // output kept per process started from now on, 0 for none
+	upload upload;
+	exec_call exec;
+	uint64_t sleep_until; // CLOCK_MONOTONIC; when the client's sleep is over, 0 if it isn't sleeping
+	int sleep_sec;
+	uint64_t ping_sent; // CLOCK_MONOTONIC; when echo ... server went to the server, 0 if it's back
+	job pending[MAX_PENDING];
+	int pending_count;
+	int max_running;
+	service services[MAX_SERVICES];
+	int service_count;
+	job_array arrays[MAX_ARRAYS];
+	int array_ids;
+	event events[EVENT_RING];
+	uint64_t event_seq; // number of the next event
+	watcher watchers[2];
+	char* token;
+	int parked;
+	int passed_fd; // socket that came with the last server cmd
+	char partial[LENGTH_BYTES + 255]; // a cmd from the client that has only partly come in
+	int partial_len;
+	char* outq;
+	int outq_len;
+	int outq_size;
+	int outq_dropping; // over the limit since the queue last emptied
+	int overflow_policy;
+	int closing; // ended; freed once its processes have been reaped
+	struct session* next;
+} session;
+static session* sessions = NULL;
+static session* cur = NULL; // the session being served
+static int shared = FALSE;
+static char* work_dir = NULL; // where CACHE_DIR is, for the PATH of processes started
+static int session_ids = 0;
+static uint64_t next_trim_ns = 0; // CLOCK_MONOTONIC; when captured output is next trimmed
+
+// diagnostics go to the server's log as datagrams of a level digit and the
+// text; if the server isn't keeping up they are dropped, never waited for
+#define LOG_ERROR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
 
 // function declarations
 void wait_for_input();
+void serve(struct pollfd* fds);
 char* get_input();
 void handle_input(char*);
-void add_process();
+void add_process(char* name, int count, int priority);
+void dispatch_pending();
+void keep_running(char* name, int count, int priority);
+void tend_services();
+struct timespec* next_wakeup(struct timespec* timeout);
+void service_exited(process* p, int status);
+void stop_service(int s);
+int find_service(char* name);
+void list_services();
+int start_process(char* name, char* args, char** env, int priority);
+void run_array(char* spec, int max_parallel, int priority, char* name, char* args);
+int parse_indices(char* spec, int* indices);
+void tend_arrays();
+void array_exited(process* p, int status);
+int cancel_array(int a);
+int find_array(char* id);
+void list_arrays();
+void list_array(char* id);
+void exec_and_wait(char* param);
+void expire_timeouts();
+void finish_exec();
+void start_sleep(char* param);
+void finish_sleep();
+void retire_process(int i, int status, struct rusage* usage);
+int count_alive();
+int count_pending();
+int cancel_pending();
+int parse_priority(char* str);
+void set_limit(char* param);
 void list();
 void list_all(int details);
+void list_row(pid_t pid, char* name, int status, int priority, uint64_t start_ns, uint64_t end_ns, uint64_t elapsed_ns, uint64_t cpu_us, int details);
+void format_elapsed(uint64_t ns, char* buff, int len);
+void list_pending();
+void status_text(int status, char* buff, int len);
+int terminate(process* p);
+void escalate_kills();
+void wait_for_exits(int timeout_ms);
+void record_event(int type, process* p, int status);
+void watch(char* param);
+void flush_events();
+int format_event(uint64_t seq, char* buff, int len);
 void kill_by_id(int pid);
 void kill_by_name(char* pname, int n);
 void kill_all();
 void free_all_processes();
 void free_process(process* p);
+void open_history();
+void append_history(process* p, int status, struct rusage* usage);
+void set_capture(char* param);
+int capture_path(pid_t pid, char* path, int len);
+void trim_capture(pid_t pid, int size);
+void trim_captures();
+void show_capture(char* param, int lines);
+void write_out(const char* buff, int len);
+void put(char* param);
+void receive_upload();
+void finish_upload();
+void abort_upload();
+void hash_upload(uint64_t off, ssize_t len);
+int link_upload(char* key, char* name);
+int bin_dir(char* path, int len);
+int valid_upload_name(char* name);
+void content_key(sha256_ctx* c, char* key);
+void sha256_init(sha256_ctx* c);
+void sha256_update(sha256_ctx* c, const uint8_t* data, uint64_t len);
+void sha256_final(sha256_ctx* c, uint8_t* digest);
+void sha256_block(uint32_t* h, const uint8_t* p);
+uint64_t now_ns();
+uint64_t monotonic_ns();
 char* first_n_letters(char* s, int n);
+void* arena_alloc(int size);
+void trace(int type, char phase, int arg, const char* text);
+int dump_trace(char* path, int len);
+void trace_handler(int signo);
 void lower(char* str);
 void hr();
 void sigchld_handler(int signo);
 void exit_gracefully(int signo);
+void term_handler(int signo);
+void end_session();
+session* new_session(char* token);
+void free_session(session* s);
+void accept_session();
+void park();
+void resume();
+void greet(int resumed);
+void client_write(const char* buff, int len);
+void end_reply(int failed);
+void queue_output(const char* buff, int len);
+void flush_output();
+void set_overflow(char* param);
+void echo(char* param);
 void printify(const char* str, ...);
+void failify(const char* str, ...);
 void fprintify(int fd, const char* str, ...);
 void perrorize(char* str, int eno);
+void logify(int level, const char* str, ...);
 
-static time_t time_zero = 0;
-
-int main()
+int main(int argc, char* argv[])
 {
 	close(STDIN_FILENO);
 	close(STDOUT_FILENO);
 	close(STDERR_FILENO);
-	infd = CL_IN;
-	outfd = CL_OUT;
+	shared = (argc > 1 && !strcmp(argv[1], "--shared"));
+	// none of these are for the processes we start
+	int fd;
+	for (fd = CONTROL_FD; fd <= LOG_FD; fd++)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	// a client that's gone shows up as a failed write, not as a dead TM
+	signal(SIGPIPE, SIG_IGN);
 	// register signal handlers
 	if (signal(SIGCHLD, sigchld_handler) == SIG_ERR)
 	{
 		perrorize("signal: SIGCHLD", errno);
 		return -1;
 	}
-	if (signal(SIGTERM, exit_gracefully) == SIG_ERR)
+	if (signal(SIGTERM, term_handler) == SIG_ERR)
 	{
 		perrorize("signal: SIGTERM", errno);
 		return -1;
 	}
-	// get (max fd + 1) for select()
-	numfds = ((SV_TO_TM_CMD > CL_IN) ? SV_TO_TM_CMD:CL_IN);
-	numfds = ((SV_TO_TM_RESULT > numfds) ? SV_TO_TM_RESULT:numfds) + 1;
+	if (signal(SIGUSR1, trace_handler) == SIG_ERR)
+	{
+		perrorize("signal: SIGUSR1", errno);
+		return -1;
+	}
+	// SIGCHLD is only let through while waiting in ppoll(), so the handler
+	// never runs in the middle of a command and cannot slip in unnoticed
+	// between dispatching queued jobs and going back to sleep. The same goes
+	// for SIGUSR1, which asks for the trace, and SIGTERM, which asks the TM to
+	// exit: the loop does either once it's out of ppoll().
+	sigset_t chld_mask;
+	sigemptyset(&chld_mask);
+	sigaddset(&chld_mask, SIGCHLD);
+	sigaddset(&chld_mask, SIGUSR1);
+	sigaddset(&chld_mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &chld_mask, &unblocked_mask) == -1)
+	{
+		perrorize("sigprocmask", errno);
+		return -1;
+	}
+	sigdelset(&unblocked_mask, SIGCHLD);
+	sigdelset(&unblocked_mask, SIGUSR1);
+	sigdelset(&unblocked_mask, SIGTERM);
+	// uploaded programs are run by name, after those installed on the host
+	work_dir = getcwd(NULL, 0);
+	if (shared)
+	{
+		// sessions come in over CONTROL_FD
+		wait_for_input();
+		return 0;
+	}
+	cur = new_session((argc > 1) ? argv[1]:NULL);
+	cur->cl_in = 3;
+	cur->cl_out = 4;
+	cur->sv_to_tm_cmd = 5;
+	cur->sv_to_tm_result = 6;
+	cur->tm_to_sv_cmd = 7;
+	cur->tm_to_sv_result = 8;
+	fcntl(CL_IN, F_SETFL, fcntl(CL_IN, F_GETFL) | O_NONBLOCK);
+	infd = CL_IN;
+	outfd = CL_OUT;
+	open_history();
+	if (argc > 2 && !strcmp(argv[2], "restarted"))
+	{
+		// the client already has its session line; the TM before this one crashed
+		logify(LOG_WARN, "restarted after a crash\n");
+		fprintify(CL_OUT, "%cTask Manager restarted after a crash; processes started before are no longer tracked.\n", RESTARTED);
+		end_reply(FALSE);
+	}
+	else if (cur->token)
+	{
+		greet(FALSE);
+	}
 
 	wait_for_input();
 	
 	return 0;
 }
 
-/* 
- * Listens on CL_IN, SV_TO_TM_CMD and SV_TO_TM_RESULT simultaneously for commands.
- * Sets infd, outfd and errfd according to where the command has to be read from 
- * and where the response has to be sent.
+/*
+ * Listens on CL_IN, SV_TO_TM_CMD and SV_TO_TM_RESULT of every session
+ * simultaneously for commands, and on CONTROL_FD for new sessions when shared.
  */
 void wait_for_input()
 {
+	struct pollfd* fds = NULL;
+	session** polled = NULL;
+	int size = 0;
 	while(TRUE)
 	{
-		// printify("TM waiting for input\n");
-		int r;
-		FD_ZERO(&rfds);
-		FD_SET(CL_IN, &rfds);
-		FD_SET(SV_TO_TM_CMD, &rfds);
-		FD_SET(SV_TO_TM_RESULT, &rfds);
-		
-		if ((r = select(numfds, &rfds, NULL, NULL, NULL)) < 0)
+		arena_used = 0;
+		if (term_requested)
+			exit_gracefully(SIGTERM);
+		if (trace_requested)
 		{
-			// perrorize("select", errno);
+			char path[64];
+			trace_requested = FALSE;
+			int n = dump_trace(path, sizeof(path));
+			if (n >= 0)
+				logify(LOG_INFO, "wrote %d trace events to %s\n", n, path);
 		}
-		if (r == 0) // not likely to happen because no timeout has been specified, but handle anyway
+		if (monotonic_ns() >= next_trim_ns)
 		{
-			continue;
+			trim_captures();
+			next_trim_ns = monotonic_ns() + CAPTURE_TRIM_NS;
 		}
-		if (FD_ISSET(CL_IN, &rfds)) // if input coming from client
+		int n = 0;
+		session* s;
+		session* next;
+		for (s = sessions; s; s = next)
 		{
-			infd = CL_IN;
+			next = s->next;
+			cur = s;
+			arena_used = 0;
 			outfd = CL_OUT;
 			errfd = CL_OUT;
-			// printify("TM detected client input\n");
-			handle_input(get_input());
-			fsync(CL_OUT);
-		}
-		if (FD_ISSET(SV_TO_TM_CMD, &rfds)) // if cmd coming from server
-		{
-			// printify("TM detected server cmd\n");
-			infd = SV_TO_TM_CMD;
-			outfd = TM_TO_SV_RESULT;
-			errfd = TM_TO_SV_RESULT;
-			// printify("TM detected server cmd\n");
-			handle_input(get_input());
+			if (cur->closing)
+			{
+				// its processes were sent SIGTERM when it ended
+				escalate_kills();
+				if (!cur->process_count)
+					free_session(cur);
+				continue;
+			}
+			// start queued jobs in slots freed up by processes that have exited
+			dispatch_pending();
+			tend_arrays();
+			tend_services();
+			expire_timeouts();
+			escalate_kills();
+			finish_exec();
+			finish_sleep();
+			flush_events();
+			n++;
+		}
+		if (4 * n + 1 > size)
+		{
+			size = 2 * (4 * n + 1);
+			fds = realloc(fds, size * sizeof(struct pollfd));
+			polled = realloc(polled, size * sizeof(session*));
+		}
+		int i = 0;
+		for (s = sessions; s; s = s->next)
+		{
+			if (s->closing)
+				continue;
+			struct pollfd* f = &fds[4 * i];
+			// a client that isn't reading its replies gets no more of them for now
+			// nor any more cmds while it waits for an exec or a sleep
+			f[0].fd = (!s->parked && s->outq_len < OUTQ_HIGH && !s->exec.pid && !s->sleep_until) ? s->cl_in:-1;
+			f[0].events = POLLIN;
+			f[1].fd = (!s->parked && s->outq_len) ? s->cl_out:-1;
+			f[1].events = POLLOUT;
+			f[2].fd = s->sv_to_tm_cmd;
+			f[2].events = POLLIN;
+			f[3].fd = s->sv_to_tm_result;
+			f[3].events = POLLIN;
+			polled[i++] = s;
+		}
+		n = i; // some may have ended just now
+		fds[4 * n].fd = shared ? CONTROL_FD:-1;
+		fds[4 * n].events = POLLIN;
+
+		// printify("TM waiting for input\n");
+		struct timespec timeout;
+		int r = ppoll(fds, 4 * n + 1, next_wakeup(&timeout), &unblocked_mask);
+		trace(TR_WAKEUP, 'i', r, NULL);
+		if (r < 0)
+		{
+			// interrupted by SIGCHLD; go dispatch
+			continue;
+		}
+		if (r == 0) // a service is due for a restart, or a process for a SIGKILL
+		{
+			continue;
+		}
+		for (i = 0; i < n; i++)
+		{
+			cur = polled[i];
+			serve(&fds[4 * i]);
+		}
+		if (fds[4 * n].revents)
+			accept_session();
+	}
+}
+
+/*
+ * Handles what is ready on the fds of the session being served: CL_OUT,
+ * CL_IN, SV_TO_TM_CMD and SV_TO_TM_RESULT, in that order. Sets infd, outfd
+ * and errfd according to where the command has to be read from and where the
+ * response has to be sent.
+ */
+void serve(struct pollfd* fds)
+{
+	int ready = POLLIN | POLLHUP | POLLERR;
+	arena_used = 0;
+	if (fds[1].revents)
+	{
+		flush_output();
+	}
+	if ((fds[0].revents & ready) && cur->upload.fd != -1) // the rest of a file being put
+	{
+		infd = CL_IN;
+		outfd = CL_OUT;
+		errfd = CL_OUT;
+		receive_upload();
+		if (cur->parked || cur->closing)
+			return;
+	}
+	else if (fds[0].revents & ready) // if input coming from client
+	{
+		infd = CL_IN;
+		outfd = CL_OUT;
+		errfd = CL_OUT;
+		// printify("TM detected client input\n");
+		cmd_failed = FALSE;
+		reply_elsewhere = FALSE;
+		char* input = get_input();
+		if (cur->parked || cur->closing) // the client has gone away
+			return;
+		if (!input && !cmd_failed) // the rest of the cmd hasn't come in yet
+			return;
+		trace(TR_CMD, 'B', 0, input);
+		handle_input(input);
+		// tell the client the reply is complete, and whether the cmd worked
+		if (!reply_elsewhere && !cur->closing)
+			end_reply(cmd_failed);
+		trace(TR_CMD, 'E', cmd_failed, NULL);
+		if (cur->closing)
+			return;
+	}
+	if (fds[2].revents & ready) // if cmd coming from server
+	{
+		// printify("TM detected server cmd\n");
+		infd = SV_TO_TM_CMD;
+		outfd = TM_TO_SV_RESULT;
+		errfd = TM_TO_SV_RESULT;
+		reply_elsewhere = FALSE;
+		arena_used = 0;
+		char* input = get_input();
+		if (cur->closing) // the server has let go of the session
+			return;
+		// a gather's cmd comes as #<gather> <cmd>; the result starts with the tag
+		int tagged = input && input[0] == '#';
+		if (tagged)
+		{
+			char* cmd = strchr(input, ' ');
+			write(TM_TO_SV_RESULT, input, cmd ? cmd + 1 - input:(int) strlen(input));
+			input = cmd ? cmd + 1:input + strlen(input);
+		}
+		trace(TR_CMD, 'B', 1, input);
+		handle_input(input);
+		trace(TR_CMD, 'E', cmd_failed, NULL);
+		if (cur->closing)
+			return;
+		if (!reply_elsewhere || tagged) // the gather waits on the end either way
+		{
+			// tell the server the result is complete
+			char end = END_OF_RESULT;
+			write(TM_TO_SV_RESULT, &end, 1);
 			fsync(TM_TO_SV_RESULT);
 		}
-		if (FD_ISSET(SV_TO_TM_RESULT, &rfds)) // if result of a cmd coming from server
+	}
+	if (fds[3].revents & ready) // if result of a cmd coming from server
+	{
+		infd = SV_TO_TM_RESULT;
+		outfd = CL_OUT;
+		errfd = CL_OUT;
+		// printify("TM detected server result dump\n");
+		// non-blocking read till pipe empty
+		int r;
+		char buff[BUFF_SIZE];
+		while ((r = read(infd, buff, BUFF_SIZE)) > 0)
 		{
-			infd = SV_TO_TM_RESULT;
-			outfd = CL_OUT;
-			errfd = CL_OUT;
-			// printify("TM detected server result dump\n");
-			// non-blocking read till pipe empty
-			int r;
-			char buff[BUFF_SIZE];
-			while ((r = read(infd, buff, BUFF_SIZE)) > 0)
-			{
-				write(outfd, buff, r);
-			}
-			fsync(CL_OUT);
+			trace(TR_FORWARD, 'i', r, NULL);
+			client_write(buff, r);
 		}
 	}
 }
 
 /* 
- * Reads the incoming command from infd, converts it to lowercase and returns it as a char* 
+ * Reads the incoming command from infd and returns it as a char* 
+ * The client's socket is non-blocking, so its cmd may come in over several
+ * calls; until all of it is in, returns NULL without failing the cmd.
  */
 char* get_input()
 {
-	char* input = malloc(MAX_INPUT+2);
+	char* input = arena_alloc(256); // as much as the header can announce
 	int r, len;
 	r = len = 0;
-	// read the 1-byte header representing the length of the input command
-	r = read(infd, &len, 1);
-	if (r == -1)
-	{
-		perrorize("read", errno);
+	if (!input)
 		return NULL;
-	}
-	// read only len bytes, to avoid reading the next command, if it is already present
-	r = read(infd, input, len);
-	if (r == -1)
+	if (infd == CL_IN)
 	{
-		perrorize("read", errno);
-		return NULL;
+		// the 1-byte header representing the length of the input command, then
+		// the cmd, put together in the session as they come, so that a client
+		// sending half a cmd doesn't hold up the TM's other sessions
+		int want;
+		while (cur->partial_len < (want = LENGTH_BYTES + (cur->partial_len ? (unsigned char) cur->partial[0]:0)))
+		{
+			r = read(CL_IN, cur->partial + cur->partial_len, want - cur->partial_len);
+			if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR))
+			{
+				park();
+				return NULL;
+			}
+			if (r == -1)
+				return NULL;
+			cur->partial_len += r;
+		}
+		len = (unsigned char) cur->partial[0];
+		cur->partial_len = 0;
+		if (len > MAX_INPUT + 1)
+		{
+			failify("Command too long.\n");
+			return NULL;
+		}
+		memcpy(input, cur->partial + LENGTH_BYTES, len);
 	}
-	if (r < len)
+	else
 	{
-		printify("Incomplete read. len: %d, r: %d\n", len, r);
-		return NULL;
+		// the server hands over the socket of a resuming client along with its
+		// cmd, which it sends in one write
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { .iov_base = &len, .iov_len = 1 };
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		r = recvmsg(infd, &msg, MSG_CMSG_CLOEXEC);
+		struct cmsghdr* cmsg = (r > 0) ? CMSG_FIRSTHDR(&msg):NULL;
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			if (cur->passed_fd != -1)
+				close(cur->passed_fd);
+			memcpy(&cur->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+		if (r == 0)
+		{
+			// the server has let go of the session, or is gone
+			end_session();
+			return NULL;
+		}
+		if (r < 0)
+		{
+			perrorize("read", errno);
+			return NULL;
+		}
+		// read only len bytes, to avoid reading the next command, if it is already present
+		r = read(infd, input, len);
+		if (r == -1)
+		{
+			perrorize("read", errno);
+			return NULL;
+		}
+		if (r < len)
+		{
+			failify("Incomplete read. len: %d, r: %d\n", len, r);
+			return NULL;
+		}
 	}
-	input[r-1] = '\0'; // null-terminate
-	lower(input);
+	if (!len)
+		return NULL;
+	input[len-1] = '\0'; // null-terminate
 	return input;
 }
 
@@ -207,7 +865,9 @@ void handle_input(char* input)
 
 	// keep a copy of the original input
 	int original_len = strlen(input) + 1;
-	char original[original_len];
+	char* original = arena_alloc(original_len);
+	if (!original)
+		return;
 	memcpy(original, input, original_len);
 
 	// printify("TM received \"%s\"\n", original);
@@ -215,27 +875,56 @@ void handle_input(char* input)
 
 	if (!cmd)
 		return;
+	// only the cmd and its options are case-insensitive; names and args aren't
+	lower(cmd);
 
 	if (!strcmp(cmd, "q") || !strcmp(cmd, "ex") || !strcmp(cmd, "quit") || !strcmp(cmd, "exit") || !strcmp(cmd, "disconnect"))
 	{
-		exit_gracefully(0);
+		end_session();
+	}
+	else if (!strcmp(cmd, "attach") && infd == SV_TO_TM_CMD)
+	{
+		resume();
 	}
 	else if (!strcmp(cmd, "broadcast"))
 	{
 		char* msg = strtok(NULL, "");
 		if (!msg)
 			return;
-		// forward cmd to server
 		outfd = CL_OUT;
-		printify("SV says: %s\n", msg);
+		if (infd != SV_TO_TM_CMD)
+		{
+			printify("SV says: %s\n", msg);
+			return;
+		}
+		// a frame of its own, in one piece, that the client can tell from a reply
+		char frame[MAX_INPUT + 16];
+		int n = snprintf(frame, sizeof(frame) - 1, "%cSV says: %s\n", UNSOLICITED, msg);
+		if (n > (int) sizeof(frame) - 2)
+			n = sizeof(frame) - 2;
+		frame[n++] = END_OF_RESULT;
+		client_write(frame, n);
 	}
 	else if (!strcmp(cmd, "msg"))
 	{
-		// forward cmd to server
-		write(TM_TO_SV_CMD, &original_len, LENGTH_BYTES);
-		write(TM_TO_SV_CMD, original, original_len);
+		// forward cmd to server, header and all in one write so the server never reads half of it
+		char frame[LENGTH_BYTES + MAX_INPUT + 2];
+		frame[0] = original_len;
+		memcpy(frame + LENGTH_BYTES, original, original_len);
+		write(TM_TO_SV_CMD, frame, LENGTH_BYTES + original_len);
 		// printify("TM sent msg \"%s\"\n", original);
 	}
+	else if (!strcmp(cmd, "trace"))
+	{
+		char path[64];
+		int n = dump_trace(path, sizeof(path));
+		if (n >= 0)
+			printify("Wrote %d trace events to %s.\n", n, path);
+	}
+	else if (!strcmp(cmd, "echo"))
+	{
+		echo(strtok(NULL, ""));
+	}
 	else if (!strcmp(cmd, "add"))
 	{
 		int sum = 0;
@@ -285,7 +974,7 @@ void handle_input(char* input)
 			int tmp = atoi(numstr);
 			if (tmp == 0)
 			{
-				printify("Divide-by-zero error.\n");
+				failify("Divide-by-zero error.\n");
 				return;
 			}
 			ans /= tmp;
@@ -295,10 +984,7 @@ void handle_input(char* input)
 	}
 	else if (!strcmp(cmd, "sleep"))
 	{
-		char* param = strtok(NULL, " ");
-		int sec = param ? atoi(param):0;
-		sleep(sec);
-		printify("Slept for %d seconds.\n", sec);
+		start_sleep(strtok(NULL, " "));
 	}
 	else if (!strcmp(cmd, "list"))
 	{
@@ -307,25 +993,93 @@ void handle_input(char* input)
 		{
 			list();
 		}
-		else if (!strcmp(param, "*") || !strcmp(param, "all"))
+		else if (!strcasecmp(param, "*") || !strcasecmp(param, "all"))
 		{
 			list_all(FALSE);
 		}
-		else if (!strcmp(param, "-d") || !strcmp(param, "details"))
+		else if (!strcasecmp(param, "-d") || !strcasecmp(param, "details"))
 		{
 			list_all(TRUE);
 		}
+		else if (!strcasecmp(param, "-q") || !strcasecmp(param, "queue"))
+		{
+			list_pending();
+		}
+		else if (!strcasecmp(param, "-s") || !strcasecmp(param, "services"))
+		{
+			list_services();
+		}
+		else if (!strcasecmp(param, "-a") || !strcasecmp(param, "arrays"))
+		{
+			list_arrays();
+		}
+		else if (!strcasecmp(param, "array"))
+		{
+			list_array(strtok(NULL, " "));
+		}
 		else
 		{
-			printify("Usage: list [-d %s *]\n", VERTICAL_LINE);
+			failify("Usage: list [-d %s -q %s -s %s -a %s array <id> %s *]\n", VERTICAL_LINE, VERTICAL_LINE,
+				VERTICAL_LINE, VERTICAL_LINE, VERTICAL_LINE);
+		}
+	}
+	else if (!strcmp(cmd, "limit"))
+	{
+		set_limit(strtok(NULL, " "));
+	}
+	else if (!strcmp(cmd, "exec"))
+	{
+		exec_and_wait(strtok(NULL, ""));
+	}
+	else if (!strcmp(cmd, "put"))
+	{
+		put(strtok(NULL, ""));
+	}
+	else if (!strcmp(cmd, "capture"))
+	{
+		set_capture(strtok(NULL, " "));
+	}
+	else if (!strcmp(cmd, "tail"))
+	{
+		char* param = strtok(NULL, " ");
+		char* count = strtok(NULL, " ");
+		int lines = count ? atoi(count):TAIL_LINES;
+		if (!param || lines <= 0)
+		{
+			failify("Usage: tail <processID> [<lines>]\n");
+			return;
+		}
+		show_capture(param, lines);
+	}
+	else if (!strcmp(cmd, "cat"))
+	{
+		char* param = strtok(NULL, " ");
+		if (!param)
+		{
+			failify("Usage: cat <processID>\n");
+			return;
 		}
+		show_capture(param, 0);
+	}
+	else if (!strcmp(cmd, "overflow"))
+	{
+		set_overflow(strtok(NULL, " "));
+	}
+	else if (!strcmp(cmd, "watch"))
+	{
+		watch(strtok(NULL, " "));
+	}
+	else if (!strcmp(cmd, "unwatch"))
+	{
+		cur->watchers[(infd == SV_TO_TM_CMD) ? WATCH_SERVER:WATCH_CLIENT].active = FALSE;
+		printify("Stopped watching at event %llu.\n", (unsigned long long) cur->event_seq);
 	}
 	else if (!strcmp(cmd, "kill"))
 	{
 		char* param = strtok(NULL, " ");
 		if (!param)
 		{
-			printify("Usage: kill <processID> %s <processName> %s *\n", VERTICAL_LINE, VERTICAL_LINE); 
+			failify("Usage: kill <processID> %s <processName> %s *\n", VERTICAL_LINE, VERTICAL_LINE); 
 			return;
 		}
 		int pid = 0;
@@ -333,9 +1087,32 @@ void handle_input(char* input)
 		{
 			kill_by_id(pid);
 		}
-		else if (!strcmp(param, "*") || !strcmp(param, "all"))
+		else if (!strcasecmp(param, "--array"))
+		{
+			int a = find_array(strtok(NULL, " "));
+			if (a == -1)
+				return;
+			int cancelled = cancel_array(a);
+			int killed = 0, i;
+			for (i = 0; i < cur->process_count; i++)
+			{
+				if (cur->processes[i]->array == a && cur->processes[i]->status == ALIVE)
+					killed += (terminate(cur->processes[i]) != -1);
+			}
+			printify("%d processes killed, %d queued instances cancelled\n", killed, cancelled);
+		}
+		else if (!strcasecmp(param, "*") || !strcasecmp(param, "all"))
 		{
+			int s;
+			for (s = 0; s < cur->service_count; s++)
+				stop_service(s);
+			int a, cancelled = 0;
+			for (a = 0; a < MAX_ARRAYS; a++)
+				cancelled += cancel_array(a);
 			kill_all();
+			cancelled += cancel_pending();
+			if (cancelled)
+				printify("%d queued processes cancelled\n", cancelled);
 		}
 		else
 		{
@@ -343,8 +1120,20 @@ void handle_input(char* input)
 			int n = 1;
 			if (!count)
 				kill_by_name(param, 1);
-			else if (!strcmp(count, "*") || !strcmp(count, "all"))
+			else if (!strcasecmp(count, "*") || !strcasecmp(count, "all"))
+			{
+				// otherwise they'd just be restarted
+				int s = find_service(param);
+				if (s != -1)
+					stop_service(s);
+				int a;
+				for (a = 0; a < MAX_ARRAYS; a++)
+				{
+					if (cur->arrays[a].id && !strcmp(cur->arrays[a].name, param))
+						cancel_array(a);
+				}
 				kill_by_name(param, -1);
+			}
 			else if ((n = atoi(count)) > 0)
 				kill_by_name(param, n);
 		}
@@ -352,12 +1141,64 @@ void handle_input(char* input)
 	else
 	{
 		int count = 1;
+		int priority = PRIORITY_NORMAL;
+		int keep = -1;
+		char* array = NULL;
+		int max_parallel = MAX_PROCESSES;
+		int parallel_given = FALSE;
 		char* pname = cmd;
 		char* param = strtok(NULL, " ");
 		if (param)
 		{
 			if (!strcmp(cmd, "run"))
 			{
+				while (param && (!strcasecmp(param, "-p") || !strcasecmp(param, "--keep") ||
+					!strcasecmp(param, "--array") || !strcasecmp(param, "--max-parallel")))
+				{
+					char* value = strtok(NULL, " ");
+					if (!strcasecmp(param, "-p") && (priority = parse_priority(value)) < 0)
+					{
+						failify("Usage: run [-p high %s normal %s low %s batch] <program-name> [<count>]\n",
+							VERTICAL_LINE, VERTICAL_LINE, VERTICAL_LINE);
+						return;
+					}
+					if (!strcasecmp(param, "--keep") && (!value || (keep = atoi(value)) < 0 || keep > MAX_PROCESSES))
+					{
+						failify("Usage: run --keep <0 - %d> [-p <priority>] <program-name>\n", MAX_PROCESSES);
+						return;
+					}
+					if (!strcasecmp(param, "--array") && !(array = value))
+						break;
+					if (!strcasecmp(param, "--max-parallel") && (!value || (max_parallel = atoi(value)) <= 0))
+					{
+						array = NULL;
+						break;
+					}
+					parallel_given |= !strcasecmp(param, "--max-parallel");
+					param = strtok(NULL, " ");
+				}
+				// --max-parallel only means something for an array
+				if ((param && !array && (!strcasecmp(param, "--array") || !strcasecmp(param, "--max-parallel"))) ||
+					(parallel_given && !array))
+				{
+					failify("Usage: run --array <from>-<to>[,…] [--max-parallel <count>] [-p <priority>] <program-name> [<args with {i}>]\n");
+					return;
+				}
+				if (!param)
+				{
+					failify("Usage: run [-p <priority>] [--keep <count>] <program-name> [<count>]\n");
+					return;
+				}
+				if (keep != -1)
+				{
+					keep_running(param, keep, priority);
+					return;
+				}
+				if (array)
+				{
+					run_array(array, max_parallel, priority, param, strtok(NULL, ""));
+					return;
+				}
 				pname = param;
 				char* tmp = strtok(NULL, " ");
 				count = (tmp && (count = atoi(tmp))) ? count:1;
@@ -368,273 +1209,2036 @@ void handle_input(char* input)
 				count = (count = atoi(param)) ? count:1;
 			}
 		}
-		if (process_count + count >= MAX_PROCESSES)
+		add_process(pname, count, priority);
+		// start whatever fits right away, so that the output goes to whoever asked
+		dispatch_pending();
+		int queued = count_pending();
+		if (queued)
+			printify("%d processes queued.\n", queued);
+	}
+}
+
+/*
+ * exec [--timeout <seconds>] <program-name> [<args>]: starts the program
+ * (regardless of the concurrency limit) and answers once it has exited, with
+ * its pid, exit code or signal, and wall and CPU time. The TM serves everyone
+ * else meanwhile. A program still running after the timeout is killed.
+ */
+void exec_and_wait(char* param)
+{
+	if (infd != CL_IN)
+	{
+		failify("exec only works from a client.\n");
+		return;
+	}
+	double timeout = 0;
+	char* name = param ? strtok(param, " "):NULL;
+	if (name && !strcasecmp(name, "--timeout"))
+	{
+		char* value = strtok(NULL, " ");
+		char* end = NULL;
+		timeout = value ? strtod(value, &end):0;
+		// also false for nan
+		if (!value || *end || !(timeout > 0 && timeout <= MAX_EXEC_TIMEOUT))
+			name = NULL;
+		else
+			name = strtok(NULL, " ");
+	}
+	if (!name)
+	{
+		failify("Usage: exec [--timeout <seconds>] <program-name> [<args>]\n");
+		return;
+	}
+	if (start_process(name, strtok(NULL, ""), NULL, PRIORITY_NORMAL) == -1)
+		return;
+	process* p = cur->processes[cur->process_count - 1];
+	if (timeout)
+		p->timeout_ns = p->start_mono_ns + (uint64_t) (timeout * 1e9);
+	memset(&cur->exec, 0, sizeof(cur->exec));
+	cur->exec.pid = p->pid;
+	reply_elsewhere = TRUE;
+}
+
+/*
+ * sleep <seconds>: from the client, the reply is sent by the event loop once
+ * the time is up, and the client's next cmds wait till then, like for exec, so
+ * that the TM's other sessions and the server aren't held up. From the server,
+ * whose result has to follow the cmd, it does sleep, unless the TM is shared.
+ */
+void start_sleep(char* param)
+{
+	int sec = param ? atoi(param):0;
+	if (sec < 0)
+		sec = 0;
+	if (infd == CL_IN && sec)
+	{
+		cur->sleep_until = monotonic_ns() + sec * 1000000000ULL;
+		cur->sleep_sec = sec;
+		reply_elsewhere = TRUE;
+		return;
+	}
+	if (sec && shared)
+	{
+		failify("sleep from the server would hold up every session.\n");
+		return;
+	}
+	sleep(sec);
+	printify("Slept for %d seconds.\n", sec);
+}
+
+void finish_sleep()
+{
+	if (!cur->sleep_until || monotonic_ns() < cur->sleep_until)
+		return;
+	cur->sleep_until = 0;
+	printify("Slept for %d seconds.\n", cur->sleep_sec);
+	end_reply(FALSE);
+}
+
+/*
+ * Answers the exec the client is waiting on, once its process has been reaped.
+ * The reply fails unless the program exited with 0.
+ */
+void finish_exec()
+{
+	if (!cur->exec.pid || !cur->exec.done)
+		return;
+	int status = cur->exec.status;
+	int failed = !WIFEXITED(status) || WEXITSTATUS(status);
+	printify("pid %d %s %d wall %.3fs cpu %.3fs%s\n", cur->exec.pid,
+		WIFEXITED(status) ? "exit":"signal", WIFEXITED(status) ? WEXITSTATUS(status):WTERMSIG(status),
+		cur->exec.elapsed_ns / 1e9, cur->exec.cpu_us / 1e6, cur->exec.timed_out ? " timeout":"");
+	cur->exec.pid = 0;
+	end_reply(failed);
+}
+
+int parse_priority(char* str)
+{
+	if (!str)
+		return -1;
+	int i;
+	for (i = 0; i < PRIORITY_COUNT; i++)
+	{
+		if (!strcasecmp(str, priorities[i].name))
+			return i;
+	}
+	return -1;
+}
+
+void set_limit(char* param)
+{
+	if (param)
+	{
+		int n = atoi(param);
+		if (n <= 0 || n > MAX_PROCESSES)
+		{
+			failify("Limit must be between 1 and %d.\n", MAX_PROCESSES);
+			return;
+		}
+		cur->max_running = n;
+	}
+	printify("At most %d processes run at a time (%d running, %d queued).\n",
+		cur->max_running, count_alive(), count_pending());
+}
+
+/*
+ * capture [off | <KiB>]: whether, and how much of, the output of processes
+ * started from now on is kept. Processes already running carry on as they were.
+ */
+void set_capture(char* param)
+{
+	if (param)
+	{
+		int kib = !strcasecmp(param, "off") ? 0:atoi(param);
+		if ((kib <= 0 && strcasecmp(param, "off")) || kib > CAPTURE_MAX / 1024)
 		{
-			count = MAX_PROCESSES - process_count;
-			printify("Process limit exceeded.\n");
+			failify("Usage: capture [off %s <4 - %d KiB>]\n", VERTICAL_LINE, CAPTURE_MAX / 1024);
+			return;
 		}
-		add_process(pname, count);
+		// the file is trimmed a page at a time
+		if (kib && kib < 4)
+			kib = 4;
+		cur->capture_size = kib * 1024;
 	}
-	free(input);
+	if (cur->capture_size)
+		printify("The last %d KiB of output of each process started is kept in %s/tm-%s-<pid>.out.\n",
+			cur->capture_size / 1024, CAPTURE_DIR, cur->host);
+	else
+		printify("Output of processes started is not kept.\n");
 }
 
 void list()
 {
-	if (!process_count) 
+	if (!cur->process_count) 
 		return;
 
 	hr();
 	printify(" %-6s %s %-10s\n", "PID", VERTICAL_LINE, "Name");
 	hr();
 	int i;
-	for(i = 0; i < process_count; i++)
+	for(i = 0; i < cur->process_count; i++)
 	{
-		if (processes[i]->status != ALIVE) continue;
-		char* print_name = first_n_letters(processes[i]->name, 10);
-		printify(" %6d %s %-10s \n", processes[i]->pid, VERTICAL_LINE, print_name);
-		free(print_name);
+		if (cur->processes[i]->status != ALIVE) continue;
+		char* print_name = first_n_letters(cur->processes[i]->name, 10);
+		printify(" %6d %s %-10s \n", cur->processes[i]->pid, VERTICAL_LINE, print_name);
 	}
 	hr();
 }
 
 void list_all(int details)
 {
-	if (!process_count) return;
+	uint64_t head = __atomic_load_n(&cur->history->head, __ATOMIC_ACQUIRE);
+	if (!cur->process_count && !head) return;
 
 	hr();
-	printify(" %-6s %s %-10s %s %-5s", "PID", VERTICAL_LINE, "Name", VERTICAL_LINE, "Status");
+	printify(" %-6s %s %-10s %s %-6s", "PID", VERTICAL_LINE, "Name", VERTICAL_LINE, "Status");
 	if (details)
-		printify(" %s %-8s %s %-8s %s %-8s", /*VERTICAL_LINE, "Priority", */VERTICAL_LINE, "Start", VERTICAL_LINE, "End", VERTICAL_LINE, "Elapsed");
+		printify(" %s %-8s %s %-8s %s %-8s %s %-8s %s %-8s", VERTICAL_LINE, "Priority", VERTICAL_LINE, "Start", 
+			VERTICAL_LINE, "End", VERTICAL_LINE, "Elapsed", VERTICAL_LINE, "CPU");
 	printify("\n");
 	hr();
 
+	// finished processes, oldest first
+	uint64_t idx = (head > cur->history->capacity) ? head - cur->history->capacity:0;
+	for (; idx < head; idx++)
+	{
+		history_record* slot = &cur->history->records[idx % cur->history->capacity];
+		history_record r = *slot;
+		// skip records being written, or overwritten while we were copying
+		if (r.seq != idx + 1 || __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != idx + 1)
+			continue;
+		r.name[HISTORY_NAME_LEN - 1] = '\0';
+		int status = r.killed ? -1:r.exit_status;
+		list_row(r.pid, r.name, status, r.priority, r.start_ns, r.end_ns, r.elapsed_ns, r.utime_us + r.stime_us, details);
+	}
 	int i;
-	for(i = 0; i < process_count; i++, printify("\n"))
-	{
-		char* print_name = first_n_letters(processes[i]->name, 10);
-		printify(" %6d %s %-10s %s %-6s ", processes[i]->pid, VERTICAL_LINE,
-										 print_name, VERTICAL_LINE,
-										 processes[i]->status ? "Alive":"Dead");
-		free(print_name);
-		if (!details) continue;
-		char buff[9];
-		strftime(buff, sizeof(buff), "%H:%M:%S", (processes[i]->start));
-		printify("%s %8s ", VERTICAL_LINE, buff); // start
-
-		strftime(buff, sizeof(buff), "%H:%M:%S", (processes[i]->end));
-		printify("%s %8s ", VERTICAL_LINE, buff); // end
-		time_t t1 = mktime((processes[i]->start));
-		time_t t2;
-		if (processes[i]->status != DEAD)
-		{
-			t2 = time(NULL);
-		}
-		else
-		{
-			t2 = mktime((processes[i]->end));
-		}
-		struct tm* elapsed;
-		time_t seconds = difftime(t2, t1);
-		elapsed = gmtime(&seconds);
-		strftime(buff, sizeof(buff), "%H:%M:%S", elapsed);
-		printify("%s %8s", VERTICAL_LINE, buff); // elapsed
+	uint64_t now = monotonic_ns();
+	for(i = 0; i < cur->process_count; i++)
+	{
+		process* p = cur->processes[i];
+		if (p->status != ALIVE) continue;
+		list_row(p->pid, p->name, -2, p->priority, p->start_ns, 0, now - p->start_mono_ns, 0, details);
 	}
 	hr();
 }
 
-void add_process(char* name, int count)
+/*
+ * Prints one row of list_all(). status is a waitpid status, -1 for a killed
+ * process, or -2 for one that is still running.
+ */
+void list_row(pid_t pid, char* name, int status, int priority, uint64_t start_ns, uint64_t end_ns, uint64_t elapsed_ns, uint64_t cpu_us, int details)
+{
+	char state[16];
+	status_text(status, state, sizeof(state));
+
+	char* print_name = first_n_letters(name, 10);
+	printify(" %6d %s %-10s %s %-6s ", pid, VERTICAL_LINE, print_name, VERTICAL_LINE, state);
+	if (!details)
+	{
+		printify("\n");
+		return;
+	}
+	printify("%s %-8s ", VERTICAL_LINE, priorities[priority].name);
+
+	char buff[9];
+	struct tm t;
+	time_t sec = start_ns / 1000000000;
+	strftime(buff, sizeof(buff), "%H:%M:%S", localtime_r(&sec, &t));
+	printify("%s %8s ", VERTICAL_LINE, buff); // start
+
+	if (end_ns)
+	{
+		sec = end_ns / 1000000000;
+		strftime(buff, sizeof(buff), "%H:%M:%S", localtime_r(&sec, &t));
+	}
+	else
+	{
+		snprintf(buff, sizeof(buff), "-");
+	}
+	printify("%s %8s ", VERTICAL_LINE, buff); // end
+
+	format_elapsed(elapsed_ns, buff, sizeof(buff));
+	printify("%s %8s ", VERTICAL_LINE, buff); // elapsed
+
+	if (status == -2)
+		printify("%s %8s\n", VERTICAL_LINE, "-");
+	else
+		printify("%s %7.2fs\n", VERTICAL_LINE, cpu_us / 1e6);
+}
+
+/*
+ * Formats a duration into the 8 columns of list details: as much precision as
+ * fits for short runs, which would otherwise all show up as 00:00:00, and days
+ * for ones of 100 hours and over.
+ */
+void format_elapsed(uint64_t ns, char* buff, int len)
+{
+	if (ns < 1000000ULL)
+		snprintf(buff, len, "%lluus", (unsigned long long) ns / 1000);
+	else if (ns < 999995000ULL) // what would round up to 1000.00ms
+		snprintf(buff, len, "%.2fms", ns / 1e6);
+	else if (ns < 59999500000ULL)
+		snprintf(buff, len, "%.3fs", ns / 1e9);
+	else if (ns < 360000000000000ULL) // 100 hours
+	{
+		unsigned long long sec = ns / 1000000000;
+		snprintf(buff, len, "%02llu:%02llu:%02llu", sec / 3600, sec / 60 % 60, sec % 60);
+	}
+	else
+	{
+		// days and hours from then on, held at 9999d23h rather than wrapping
+		unsigned long long hours = ns / 3600000000000ULL;
+		if (hours > 9999 * 24 + 23)
+			hours = 9999 * 24 + 23;
+		snprintf(buff, len, "%llud%02lluh", hours / 24, hours % 24);
+	}
+}
+
+/*
+ * status is a waitpid status, -1 for a killed process, or -2 for one that is
+ * still running.
+ */
+void status_text(int status, char* buff, int len)
+{
+	if (status == -2)
+		snprintf(buff, len, "Alive");
+	else if (status == -1)
+		snprintf(buff, len, "Killed");
+	else if (status == ARRAY_QUEUED)
+		snprintf(buff, len, "Queued");
+	else if (status == ARRAY_DROPPED)
+		snprintf(buff, len, "Dropped");
+	else if (WIFSIGNALED(status))
+		snprintf(buff, len, "Sig %d", WTERMSIG(status));
+	else
+		snprintf(buff, len, "Exit %d", WEXITSTATUS(status));
+}
+
+void list_pending()
+{
+	if (!cur->pending_count)
+	{
+		printify("No queued processes.\n");
+		return;
+	}
+
+	hr();
+	printify(" %-10s %s %-8s %s %-5s\n", "Name", VERTICAL_LINE, "Priority", VERTICAL_LINE, "Count");
+	hr();
+	int i;
+	for(i = 0; i < cur->pending_count; i++)
+	{
+		char* print_name = first_n_letters(cur->pending[i].name, 10);
+		printify(" %-10s %s %-8s %s %5d\n", print_name, VERTICAL_LINE,
+			priorities[cur->pending[i].priority].name, VERTICAL_LINE, cur->pending[i].count);
+	}
+	hr();
+}
+
+/*
+ * Queues count instances of the program. Jobs are kept sorted by priority, and
+ * in submission order within the same priority.
+ */
+void add_process(char* name, int count, int priority)
+{
+	if (count <= 0)
+		return;
+
+	if (cur->pending_count >= MAX_PENDING)
+	{
+		failify("Error: Job queue is full.\n");
+		return;
+	}
+	int pos = cur->pending_count;
+	while (pos > 0 && cur->pending[pos-1].priority > priority)
+		pos--;
+	memmove(&cur->pending[pos+1], &cur->pending[pos], (cur->pending_count - pos) * sizeof(job));
+	snprintf(cur->pending[pos].name, sizeof(cur->pending[pos].name), "%s", name);
+	cur->pending[pos].priority = priority;
+	cur->pending[pos].count = count;
+	cur->pending_count++;
+}
+
+/*
+ * Starts queued jobs, highest priority first, until the concurrency limit is reached.
+ */
+void dispatch_pending()
+{
+	int running = count_alive();
+	// killed processes keep their slot in the table until they are reaped
+	while (cur->pending_count && running < cur->max_running && cur->process_count < MAX_PROCESSES)
+	{
+		job* j = &cur->pending[0];
+		if (start_process(j->name, NULL, NULL, j->priority) == -1)
+		{
+			// the rest of the instances won't start either
+			if (j->count > 1)
+				printify("Dropped %d queued instances of %s.\n", j->count - 1, j->name);
+			j->count = 0;
+		}
+		else
+		{
+			running++;
+			j->count--;
+		}
+		if (j->count == 0)
+		{
+			cur->pending_count--;
+			memmove(&cur->pending[0], &cur->pending[1], cur->pending_count * sizeof(job));
+		}
+	}
+}
+
+/*
+ * run --keep: keeps count instances of the program running, starting or
+ * killing instances to get there. A count of 0 stops it and its instances.
+ */
+void keep_running(char* name, int count, int priority)
+{
+	int s = find_service(name);
+	if (s == -1 && count == 0)
+	{
+		failify("%s isn't being kept running.\n", name);
+		return;
+	}
+	if (s == -1)
+	{
+		// reuse a stopped one
+		for (s = 0; s < cur->service_count && cur->services[s].keep; s++);
+		if (s == MAX_SERVICES)
+		{
+			failify("Error: At most %d programs can be kept running.\n", MAX_SERVICES);
+			return;
+		}
+		if (s == cur->service_count)
+			cur->service_count++;
+		snprintf(cur->services[s].name, sizeof(cur->services[s].name), "%s", name);
+		cur->services[s].restarts = 0;
+		cur->services[s].backoff_ms = 0;
+		cur->services[s].next_start_ns = 0;
+		cur->services[s].last_status = -1;
+	}
+	cur->services[s].priority = priority;
+	cur->services[s].keep = count;
+	// scaling down kills the newest instances
+	int alive = 0;
+	int i;
+	for (i = 0; i < cur->process_count; i++)
+		alive += (cur->processes[i]->service == s && cur->processes[i]->status == ALIVE);
+	for (i = cur->process_count - 1; i >= 0 && alive > count; i--)
+	{
+		if (cur->processes[i]->service == s && cur->processes[i]->status == ALIVE && terminate(cur->processes[i]) != -1)
+			alive--;
+	}
+	if (count == 0)
+	{
+		stop_service(s);
+		printify("Stopped keeping %s running.\n", name);
+		return;
+	}
+	tend_services();
+	printify("Keeping %d instances of %s running.\n", count, name);
+}
+
+/*
+ * Starts instances of the services that are short of them, unless they are
+ * backing off.
+ */
+void tend_services()
+{
+	uint64_t now = monotonic_ns();
+	int s;
+	for (s = 0; s < cur->service_count; s++)
+	{
+		service* sv = &cur->services[s];
+		if (!sv->keep || now < sv->next_start_ns)
+			continue;
+		int alive = 0;
+		int i;
+		for (i = 0; i < cur->process_count; i++)
+			alive += (cur->processes[i]->service == s && cur->processes[i]->status == ALIVE);
+		// killed processes keep their slot in the table until they are reaped
+		while (alive < sv->keep && cur->process_count < MAX_PROCESSES)
+		{
+			if (start_process(sv->name, NULL, NULL, sv->priority) == -1)
+			{
+				// can't be started at all, so that's a crash loop too
+				sv->backoff_ms = sv->backoff_ms ? 2 * sv->backoff_ms:BACKOFF_START_MS;
+				if (sv->backoff_ms > BACKOFF_MAX_MS)
+					sv->backoff_ms = BACKOFF_MAX_MS;
+				sv->next_start_ns = now + sv->backoff_ms * 1000000ULL;
+				break;
+			}
+			cur->processes[cur->process_count - 1]->service = s;
+			alive++;
+		}
+	}
+}
+
+/*
+ * Sets timeout to when the next service that is backing off is due to be
+ * restarted, the next killed process that hasn't exited is due for a
+ * SIGKILL, the next exec runs out of time, a client's sleep is over, or
+ * captured output is due to be trimmed, for ppoll(). Returns NULL if there is
+ * nothing to wait for.
+ */
+struct timespec* next_wakeup(struct timespec* timeout)
+{
+	uint64_t now = monotonic_ns();
+	uint64_t next = UINT64_MAX;
+	session* sn;
+	int s, i;
+	for (sn = sessions; sn; sn = sn->next)
+	{
+		if (sn->sleep_until && sn->sleep_until < next)
+			next = (sn->sleep_until > now) ? sn->sleep_until:now;
+		for (s = 0; s < sn->service_count; s++)
+		{
+			if (sn->services[s].keep && sn->services[s].next_start_ns > now && sn->services[s].next_start_ns < next)
+				next = sn->services[s].next_start_ns;
+		}
+		for (i = 0; i < sn->process_count; i++)
+		{
+			uint64_t deadline = sn->processes[i]->kill_deadline_ns;
+			if (deadline && deadline < next)
+				next = (deadline > now) ? deadline:now;
+			deadline = sn->processes[i]->timeout_ns;
+			if (deadline && deadline < next)
+				next = (deadline > now) ? deadline:now;
+			if (sn->processes[i]->capture && next_trim_ns < next)
+				next = (next_trim_ns > now) ? next_trim_ns:now;
+		}
+	}
+	if (next == UINT64_MAX)
+		return NULL;
+	timeout->tv_sec = (next - now) / 1000000000ULL;
+	timeout->tv_nsec = (next - now) % 1000000000ULL;
+	return timeout;
+}
+
+/*
+ * Called when an instance of a service has exited; it gets restarted on the
+ * next pass through the event loop. One that didn't last long pushes the
+ * restart back, so that a crash loop doesn't eat the machine.
+ */
+void service_exited(process* p, int status)
+{
+	service* sv = &cur->services[p->service];
+	if (!sv->keep)
+		return;
+	sv->last_status = (p->status == DEAD) ? -1:status;
+	sv->restarts++;
+	uint64_t now = monotonic_ns();
+	if (p->status == DEAD || now - p->start_mono_ns >= STABLE_NS)
+	{
+		// killed on purpose, or it had been running fine
+		sv->backoff_ms = 0;
+		return;
+	}
+	if (sv->backoff_ms)
+		logify(LOG_WARN, "%s keeps exiting; restarting it in %dms\n", sv->name, sv->backoff_ms);
+	// the first quick exit is restarted right away too
+	sv->next_start_ns = now + sv->backoff_ms * 1000000ULL;
+	sv->backoff_ms = sv->backoff_ms ? 2 * sv->backoff_ms:BACKOFF_START_MS;
+	if (sv->backoff_ms > BACKOFF_MAX_MS)
+		sv->backoff_ms = BACKOFF_MAX_MS;
+}
+
+/*
+ * Stops restarting the service. Its instances are left alone.
+ */
+void stop_service(int s)
+{
+	cur->services[s].keep = 0;
+	int i;
+	for (i = 0; i < cur->process_count; i++)
+	{
+		if (cur->processes[i]->service == s)
+			cur->processes[i]->service = -1;
+	}
+}
+
+int find_service(char* name)
+{
+	int s;
+	for (s = 0; s < cur->service_count; s++)
+	{
+		if (cur->services[s].keep && !strcmp(cur->services[s].name, name))
+			return s;
+	}
+	return -1;
+}
+
+void list_services()
 {
+	int active = 0;
+	int s, i;
+	for (s = 0; s < cur->service_count; s++)
+		active += (cur->services[s].keep > 0);
+	if (!active)
+	{
+		printify("No programs are being kept running.\n");
+		return;
+	}
+
+	hr();
+	printify(" %-10s %s %-4s %s %-5s %s %-8s %s %-8s %s %-6s\n", "Name", VERTICAL_LINE, "Keep", VERTICAL_LINE,
+		"Alive", VERTICAL_LINE, "Restarts", VERTICAL_LINE, "Backoff", VERTICAL_LINE, "Last exit");
+	hr();
+	for (s = 0; s < cur->service_count; s++)
+	{
+		service* sv = &cur->services[s];
+		if (!sv->keep)
+			continue;
+		int alive = 0;
+		for (i = 0; i < cur->process_count; i++)
+			alive += (cur->processes[i]->service == s && cur->processes[i]->status == ALIVE);
+		char last[16] = "-";
+		if (sv->restarts)
+			status_text(sv->last_status, last, sizeof(last));
+		char backoff[16] = "-";
+		if (sv->backoff_ms)
+			snprintf(backoff, sizeof(backoff), "%dms", sv->backoff_ms);
+		char* print_name = first_n_letters(sv->name, 10);
+		printify(" %-10s %s %4d %s %5d %s %8d %s %8s %s %-6s\n", print_name, VERTICAL_LINE, sv->keep, VERTICAL_LINE,
+			alive, VERTICAL_LINE, sv->restarts, VERTICAL_LINE, backoff, VERTICAL_LINE, last);
+	}
+	hr();
+}
+
+/*
+ * run --array: sets up an array of instances of the program, one per index in
+ * spec, and starts what fits right away. Takes the slot of the oldest finished
+ * array if all are taken.
+ */
+void run_array(char* spec, int max_parallel, int priority, char* name, char* args)
+{
+	int count = parse_indices(spec, NULL);
 	if (count <= 0)
+	{
+		failify("Invalid indices: %s (e.g. 1-100 or 1,5,10-20; at most %d)\n", spec, ARRAY_MAX_INDICES);
+		return;
+	}
+	int a, free_slot = -1;
+	for (a = 0; a < MAX_ARRAYS; a++)
+	{
+		job_array* ja = &cur->arrays[a];
+		int finished = (ja->next == ja->count && !ja->running);
+		if (!ja->id && (free_slot == -1 || cur->arrays[free_slot].id))
+			free_slot = a;
+		else if (ja->id && finished && (free_slot == -1 || (cur->arrays[free_slot].id && ja->id < cur->arrays[free_slot].id)))
+			free_slot = a;
+	}
+	if (free_slot == -1)
+	{
+		failify("Error: At most %d job arrays can be running.\n", MAX_ARRAYS);
 		return;
+	}
+	job_array* ja = &cur->arrays[free_slot];
+	free(ja->indices);
+	free(ja->status);
+	ja->indices = malloc(count * sizeof(int));
+	ja->status = malloc(count * sizeof(int));
+	if (!ja->indices || !ja->status)
+	{
+		free(ja->indices);
+		free(ja->status);
+		memset(ja, 0, sizeof(*ja));
+		failify("Error: Out of memory.\n");
+		return;
+	}
+	parse_indices(spec, ja->indices);
+	int i;
+	for (i = 0; i < count; i++)
+		ja->status[i] = ARRAY_QUEUED;
+	ja->id = ++cur->array_ids;
+	snprintf(ja->name, sizeof(ja->name), "%s", name);
+	snprintf(ja->args, sizeof(ja->args), "%s", args ? args:"");
+	ja->priority = priority;
+	ja->max_parallel = max_parallel;
+	ja->count = count;
+	ja->next = 0;
+	ja->running = 0;
+	printify("Array %d: %d instances of %s, at most %d at a time.\n", ja->id, count, name,
+		(max_parallel < cur->max_running) ? max_parallel:cur->max_running);
+	tend_arrays();
+}
+
+/*
+ * Reads a comma-separated list of indices and ranges (from-to) into indices,
+ * if not NULL. Returns how many there are, or -1 if spec isn't valid.
+ */
+int parse_indices(char* spec, int* indices)
+{
+	int count = 0;
+	char* c = spec;
+	while (TRUE)
+	{
+		char* end;
+		if (!isdigit(*c))
+			return -1;
+		long from = strtol(c, &end, 10);
+		long to = from;
+		if (*end == '-')
+		{
+			if (!isdigit(end[1]))
+				return -1;
+			to = strtol(end + 1, &end, 10);
+		}
+		if (to < from || to > INT32_MAX || to - from >= ARRAY_MAX_INDICES - count)
+			return -1;
+		for (; from <= to; from++, count++)
+		{
+			if (indices)
+				indices[count] = from;
+		}
+		if (*end == '\0')
+			return count;
+		if (*end != ',')
+			return -1;
+		c = end + 1;
+	}
+}
+
+/*
+ * Starts the next instances of the job arrays, oldest array first, as long as
+ * the concurrency limit and each array's max_parallel allow. An instance that
+ * can't be started means the rest of its array won't start either.
+ */
+void tend_arrays()
+{
+	int running = count_alive();
+	int a;
+	for (a = 0; a < MAX_ARRAYS; a++)
+	{
+		job_array* ja = &cur->arrays[a];
+		while (ja->next < ja->count && ja->running < ja->max_parallel && running < cur->max_running &&
+			cur->process_count < MAX_PROCESSES)
+		{
+			int index = ja->indices[ja->next];
+			char args[BUFF_SIZE];
+			char* t = ja->args;
+			char* i;
+			int len = 0;
+			// {i} becomes the index
+			while ((i = strstr(t, "{i}")) && len < BUFF_SIZE)
+			{
+				len += snprintf(args + len, BUFF_SIZE - len, "%.*s%d", (int) (i - t), t, index);
+				t = i + 3;
+			}
+			if (len < BUFF_SIZE)
+				snprintf(args + len, BUFF_SIZE - len, "%s", t);
+			char id_var[32], index_var[32];
+			snprintf(id_var, sizeof(id_var), "TM_ARRAY_ID=%d", ja->id);
+			snprintf(index_var, sizeof(index_var), "TM_ARRAY_INDEX=%d", index);
+			char* env[] = { id_var, index_var, NULL };
+			if (start_process(ja->name, args, env, ja->priority) == -1)
+			{
+				printify("Array %d: dropped %d instances.\n", ja->id, cancel_array(a));
+				break;
+			}
+			process* p = cur->processes[cur->process_count - 1];
+			p->array = a;
+			p->array_pos = ja->next;
+			ja->status[ja->next++] = -2;
+			ja->running++;
+			running++;
+		}
+	}
+}
 
-	if (process_count >= MAX_PROCESSES)
+/*
+ * Called when an instance of a job array has exited, to keep how it ended.
+ */
+void array_exited(process* p, int status)
+{
+	job_array* ja = &cur->arrays[p->array];
+	ja->status[p->array_pos] = (p->status == DEAD) ? -1:status;
+	ja->running--;
+	if (ja->next == ja->count && !ja->running)
+		logify(LOG_INFO, "array %d (%s) is done\n", ja->id, ja->name);
+}
+
+/*
+ * Drops the instances of the array that haven't been started yet. Those that
+ * are running are left alone. Returns how many were dropped.
+ */
+int cancel_array(int a)
+{
+	job_array* ja = &cur->arrays[a];
+	int dropped = ja->count - ja->next;
+	for (; ja->next < ja->count; ja->next++)
+		ja->status[ja->next] = ARRAY_DROPPED;
+	return dropped;
+}
+
+/*
+ * Returns the slot of the array with the id, or -1 (having said so) if there
+ * is none.
+ */
+int find_array(char* id)
+{
+	int n = id ? atoi(id):0;
+	int a;
+	for (a = 0; a < MAX_ARRAYS && n > 0; a++)
+	{
+		if (cur->arrays[a].id == n)
+			return a;
+	}
+	failify("No job array with ID %s.\n", id ? id:"");
+	return -1;
+}
+
+void list_arrays()
+{
+	int a, i;
+	int shown = 0;
+	for (a = 0; a < MAX_ARRAYS; a++)
 	{
-		printify( "Error: Process limit exceeded.\n" );
+		job_array* ja = &cur->arrays[a];
+		if (!ja->id)
+			continue;
+		if (!shown++)
+		{
+			hr();
+			printify(" %-4s %s %-10s %s %-6s %s %-7s %s %-6s %s %-6s %s %-6s\n", "ID", VERTICAL_LINE, "Name",
+				VERTICAL_LINE, "Total", VERTICAL_LINE, "Running", VERTICAL_LINE, "Queued", VERTICAL_LINE,
+				"OK", VERTICAL_LINE, "Failed");
+			hr();
+		}
+		int failed = 0;
+		for (i = 0; i < ja->next; i++)
+			failed += (ja->status[i] != -2 && ja->status[i] != 0);
+		char* print_name = first_n_letters(ja->name, 10);
+		printify(" %4d %s %-10s %s %6d %s %7d %s %6d %s %6d %s %6d\n", ja->id, VERTICAL_LINE, print_name,
+			VERTICAL_LINE, ja->count, VERTICAL_LINE, ja->running, VERTICAL_LINE, ja->count - ja->next,
+			VERTICAL_LINE, ja->next - ja->running - failed, VERTICAL_LINE, failed);
+	}
+	if (shown)
+		hr();
+	else
+		printify("No job arrays.\n");
+}
+
+/*
+ * list array <id>: how each index of the array is doing, with runs of
+ * consecutive indices in the same state on one line.
+ */
+void list_array(char* id)
+{
+	int a = find_array(id);
+	if (a == -1)
 		return;
+	job_array* ja = &cur->arrays[a];
+	printify("Array %d: %s %s\n", ja->id, ja->name, ja->args);
+	int i, first = 0;
+	for (i = 1; i <= ja->count; i++)
+	{
+		if (i < ja->count && ja->status[i] == ja->status[first] && ja->indices[i] == ja->indices[i-1] + 1)
+			continue;
+		char state[16];
+		status_text(ja->status[first], state, sizeof(state));
+		if (i - 1 > first)
+			printify(" %d-%d %s\n", ja->indices[first], ja->indices[i-1], state);
+		else
+			printify(" %d %s\n", ja->indices[first], state);
+		first = i;
+	}
+}
+
+/*
+ * Returns the number of instances still waiting to be started.
+ */
+int count_pending()
+{
+	int queued = 0;
+	int i;
+	for (i = 0; i < cur->pending_count; i++)
+		queued += cur->pending[i].count;
+	return queued;
+}
+
+int count_alive()
+{
+	int alive = 0;
+	int i;
+	for (i = 0; i < cur->process_count; i++)
+	{
+		if (cur->processes[i]->status == ALIVE)
+			alive++;
+	}
+	return alive;
+}
+
+/*
+ * Drops all queued jobs. Returns the number of instances that were cancelled.
+ */
+int cancel_pending()
+{
+	int cancelled = count_pending();
+	cur->pending_count = 0;
+	return cancelled;
+}
+
+/*
+ * Forks and execs one instance of the program with the scheduling settings of
+ * its priority class, and args (separated by spaces) and env (NAME=value
+ * strings added to the TM's environment, up to a NULL) if not NULL. Returns 0
+ * on success and -1 if the program couldn't be started.
+ */
+int start_process(char* name, char* args, char** env, int priority)
+{
+	if (cur->process_count >= MAX_PROCESSES)
+	{
+		failify( "Error: Process limit exceeded.\n" );
+		return -1;
 	}
 	int c2p[2];
 	int r1 = pipe2(c2p, O_CLOEXEC);
 	if (r1 == -1)
 	{
 		perrorize("pipe", errno);
-		return;
+		return -1;
 	}
+	trace(TR_SPAWN, 'B', 0, name);
 	pid_t cpid = fork();
 	if (cpid == -1)
 	{
+		trace(TR_SPAWN, 'E', -errno, NULL);
 		perrorize("add_process: fork", errno);
-		return;
+		close(c2p[READ_END]);
+		close(c2p[WRITE_END]);
+		return -1;
 	}
 	if (cpid > 0) // parent
 	{
 		close(c2p[WRITE_END]);
-		char c;
-		int r2 = read(c2p[READ_END], &c, 1);
+		char failure[1 + sizeof(int)] = { 0 };
+		int r2 = read(c2p[READ_END], failure, sizeof(failure));
 		if (r2 == -1)
 		{
+			trace(TR_SPAWN, 'E', -errno, NULL);
 			perrorize("pipe read", errno);
 			close(c2p[READ_END]);
-			return;    		
+			return -1;
 		}
-		if (c == EXEC_FAILED)
+		if (failure[0] == EXEC_FAILED || failure[0] == CAPTURE_FAILED)
 		{
+			// reported from here, so that it goes out in order with the rest
+			int eno;
+			memcpy(&eno, failure + 1, sizeof(int));
+			trace(TR_SPAWN, 'E', -eno, NULL);
+			perrorize((failure[0] == EXEC_FAILED) ? "exec":"capture: open", eno);
+			failify("Failed to start process.\n");
 			close(c2p[READ_END]);
 			waitpid(cpid, NULL, 0);
-			return;
+			return -1;
 		}
 
+		trace(TR_SPAWN, 'E', cpid, NULL);
 		process* new_proc = malloc(sizeof(*new_proc));
 
-		new_proc->pid = cpid;
-		new_proc->name = malloc(strlen(name));
-		strcpy(new_proc->name, name);
-		new_proc->status = ALIVE;
+		new_proc->pid = cpid;
+		new_proc->name = malloc(strlen(name) + 1);
+		strcpy(new_proc->name, name);
+		new_proc->status = ALIVE;
+		new_proc->priority = priority;
+		new_proc->start_ns = now_ns();
+		new_proc->start_mono_ns = monotonic_ns();
+		new_proc->kill_deadline_ns = 0;
+		new_proc->service = -1;
+		new_proc->array = -1;
+		new_proc->capture = cur->capture_size;
+		new_proc->timeout_ns = 0;
+
+		cur->processes[cur->process_count++] = new_proc;
+		record_event(EV_START, new_proc, 0);
+		close(c2p[READ_END]);
+		return 0;
+	}
+	else // child
+	{
+		close(c2p[READ_END]);
+		sigprocmask(SIG_SETMASK, &unblocked_mask, NULL);
+		signal(SIGPIPE, SIG_DFL); // ignored signals stay ignored across exec
+		// both are best effort: raising priority needs privileges we may not have
+		setpriority(PRIO_PROCESS, 0, priorities[priority].nice);
+		if (priorities[priority].policy != SCHED_OTHER)
+		{
+			struct sched_param sp = { .sched_priority = 0 };
+			sched_setscheduler(0, priorities[priority].policy, &sp);
+		}
+		char failure[1 + sizeof(int)] = { EXEC_FAILED };
+		if (cur->capture_size)
+		{
+			// the TM has no stdout or stderr, so the pipe may well be on 1 or 2
+			if (c2p[WRITE_END] <= STDERR_FILENO)
+				c2p[WRITE_END] = fcntl(c2p[WRITE_END], F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+			// a fresh file: a pid that has come around again starts over
+			char path[256];
+			capture_path(getpid(), path, sizeof(path));
+			int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+			if (out == -1 || dup2(out, STDOUT_FILENO) == -1 || dup2(out, STDERR_FILENO) == -1)
+			{
+				failure[0] = CAPTURE_FAILED;
+				memcpy(failure + 1, &errno, sizeof(int));
+				write(c2p[WRITE_END], failure, sizeof(failure));
+				_exit(EXIT_FAILURE);
+			}
+			if (out != STDOUT_FILENO && out != STDERR_FILENO)
+				close(out);
+		}
+		for (; env && *env; env++)
+			putenv(*env);
+		char bin[128];
+		if (work_dir && bin_dir(bin, sizeof(bin)) == 0)
+		{
+			// an empty PATH would put the working dir first
+			char* path = getenv("PATH");
+			path = (path && *path) ? path:"/usr/local/bin:/usr/bin:/bin";
+			char* search = malloc(strlen(path) + strlen(work_dir) + strlen(bin) + 3);
+			sprintf(search, "%s:%s/%s", path, work_dir, bin);
+			setenv("PATH", search, TRUE);
+		}
+		char* argv[MAX_ARGS + 2] = { name };
+		int argc = 1;
+		char* arg = args ? strtok(args, " "):NULL;
+		for (; arg && argc <= MAX_ARGS; arg = strtok(NULL, " "))
+			argv[argc++] = arg;
+		argv[argc] = NULL;
+		int r3 = execvp(name, argv);
+		if (r3 == -1)
+		{
+			memcpy(failure + 1, &errno, sizeof(int));
+			write(c2p[WRITE_END], failure, sizeof(failure));
+		}
+		close(c2p[WRITE_END]);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Adds an event to the ring. Called from the SIGCHLD handler too, so it only
+ * fills in memory; watchers are sent the events from the event loop.
+ */
+void record_event(int type, process* p, int status)
+{
+	event* e = &cur->events[cur->event_seq % EVENT_RING];
+	e->seq = cur->event_seq;
+	e->type = type;
+	e->pid = p->pid;
+	e->status = status;
+	strcpy(e->name, p->name);
+	cur->event_seq++;
+}
+
+/*
+ * Subscribes whoever sent the cmd, the client or the server, to events: new
+ * ones, or those from the given number on that are still in the ring.
+ */
+void watch(char* param)
+{
+	watcher* w = &cur->watchers[(infd == SV_TO_TM_CMD) ? WATCH_SERVER:WATCH_CLIENT];
+	w->active = TRUE;
+	w->next = cur->event_seq;
+	if (param)
+	{
+		long long from = atoll(param);
+		if (from < 1)
+		{
+			failify("Usage: watch [<event-number>]\n");
+			w->active = FALSE;
+			return;
+		}
+		if (from < cur->event_seq)
+			w->next = from;
+	}
+	printify("Watching from event %llu.\n", (unsigned long long) w->next);
+}
+
+/*
+ * Sends watchers the events they haven't had yet: to the client in one write,
+ * ended like a reply, and to the server as one forwarded cmd per event.
+ */
+void flush_events()
+{
+	uint64_t oldest = (cur->event_seq > EVENT_RING) ? cur->event_seq - EVENT_RING:1;
+	int who;
+	for (who = WATCH_CLIENT; who <= WATCH_SERVER; who++)
+	{
+		watcher* w = &cur->watchers[who];
+		if (!w->active || w->next >= cur->event_seq)
+			continue;
+		// they wait in the ring while the client is behind on its output
+		if (who == WATCH_CLIENT && cur->outq_len >= OUTQ_HIGH)
+			continue;
+		char buff[EVENT_RING * EVENT_LINE];
+		char* line = buff + LENGTH_BYTES; // the server gets a header before each, the client UNSOLICITED
+		int len = 0;
+		if (w->next < oldest)
+		{
+			len = snprintf(line, EVENT_LINE, "event %llu-%llu lost\n", (unsigned long long) w->next, (unsigned long long) oldest - 1);
+			w->next = oldest;
+		}
+		while (w->next < cur->event_seq)
+		{
+			if (who == WATCH_SERVER)
+			{
+				if (len)
+				{
+					line[-1] = len;
+					line[len - 1] = '\0';
+					write(TM_TO_SV_CMD, line - LENGTH_BYTES, LENGTH_BYTES + len);
+				}
+				len = 0;
+			}
+			len += format_event(w->next++, line + len, EVENT_LINE);
+		}
+		if (who == WATCH_SERVER)
+		{
+			line[-1] = len;
+			line[len - 1] = '\0';
+			write(TM_TO_SV_CMD, line - LENGTH_BYTES, LENGTH_BYTES + len);
+			continue;
+		}
+		line[-1] = UNSOLICITED;
+		line[len++] = END_OF_RESULT;
+		// dropped if the client isn't reading; the numbers show it what it missed
+		client_write(line - 1, len + 1);
+	}
+}
+
+int format_event(uint64_t seq, char* buff, int len)
+{
+	event* e = &cur->events[seq % EVENT_RING];
+	unsigned long long n = e->seq;
+	char* name = first_n_letters(e->name, 64);
+	int r;
+	if (e->type == EV_START)
+		r = snprintf(buff, len, "event %llu start %d %s\n", n, e->pid, name);
+	else if (e->type == EV_TERM)
+		r = snprintf(buff, len, "event %llu term %d %s\n", n, e->pid, name);
+	else if (e->type == EV_KILL)
+		r = snprintf(buff, len, "event %llu kill %d %s\n", n, e->pid, name);
+	else if (WIFSIGNALED(e->status))
+		r = snprintf(buff, len, "event %llu signal %d %s %d\n", n, e->pid, name, WTERMSIG(e->status));
+	else
+		r = snprintf(buff, len, "event %llu exit %d %s %d\n", n, e->pid, name, WEXITSTATUS(e->status));
+	return (r < len) ? r:len - 1;
+}
+
+void kill_by_id(int pid)
+{
+	int i;
+	for(i = 0; i < cur->process_count; i++)
+	{
+		if(cur->processes[i]->status == ALIVE && cur->processes[i]->pid == pid)
+		{
+			if(terminate(cur->processes[i]) == -1)
+			{
+				perrorize("kill", errno);
+				failify( "Failed to kill process %d.\n", pid);
+			}
+			return;
+		}
+	}
+	failify( "No running process with process ID %d.\n", pid );
+}
+
+void kill_by_name(char* pname, int n)
+{
+	int death_toll = 0;
+	int lim = (n < 0) ? MAX_PROCESSES:n;
+	int i;
+	for(i = 0; (i < cur->process_count) && (death_toll < lim); i++)
+	{
+		if(cur->processes[i]->status == ALIVE && !strcmp(cur->processes[i]->name, pname))
+		{
+			if(terminate(cur->processes[i]) != -1)
+			{
+				death_toll++;
+			}
+			else
+			{
+				perrorize("kill", errno);
+				failify( "Failed to kill process %s(%d).\n", pname, cur->processes[i]->pid);
+			}
+		}
+	}
+	printify("%d processes killed\n", death_toll);
+}
+
+void kill_all()
+{
+	int death_toll = 0;
+	int i;
+	for(i = 0; i < cur->process_count; i++)
+	{
+		if (cur->processes[i]->status != ALIVE) 
+			continue;
+		if(terminate(cur->processes[i]) != -1)
+		{
+			death_toll++;
+		}
+		else
+		{
+			perrorize("kill", errno);
+			failify( "Failed to kill process %d.\n", cur->processes[i]->pid);
+		}
+	}
+	printify("%d processes killed\n", death_toll);
+}
+
+/*
+ * Sends the process SIGTERM, and gives it KILL_GRACE_MS to exit before it gets
+ * SIGKILL from the event loop.
+ */
+int terminate(process* p)
+{
+	if (kill(p->pid, SIGTERM) == -1)
+		return -1;
+	p->status = DEAD;
+	p->kill_deadline_ns = monotonic_ns() + KILL_GRACE_MS * 1000000ULL;
+	record_event(EV_TERM, p, 0);
+	return 0;
+}
+
+/*
+ * exec --timeout: sends SIGTERM to the processes that have run out of time,
+ * and SIGKILL after KILL_GRACE_MS, like kill.
+ */
+void expire_timeouts()
+{
+	uint64_t now = monotonic_ns();
+	int i;
+	for (i = 0; i < cur->process_count; i++)
+	{
+		process* p = cur->processes[i];
+		if (!p->timeout_ns || now < p->timeout_ns)
+			continue;
+		p->timeout_ns = 0;
+		if (p->status != ALIVE)
+			continue;
+		if (p->pid == cur->exec.pid)
+			cur->exec.timed_out = TRUE;
+		if (terminate(p) == -1)
+			logify(LOG_WARN, "can't stop %s (%d) after its timeout: %s\n", p->name, p->pid, strerror(errno));
+	}
+}
+
+void escalate_kills()
+{
+	uint64_t now = monotonic_ns();
+	int i;
+	for (i = 0; i < cur->process_count; i++)
+	{
+		process* p = cur->processes[i];
+		if (p->kill_deadline_ns && now >= p->kill_deadline_ns)
+		{
+			logify(LOG_WARN, "%s (%d) ignored SIGTERM; sending SIGKILL\n", p->name, p->pid);
+			kill(p->pid, SIGKILL);
+			p->kill_deadline_ns = 0;
+			record_event(EV_KILL, p, 0);
+		}
+	}
+}
+
+/*
+ * Waits for the processes of all sessions to exit, retiring them as they do, until
+ * timeout_ms have passed. Their pidfds and a timerfd for the deadline are all
+ * waited on at once; each pidfd is opened once, and closed once its process has
+ * exited. SIGCHLD has to be blocked.
+ */
+void wait_for_exits(int timeout_ms)
+{
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec deadline = { .it_value = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L } };
+	if (timer == -1 || timerfd_settime(timer, 0, &deadline, NULL) == -1)
+	{
+		perrorize("timerfd", errno);
+		if (timer != -1)
+			close(timer);
+		return;
+	}
+	int n = 0, i;
+	session* s;
+	for (s = sessions; s; s = s->next)
+		n += s->process_count;
+	struct pollfd* fds = malloc((n + 1) * sizeof(struct pollfd));
+	n = 0;
+	for (s = sessions; s; s = s->next)
+	{
+		for (i = 0; i < s->process_count; i++)
+		{
+			fds[n].fd = syscall(__NR_pidfd_open, s->processes[i]->pid, 0);
+			fds[n].events = POLLIN;
+			if (fds[n].fd != -1)
+				n++;
+		}
+	}
+	while (n > 0)
+	{
+		fds[n].fd = timer;
+		fds[n].events = POLLIN;
+		int r = poll(fds, n + 1, -1);
+		if (r == -1 && errno != EINTR)
+			break;
+		sigchld_handler(SIGCHLD); // reaps whatever has exited
+		if (r > 0 && (fds[n].revents & POLLIN))
+			break;
+		for (i = n - 1; r > 0 && i >= 0; i--)
+		{
+			if (!fds[i].revents)
+				continue;
+			close(fds[i].fd);
+			fds[i] = fds[--n];
+		}
+	}
+	for (i = 0; i < n; i++)
+		close(fds[i].fd);
+	free(fds);
+	close(timer);
+}
+
+void free_all_processes()
+{
+	int i;
+	for(i = 0; i < cur->process_count; i++)
+	{
+		if (cur->processes[i])
+			free_process(cur->processes[i]);
+	}
+}
+
+void free_process(process* p)
+{
+	free(p->name);
+	free(p);
+}
+
+/*
+ * Maps the history file of the client this TM serves, creating or resetting it
+ * if needed. Falls back to an in-memory history if the file can't be used.
+ */
+void open_history()
+{
+	snprintf(cur->host, sizeof(cur->host), "local");
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	if (getpeername(CL_IN, (struct sockaddr*) &addr, &addrlen) == 0)
+	{
+		if (addr.ss_family == AF_INET)
+			inet_ntop(AF_INET, &((struct sockaddr_in*) &addr)->sin_addr, cur->host, sizeof(cur->host));
+		else if (addr.ss_family == AF_INET6)
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*) &addr)->sin6_addr, cur->host, sizeof(cur->host));
+	}
+	char path[256];
+	snprintf(path, sizeof(path), "%s/tm-%s.history", HISTORY_DIR, cur->host);
+
+	struct stat st;
+	cur->history_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (cur->history_fd != -1 && flock(cur->history_fd, LOCK_EX) == 0 && fstat(cur->history_fd, &st) == 0 &&
+		(st.st_size == sizeof(history_file) || ftruncate(cur->history_fd, sizeof(history_file)) == 0))
+	{
+		cur->history = mmap(NULL, sizeof(history_file), PROT_READ | PROT_WRITE, MAP_SHARED, cur->history_fd, 0);
+		if (cur->history == MAP_FAILED)
+			cur->history = NULL;
+	}
+	if (!cur->history)
+	{
+		if (cur->history_fd != -1)
+			close(cur->history_fd);
+		cur->history_fd = -1;
+		cur->history = mmap(NULL, sizeof(history_file), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (cur->history == MAP_FAILED)
+		{
+			perrorize("open_history: mmap", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (cur->history->magic != HISTORY_MAGIC || cur->history->version != HISTORY_VERSION || 
+		cur->history->capacity != HISTORY_CAPACITY)
+	{
+		memset(cur->history, 0, sizeof(history_file));
+		cur->history->version = HISTORY_VERSION;
+		cur->history->capacity = HISTORY_CAPACITY;
+		cur->history->magic = HISTORY_MAGIC;
+	}
+	if (cur->history_fd != -1)
+		flock(cur->history_fd, LOCK_UN);
+}
+
+void append_history(process* p, int status, struct rusage* usage)
+{
+	uint64_t idx = __atomic_fetch_add(&cur->history->head, 1, __ATOMIC_ACQ_REL);
+	history_record* r = &cur->history->records[idx % cur->history->capacity];
+	if (idx >= cur->history->capacity)
+	{
+		// the process dropping out takes its captured output along, unless
+		// its pid has come around again and the file is a running process's
+		int i;
+		for (i = 0; i < cur->process_count && cur->processes[i]->pid != r->pid; i++);
+		char path[256];
+		if (i == cur->process_count && capture_path(r->pid, path, sizeof(path)) == 0)
+			unlink(path);
+	}
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+	r->pid = p->pid;
+	snprintf(r->name, sizeof(r->name), "%s", p->name);
+	r->priority = p->priority;
+	r->killed = (p->status == DEAD);
+	r->exit_status = status;
+	r->start_ns = p->start_ns;
+	r->end_ns = now_ns();
+	r->elapsed_ns = monotonic_ns() - p->start_mono_ns;
+	r->utime_us = usage ? usage->ru_utime.tv_sec * 1000000ULL + usage->ru_utime.tv_usec:0;
+	r->stime_us = usage ? usage->ru_stime.tv_sec * 1000000ULL + usage->ru_stime.tv_usec:0;
+	r->maxrss_kb = usage ? usage->ru_maxrss:0;
+	__atomic_store_n(&r->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Moves processes[i] from the table to the history.
+ */
+void retire_process(int i, int status, struct rusage* usage)
+{
+	if (cur->processes[i]->service != -1)
+		service_exited(cur->processes[i], status);
+	if (cur->processes[i]->array != -1)
+		array_exited(cur->processes[i], status);
+	record_event(EV_EXIT, cur->processes[i], status);
+	if (cur->processes[i]->capture)
+		trim_capture(cur->processes[i]->pid, cur->processes[i]->capture);
+	if (cur->processes[i]->pid == cur->exec.pid)
+	{
+		// answered from the event loop
+		cur->exec.done = TRUE;
+		cur->exec.status = status;
+		cur->exec.elapsed_ns = monotonic_ns() - cur->processes[i]->start_mono_ns;
+		cur->exec.cpu_us = usage ? (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000ULL +
+			usage->ru_utime.tv_usec + usage->ru_stime.tv_usec:0;
+	}
+	append_history(cur->processes[i], status, usage);
+	free_process(cur->processes[i]);
+	cur->process_count--;
+	memmove(&cur->processes[i], &cur->processes[i+1], (cur->process_count - i) * sizeof(process*));
+}
+
+/*
+ * The name of the file the output of pid goes to.
+ */
+int capture_path(pid_t pid, char* path, int len)
+{
+	return (snprintf(path, len, "%s/tm-%s-%d.out", CAPTURE_DIR, cur->host, pid) < len) ? 0:-1;
+}
+
+/*
+ * Frees the blocks of the capture file of pid that are older than its last
+ * size bytes. The offsets are left as they are, so the process, appending,
+ * never notices; the file reads as zeros up to where its output starts.
+ */
+void trim_capture(pid_t pid, int size)
+{
+	char path[256];
+	if (capture_path(pid, path, sizeof(path)) == -1)
+		return;
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	struct stat st;
+	long page = sysconf(_SC_PAGESIZE);
+	// only once there's a page or more to free, with whatever was freed before
+	// no longer taking up blocks
+	if (fstat(fd, &st) == 0 && st.st_size > size && (uint64_t) st.st_blocks * 512 >= (uint64_t) size + page)
+	{
+		off_t end = (st.st_size - size) & ~(page - 1);
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, end) == -1)
+			logify(LOG_WARN, "capture: can't trim %s: %s\n", path, strerror(errno));
+	}
+	close(fd);
+}
+
+/*
+ * Trims the captured output of every running process, of all sessions.
+ */
+void trim_captures()
+{
+	session* was = cur;
+	int i;
+	for (cur = sessions; cur; cur = cur->next)
+	{
+		for (i = 0; i < cur->process_count; i++)
+		{
+			if (cur->processes[i]->capture)
+				trim_capture(cur->processes[i]->pid, cur->processes[i]->capture);
+		}
+	}
+	cur = was;
+}
+
+/*
+ * tail <pid> [<lines>] and cat <pid>: sends the last lines of the captured
+ * output of the process, or all that's kept of it if lines is 0. The file is
+ * mapped rather than read. Control bytes other than tabs, line ends and
+ * escape sequences are sent as ^@, ^U and so on, like cat -v does: a NUL
+ * would end the reply early, and others would be read as markers.
+ */
+void show_capture(char* param, int lines)
+{
+	pid_t pid = atoi(param);
+	char path[256];
+	if (pid <= 0 || capture_path(pid, path, sizeof(path)) == -1)
+	{
+		failify("Invalid process ID: %s\n", param);
+		return;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		failify("No output of process %d is kept.\n", pid);
+		return;
+	}
+	int size = CAPTURE_MAX;
+	int i;
+	for (i = 0; i < cur->process_count; i++)
+	{
+		if (cur->processes[i]->pid == pid && cur->processes[i]->capture)
+			size = cur->processes[i]->capture;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	// from the page the kept output starts in; what's before it is a hole
+	long page = sysconf(_SC_PAGESIZE);
+	off_t from = (st.st_size > size) ? st.st_size - size:0;
+	off_t base = from & ~(page - 1);
+	size_t len = st.st_size - base;
+	char* map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, base);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		perrorize("capture: mmap", errno);
+		return;
+	}
+	char* start = map + (from - base);
+	char* end = map + len;
+	// skip the zeros a hole reads as, and the line cut in half by the trim
+	if (from)
+	{
+		char* nl = memchr(start, '\n', end - start);
+		start = nl ? nl + 1:end;
+	}
+	if (lines)
+	{
+		char* c = end;
+		if (c > start && c[-1] == '\n')
+			c--;
+		while (c > start && (c[-1] != '\n' || --lines))
+			c--;
+		start = c;
+	}
+	char out[BUFF_SIZE * 8];
+	int n = 0;
+	char* c;
+	for (c = start; c < end; c++)
+	{
+		unsigned char b = *c;
+		if (b < ' ' && b != '\n' && b != '\t' && b != '\r' && b != '\x1b')
+		{
+			out[n++] = '^';
+			out[n++] = b + '@';
+		}
+		else
+		{
+			out[n++] = b;
+		}
+		if (n > (int) sizeof(out) - 2)
+		{
+			write_out(out, n);
+			n = 0;
+		}
+	}
+	write_out(out, n);
+	if (end > start && end[-1] != '\n')
+		printify("\n");
+	munmap(map, len);
+}
+
+/*
+ * put <key> <size> <name>, as sent by the client's put: names the cached file
+ * with that key, or gets the client to send it. Answers the client with
+ * UPLOAD_READY or UPLOAD_SKIP first either way, as it waits for one of them.
+ */
+void put(char* param)
+{
+	if (infd != CL_IN)
+	{
+		failify("put only works from a client.\n");
+		return;
+	}
+	char skip = UPLOAD_SKIP;
+	upload* u = &cur->upload;
+	unsigned long long size;
+	int end = 0;
+	if (!param || sscanf(param, "%32s %llu %32s%n", u->key, &size, u->name, &end) != 3 || param[end] ||
+		strlen(u->key) != UPLOAD_KEY_LEN || strspn(u->key, "0123456789abcdef") != UPLOAD_KEY_LEN)
+	{
+		client_write(&skip, 1);
+		failify("Usage: put <local-file> [<name>]\n");
+		return;
+	}
+	if (!valid_upload_name(u->name))
+	{
+		client_write(&skip, 1);
+		failify("Invalid name: %s\n", u->name);
+		return;
+	}
+	if (size > UPLOAD_MAX)
+	{
+		client_write(&skip, 1);
+		failify("Too large; at most %llu MiB.\n", UPLOAD_MAX / (1024 * 1024));
+		return;
+	}
+	mkdir(CACHE_DIR, 0700);
+	mkdir(CACHE_DIR "/objects", 0700);
+	mkdir(CACHE_DIR "/bin", 0700);
+	mkdir(CACHE_DIR "/tmp", 0700);
+	char path[128];
+	snprintf(path, sizeof(path), "%s/objects/%s", CACHE_DIR, u->key);
+	if (access(path, F_OK) == 0)
+	{
+		client_write(&skip, 1);
+		if (link_upload(u->key, u->name) == 0)
+			printify("%s is cached (%s); nothing sent.\n", u->name, u->key);
+		return;
+	}
+	snprintf(u->staging, sizeof(u->staging), "%s/tmp/%s.%d.%d", CACHE_DIR, u->key, getpid(), cur->id);
+	u->fd = open(u->staging, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0700);
+	if (u->fd == -1)
+	{
+		client_write(&skip, 1);
+		perrorize("put: staging", errno);
+		return;
+	}
+	if (pipe2(u->pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+	{
+		client_write(&skip, 1);
+		perrorize("put: pipe", errno);
+		close(u->fd);
+		unlink(u->staging);
+		u->fd = -1;
+		return;
+	}
+	u->size = u->left = size;
+	u->error = 0;
+	sha256_init(&u->hash);
+	u->start_ns = monotonic_ns();
+	if (!size)
+	{
+		client_write(&skip, 1);
+		finish_upload();
+		return;
+	}
+	char ready = UPLOAD_READY;
+	client_write(&ready, 1);
+	// ended once the file is in
+	reply_elsewhere = TRUE;
+}
+
+/*
+ * Moves what has come in of the file being put from the socket into the
+ * staging file, a pipe's worth at most, so other sessions get their turn.
+ */
+void receive_upload()
+{
+	upload* u = &cur->upload;
+	size_t want = (u->left < UPLOAD_CHUNK) ? u->left:UPLOAD_CHUNK;
+	ssize_t r = splice(CL_IN, NULL, u->pipe[WRITE_END], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR))
+	{
+		logify(LOG_WARN, "put: %s cut off with %llu bytes to go\n", u->name, (unsigned long long) u->left);
+		park();
+		return;
+	}
+	if (r == -1)
+		return;
+	trace(TR_UPLOAD, 'i', r, NULL);
+	ssize_t moved = 0;
+	while (moved < r)
+	{
+		ssize_t w = splice(u->pipe[READ_END], NULL, u->fd, NULL, r - moved, SPLICE_F_MOVE);
+		if (w <= 0 && !u->error)
+		{
+			// the rest of the file still has to be taken off the socket, or
+			// it would be read as cmds
+			u->error = (w == -1) ? errno:EIO;
+			int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+			dup3(null, u->fd, O_CLOEXEC);
+			close(null);
+			continue;
+		}
+		if (w <= 0)
+		{
+			perrorize("put: write", errno);
+			end_session();
+			return;
+		}
+		moved += w;
+	}
+	if (!u->error)
+		hash_upload(u->size - u->left, r);
+	u->left -= r;
+	if (!u->left)
+	{
+		cmd_failed = FALSE;
+		finish_upload();
+		end_reply(cmd_failed);
+	}
+}
+
+/*
+ * Checks the file that has come in against its key and moves it into the
+ * cache under that key.
+ */
+void finish_upload()
+{
+	upload* u = &cur->upload;
+	char key[UPLOAD_KEY_LEN + 1];
+	if (u->error)
+	{
+		perrorize("put: write", u->error);
+		abort_upload();
+		return;
+	}
+	content_key(&u->hash, key);
+	if (strcmp(key, u->key))
+	{
+		failify("%s came in damaged (%s); not kept.\n", u->name, key);
+		abort_upload();
+		return;
+	}
+	char path[128];
+	snprintf(path, sizeof(path), "%s/objects/%s", CACHE_DIR, u->key);
+	if (rename(u->staging, path) == -1)
+	{
+		perrorize("put: rename", errno);
+		abort_upload();
+		return;
+	}
+	u->staging[0] = '\0';
+	uint64_t ms = (monotonic_ns() - u->start_ns) / 1000000;
+	abort_upload();
+	if (link_upload(u->key, u->name) == 0)
+		printify("%s stored (%s, %llu bytes in %llu ms).\n", u->name, u->key,
+			(unsigned long long) u->size, (unsigned long long) ms);
+}
+
+/*
+ * Adds the len bytes of the staging file from off, just spliced in, to the
+ * upload's hash while they are still in the page cache, so that the file
+ * isn't left to hash in one go once the last of it is in.
+ */
+void hash_upload(uint64_t off, ssize_t len)
+{
+	static uint8_t chunk[UPLOAD_CHUNK];
+	upload* u = &cur->upload;
+	while (len > 0)
+	{
+		ssize_t r = pread(u->fd, chunk, (len < UPLOAD_CHUNK) ? len:UPLOAD_CHUNK, off);
+		if (r <= 0)
+		{
+			u->error = (r == -1) ? errno:EIO;
+			return;
+		}
+		sha256_update(&u->hash, chunk, r);
+		off += r;
+		len -= r;
+	}
+}
+
+/*
+ * Drops the upload in progress, if any, along with its staging file.
+ */
+void abort_upload()
+{
+	upload* u = &cur->upload;
+	if (u->fd == -1)
+		return;
+	close(u->fd);
+	close(u->pipe[READ_END]);
+	close(u->pipe[WRITE_END]);
+	if (u->staging[0])
+		unlink(u->staging);
+	u->fd = -1;
+}
+
+/*
+ * Points <name> in the client's bin dir at the cached file with the key,
+ * replacing whatever it pointed at. Returns 0 on success, -1 on failure.
+ */
+int link_upload(char* key, char* name)
+{
+	char target[128], bin[128], link[192], tmp[128];
+	if (bin_dir(bin, sizeof(bin)) == -1)
+	{
+		failify("put: no bin dir for %s\n", cur->host);
+		return -1;
+	}
+	mkdir(bin, 0700);
+	snprintf(target, sizeof(target), "../../objects/%s", key);
+	snprintf(link, sizeof(link), "%s/%s", bin, name);
+	snprintf(tmp, sizeof(tmp), "%s/tmp/%s.%d.%d.link", CACHE_DIR, name, getpid(), cur->id);
+	unlink(tmp);
+	// renamed into place, so that a process started meanwhile gets the old or the new one
+	if (symlink(target, tmp) == -1 || rename(tmp, link) == -1)
+	{
+		perrorize("put: link", errno);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * CACHE_DIR/bin/<host>, relative to the working dir: where the client's
+ * uploads are linked by name. The colons of an IPv6 address become dashes, as
+ * they would split the dir in two on the PATH. Returns 0, or -1 if it doesn't
+ * fit in len.
+ */
+int bin_dir(char* path, int len)
+{
+	int n = snprintf(path, len, "%s/bin/%s", CACHE_DIR, cur->host);
+	if (n >= len)
+		return -1;
+	char* c;
+	for (c = path; *c; c++)
+	{
+		if (*c == ':')
+			*c = '-';
+	}
+	return 0;
+}
+
+int valid_upload_name(char* name)
+{
+	return strcmp(name, ".") && strcmp(name, "..") &&
+		strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") == strlen(name);
+}
 
-		time_t curr_time = time(NULL);
-		new_proc->start = malloc(sizeof(struct tm));
-		new_proc->end = malloc(sizeof(struct tm));
-		memcpy(new_proc->start, localtime(&curr_time), sizeof(struct tm));
-		memcpy(new_proc->end, gmtime(&time_zero), sizeof(struct tm));
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-		processes[process_count++] = new_proc;
-		close(c2p[READ_END]);
-	}
-	else // child
-	{
-		close(c2p[READ_END]);
-		int r3 = execlp(name, name, NULL); // TODO: accept command line args
-		if (r3 == -1)
-		{
-			perrorize("exec", errno);
-			printify("Failed to start process.\n");
-			char c = EXEC_FAILED;
-			r3 = write(c2p[WRITE_END], &c, 1);
-			if (r3 == -1)
-			{
-				perrorize("write", errno);
-				close(c2p[WRITE_END]);
-				return;
-			}
-		}
-		close(c2p[WRITE_END]);
-	}    
-	add_process(name, count-1);
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void kill_by_id(int pid)
+/*
+ * The first n letters of s, ending in ... if s is longer. The copy is in the
+ * arena.
+ */
+char* first_n_letters(char* s, int n)
 {
-	int i;
-	for(i = 0; i < process_count; i++)
+	int len = strnlen(s, n + 1);
+	char* ss = arena_alloc(n+1);
+	if (!ss)
+		return "";
+	memcpy(ss, s, (len < n) ? len:n);
+	ss[(len < n) ? len:n] = 0;
+	if (len > n && n > 3)
 	{
-		if(processes[i]->status == ALIVE && processes[i]->pid == pid)
-		{
-			if(kill(processes[i]->pid, SIGTERM) != -1)
-			{
-				processes[i]->status = DEAD;
-				time_t curr_time = time(NULL);
-				memcpy(processes[i]->end, localtime(&curr_time), sizeof(struct tm));
-			}
-			else
-			{
-				perrorize("kill", errno);
-				printify( "Failed to kill process %d.\n", pid);
-			}
-			return;
-		}
+		ss[n-1] = ss[n-2] = ss[n-3] = '.';
 	}
-	printify( "No running process with process ID %d.\n", pid );
+	return ss;
 }
 
-void kill_by_name(char* pname, int n)
+/*
+ * Adds a record to the trace ring, over the oldest once it's full. Called from
+ * the SIGCHLD handler too, which only runs while the loop waits in ppoll().
+ */
+void trace(int type, char phase, int arg, const char* text)
 {
-	int death_toll = 0;
-	int lim = (n < 0) ? MAX_PROCESSES:n;
-	int i;
-	for(i = 0; (i < process_count) && (death_toll < lim); i++)
-	{
-		if(processes[i]->status == ALIVE && !strcmp(processes[i]->name, pname))
-		{
-			if(kill(processes[i]->pid, SIGTERM) != -1)
-			{
-				processes[i]->status = DEAD;
-				death_toll++;
-				time_t curr_time = time(NULL);
-				memcpy(processes[i]->end, localtime(&curr_time), sizeof(struct tm));
-			}
-			else
-			{
-				perrorize("kill", errno);
-				printify( "Failed to kill process %s(%d).\n", pname, processes[i]->pid);
-			}
-			return;
-		}
-	}
-	printify("%d processes killed\n", death_toll);
+	trace_record* t = &traces[trace_head++ & (TRACE_RING - 1)];
+	t->ns = monotonic_ns();
+	t->arg = arg;
+	t->phase = phase;
+	t->type = type;
+	t->text[0] = '\0';
+	if (text)
+		strncat(t->text, text, TRACE_TEXT - 1);
 }
 
-void kill_all()
+/*
+ * Writes the trace ring out as Chrome trace JSON, to trace-tm-<pid>.json in
+ * the working directory, oldest record first. Returns the number of records
+ * written, or -1, and the file's name in path.
+ */
+int dump_trace(char* path, int len)
 {
-	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+	snprintf(path, len, "trace-tm-%d.json", getpid());
+	FILE* f = fopen(path, "w");
+	if (!f)
 	{
-		perror("rm_all_clients: signal: SIGCHLD(SIG_IGN)");
-		exit(EXIT_FAILURE);
+		perrorize("trace: fopen", errno);
+		return -1;
 	}
-	int death_toll = 0;
-	int i;
-	for(i = 0; i < process_count; i++)
+	int pid = getpid();
+	uint64_t i = (trace_head > TRACE_RING) ? trace_head - TRACE_RING:0;
+	int n = 0;
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (; i < trace_head; i++, n++)
 	{
-		if (processes[i]->status != ALIVE) 
-			continue;
-		if(kill(processes[i]->pid, SIGTERM) != -1)
-		{
-			processes[i]->status = DEAD;
-			death_toll++;
-			time_t curr_time = time(NULL);
-			memcpy(processes[i]->end, localtime(&curr_time), sizeof(struct tm));
-		}
-		else
-		{
-			perrorize("kill", errno);
-			printify( "Failed to kill process %d.\n", processes[i]->pid);
-		}
+		trace_record* t = &traces[i & (TRACE_RING - 1)];
+		// the text comes from clients; keep it from breaking the JSON
+		char text[TRACE_TEXT];
+		int c;
+		for (c = 0; t->text[c] && t->text[c] != ' '; c++)
+			text[c] = (t->text[c] == '"' || t->text[c] == '\\' || iscntrl((unsigned char) t->text[c])) ? '?':t->text[c];
+		text[c] = '\0';
+		fprintf(f, "%s{\"name\":\"%s%s%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d,%s\"args\":{\"arg\":%d}}\n",
+			n ? ",":"", trace_names[t->type], text[0] ? " ":"", text, t->phase,
+			(unsigned long long) t->ns / 1000, (unsigned long long) t->ns % 1000, pid, pid,
+			(t->phase == 'i') ? "\"s\":\"t\",":"", t->arg);
 	}
-	
-	if (signal(SIGCHLD, sigchld_handler) == SIG_ERR)
+	fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+	fclose(f);
+	return n;
+}
+
+void trace_handler(int signo)
+{
+	trace_requested = TRUE;
+}
+
+void term_handler(int signo)
+{
+	term_requested = TRUE;
+}
+
+void* arena_alloc(int size)
+{
+	size = (size + 7) & ~7;
+	if (arena_used + size > ARENA_SIZE)
 	{
-		perror("rm_all_clients: signal: SIGCHLD");
-		exit(EXIT_FAILURE);
+		// sized for the worst case, so running out is a bug; it costs the cmd,
+		// not the TM and every session on it
+		logify(LOG_ERROR, "arena exhausted (%d bytes)\n", ARENA_SIZE);
+		failify("Out of scratch memory.\n");
+		return NULL;
 	}
-	printify("%d processes killed\n", death_toll);
+	void* p = arena + arena_used;
+	arena_used += size;
+	return p;
 }
 
-void free_all_processes()
+/*
+ * The cache key of what has gone into the hash: the first 128 bits of its
+ * SHA-256, in hex.
+ */
+void content_key(sha256_ctx* c, char* key)
 {
+	uint8_t digest[32];
+	sha256_final(c, digest);
 	int i;
-	for(i = 0; i < process_count; i++)
+	for (i = 0; i < UPLOAD_KEY_LEN / 2; i++)
+		sprintf(key + 2 * i, "%02x", digest[i]);
+}
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+static const uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void sha256_init(sha256_ctx* c)
+{
+	static const uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(c->h, h0, sizeof(h0));
+	c->len = 0;
+}
+
+/*
+ * Hashes data into c, keeping what doesn't make up a whole block for the next
+ * call.
+ */
+void sha256_update(sha256_ctx* c, const uint8_t* data, uint64_t len)
+{
+	int have = c->len & 63;
+	c->len += len;
+	if (have)
 	{
-		if (processes[i])
-			free_process(processes[i]);
+		int n = (len < (uint64_t) (64 - have)) ? len:64 - have;
+		memcpy(c->block + have, data, n);
+		data += n;
+		len -= n;
+		if (have + n < 64)
+			return;
+		sha256_block(c->h, c->block);
 	}
+	for (; len >= 64; data += 64, len -= 64)
+		sha256_block(c->h, data);
+	memcpy(c->block, data, len);
 }
 
-void free_process(process* p)
+void sha256_final(sha256_ctx* c, uint8_t* digest)
 {
-	free(p->name);
-	free(p->start);
-	free(p->end);
-	free(p);
+	// the rest, a 1 bit, zeros, and the length in bits, to a whole block or two
+	uint8_t tail[128] = { 0 };
+	int rest = c->len & 63;
+	memcpy(tail, c->block, rest);
+	tail[rest] = 0x80;
+	int padded = (rest < 56) ? 64:128;
+	int j;
+	for (j = 0; j < 8; j++)
+		tail[padded - 1 - j] = (c->len * 8) >> (8 * j);
+	sha256_block(c->h, tail);
+	if (padded == 128)
+		sha256_block(c->h, tail + 64);
+	for (j = 0; j < 32; j++)
+		digest[j] = c->h[j / 4] >> (24 - 8 * (j % 4));
 }
 
-char* first_n_letters(char* s, int n)
+void sha256_block(uint32_t* h, const uint8_t* p)
 {
-	char* ss = malloc(n+1);
-	memcpy(ss, s, n);
-	ss[n] = 0;
-	if (strlen(s) > n && n > 3)
+	uint32_t w[64];
+	int t;
+	for (t = 0; t < 16; t++)
+		w[t] = (uint32_t) p[4*t] << 24 | p[4*t+1] << 16 | p[4*t+2] << 8 | p[4*t+3];
+	for (t = 16; t < 64; t++)
+		w[t] = w[t-16] + (ROR(w[t-15], 7) ^ ROR(w[t-15], 18) ^ (w[t-15] >> 3)) +
+			w[t-7] + (ROR(w[t-2], 17) ^ ROR(w[t-2], 19) ^ (w[t-2] >> 10));
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+	for (t = 0; t < 64; t++)
 	{
-		ss[n-1] = ss[n-2] = ss[n-3] = '.';
+		uint32_t t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
 	}
-	return ss;
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
 }
 
 void lower(char* str)
@@ -652,34 +3256,109 @@ void hr()
 	printify("\n");
 }
 
+/*
+ * Reaps every child that has exited. Signals don't queue, so one SIGCHLD may
+ * stand for several children, and each of them frees a slot for the job queue.
+ */
 void sigchld_handler(int signo)
 {
 	pid_t pid;
-	pid = waitpid(-1, NULL, 0);
-	if (pid < 0)
-		return;
-	int i;
-	for (i = 0; i < process_count; i++)
+	int status;
+	struct rusage usage;
+	session* was = cur;
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
 	{
-		if (processes[i]->pid == pid)
+		session* s;
+		int i = 0;
+		for (s = sessions; s; s = s->next)
 		{
-			processes[i]->status = DEAD;
-			time_t curr_time = time(NULL);
-			memcpy(processes[i]->end, localtime(&curr_time), sizeof(struct tm));
-			return;
+			for (i = 0; i < s->process_count && s->processes[i]->pid != pid; i++);
+			if (i < s->process_count)
+				break;
 		}
+		if (!s)
+			continue;
+		cur = s;
+		trace(TR_REAP, 'i', pid, cur->processes[i]->name);
+		retire_process(i, status, &usage);
 	}
+	cur = was;
 }
 
 void exit_gracefully(int signo)
 {
-	if (signo == SIGINT)
+	if (signo == SIGINT && cur)
 	{
 		outfd = CL_OUT;
 		printify("%d received ctrl+c", getpid());
 	}
+	// no SIGCHLD handler running behind our back while we wait. SIGTERM stays
+	// blocked too, as outside ppoll() it always is, so the server's SIGTERM
+	// can't start this over when the session's end got here first.
+	sigset_t chld_mask;
+	sigemptyset(&chld_mask);
+	sigaddset(&chld_mask, SIGCHLD);
+	sigaddset(&chld_mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &chld_mask, NULL);
+	session* s;
+	for (s = sessions; s; s = s->next)
+	{
+		cur = s;
+		if (shared)
+			outfd = errfd = CL_OUT;
+		kill_all();
+	}
+	// all of them at once, and not forever
+	wait_for_exits(KILL_GRACE_MS);
+	int i;
+	for (s = sessions; s; s = s->next)
+	{
+		for (i = 0; i < s->process_count; i++)
+			kill(s->processes[i]->pid, SIGKILL);
+	}
+	wait_for_exits(KILL_GRACE_MS);
+	for (s = sessions; s; s = s->next)
+	{
+		cur = s;
+		// whatever hasn't exited by now goes into the history as killed
+		while (cur->process_count)
+		{
+			cur->processes[0]->status = DEAD;
+			retire_process(0, 0, NULL);
+		}
+		free_all_processes();
+		abort_upload();
+		shutdown(CL_IN, SHUT_RDWR);
+		close(CL_IN);
+		close(CL_OUT);
+		close(SV_TO_TM_CMD);
+		close(SV_TO_TM_RESULT);
+		close(TM_TO_SV_CMD);
+		close(TM_TO_SV_RESULT);
+	}
+	exit(signo);
+}
+
+/*
+ * Ends the session being served. A TM of its own exits with it; in a shared
+ * TM, the session's processes are sent SIGTERM, queued ones are cancelled and
+ * its fds closed, and the event loop frees it once the last of its processes
+ * has been reaped, SIGKILL'ing those that take too long, as it goes.
+ */
+void end_session()
+{
+	if (!shared)
+		exit_gracefully(0);
+	int s;
+	for (s = 0; s < cur->service_count; s++)
+		stop_service(s);
+	for (s = 0; s < MAX_ARRAYS; s++)
+		cancel_array(s);
 	kill_all();
-	free_all_processes();
+	cancel_pending();
+	cur->watchers[WATCH_CLIENT].active = FALSE;
+	cur->watchers[WATCH_SERVER].active = FALSE;
+	abort_upload();
 	shutdown(CL_IN, SHUT_RDWR);
 	close(CL_IN);
 	close(CL_OUT);
@@ -687,7 +3366,369 @@ void exit_gracefully(int signo)
 	close(SV_TO_TM_RESULT);
 	close(TM_TO_SV_CMD);
 	close(TM_TO_SV_RESULT);
-	exit(signo);
+	if (cur->passed_fd != -1)
+		close(cur->passed_fd);
+	cur->cl_in = cur->cl_out = cur->sv_to_tm_cmd = cur->sv_to_tm_result = -1;
+	cur->tm_to_sv_cmd = cur->tm_to_sv_result = cur->passed_fd = -1;
+	cur->parked = FALSE;
+	cur->outq_len = 0;
+	cur->closing = TRUE;
+	outfd = errfd = -1;
+	logify(LOG_INFO, "session ended\n");
+}
+
+/*
+ * A session with the defaults of a new TM, and no fds yet.
+ */
+session* new_session(char* token)
+{
+	session* s = calloc(1, sizeof(*s));
+	if (!s)
+	{
+		logify(LOG_ERROR, "new_session: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	s->id = ++session_ids;
+	s->cl_in = s->cl_out = s->sv_to_tm_cmd = s->sv_to_tm_result = -1;
+	s->tm_to_sv_cmd = s->tm_to_sv_result = -1;
+	s->history_fd = -1;
+	s->max_running = MAX_PROCESSES;
+	s->event_seq = 1;
+	s->token = token ? strdup(token):NULL;
+	s->passed_fd = -1;
+	s->overflow_policy = OVERFLOW_DROP;
+	s->upload.fd = -1;
+	s->next = sessions;
+	sessions = s;
+	return s;
+}
+
+void free_session(session* s)
+{
+	session** link;
+	for (link = &sessions; *link != s; link = &(*link)->next);
+	*link = s->next;
+	munmap(s->history, sizeof(history_file));
+	if (s->history_fd != -1)
+		close(s->history_fd);
+	int a;
+	for (a = 0; a < MAX_ARRAYS; a++)
+	{
+		free(s->arrays[a].indices);
+		free(s->arrays[a].status);
+	}
+	free(s->outq);
+	free(s->token);
+	free(s);
+	if (cur == s)
+		cur = NULL;
+}
+
+/*
+ * --shared: takes a new session from the server, which sends "session <token>"
+ * with the client's socket and the session's end of its pipes: SV_TO_TM_CMD,
+ * SV_TO_TM_RESULT, TM_TO_SV_CMD and TM_TO_SV_RESULT, in that order. The TM
+ * exits along with the server.
+ */
+void accept_session()
+{
+	char text[MAX_INPUT + 1];
+	int passed[5];
+	char cbuf[CMSG_SPACE(sizeof(passed))];
+	struct iovec iov = { .iov_base = text, .iov_len = MAX_INPUT };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	int r = recvmsg(CONTROL_FD, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (r == 0)
+		exit_gracefully(0);
+	if (r < 0)
+		return;
+	text[r] = '\0';
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	int n = 0, i;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	{
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(passed, CMSG_DATA(cmsg), n * sizeof(int));
+	}
+	if (n != 5 || strncmp(text, "session ", 8))
+	{
+		logify(LOG_ERROR, "bad session handover (%d fds)\n", n);
+		for (i = 0; i < n; i++)
+			close(passed[i]);
+		return;
+	}
+	cur = new_session(text + 8);
+	fcntl(passed[0], F_SETFL, fcntl(passed[0], F_GETFL) | O_NONBLOCK);
+	cur->cl_in = passed[0];
+	// its own fd, so that parking can swap the two halves out independently
+	cur->cl_out = fcntl(passed[0], F_DUPFD_CLOEXEC, 0);
+	cur->sv_to_tm_cmd = passed[1];
+	cur->sv_to_tm_result = passed[2];
+	cur->tm_to_sv_cmd = passed[3];
+	cur->tm_to_sv_result = passed[4];
+	outfd = errfd = CL_OUT;
+	open_history();
+	greet(FALSE);
+}
+
+/*
+ * Called when the client has gone away. Without a session token that ends the
+ * session; otherwise the TM carries on, with the client's output going into a
+ * bounded buffer, and tells the server it is detached.
+ */
+void park()
+{
+	if (!cur->token)
+	{
+		end_session();
+		return;
+	}
+	abort_upload();
+	int buffer[2];
+	if (pipe2(buffer, O_NONBLOCK | O_CLOEXEC) == -1)
+	{
+		end_session();
+		return;
+	}
+	fcntl(buffer[WRITE_END], F_SETPIPE_SZ, PARK_BUFFER);
+	// replaces (and closes) the socket
+	dup3(buffer[READ_END], CL_IN, O_CLOEXEC);
+	dup3(buffer[WRITE_END], CL_OUT, O_CLOEXEC);
+	close(buffer[READ_END]);
+	close(buffer[WRITE_END]);
+	cur->parked = TRUE;
+	cur->partial_len = 0;
+	// what the client hadn't taken yet is kept for it, as far as it fits
+	if (cur->outq_len)
+		write(CL_OUT, cur->outq, cur->outq_len);
+	cur->outq_len = 0;
+	cur->outq_dropping = FALSE;
+	logify(LOG_INFO, "client gone; session kept\n");
+	char frame[] = { sizeof("detached"), 'd', 'e', 't', 'a', 'c', 'h', 'e', 'd', '\0' };
+	write(TM_TO_SV_CMD, frame, sizeof(frame));
+}
+
+/*
+ * Switches the client over to the socket the server has just handed over,
+ * and sends it what was buffered while detached. Also used when a client
+ * resumes a session whose old connection hasn't been noticed to be dead yet.
+ */
+void resume()
+{
+	if (cur->passed_fd == -1)
+		return;
+	// the new connection won't carry on with the old one's file
+	abort_upload();
+	char* buffered = NULL;
+	int len = 0;
+	if (cur->parked)
+	{
+		buffered = malloc(PARK_BUFFER);
+		int r;
+		while (len < PARK_BUFFER && (r = read(CL_IN, buffered + len, PARK_BUFFER - len)) > 0)
+			len += r;
+	}
+	fcntl(cur->passed_fd, F_SETFL, fcntl(cur->passed_fd, F_GETFL) | O_NONBLOCK);
+	dup3(cur->passed_fd, CL_IN, O_CLOEXEC);
+	dup3(cur->passed_fd, CL_OUT, O_CLOEXEC);
+	close(cur->passed_fd);
+	cur->passed_fd = -1;
+	cur->partial_len = 0;
+	int was_parked = cur->parked;
+	cur->parked = FALSE;
+	// the rest of a reply to the old connection would only garble the greeting
+	cur->outq_len = 0;
+	cur->outq_dropping = FALSE;
+	greet(TRUE);
+	if (len)
+		client_write(buffered, len);
+	free(buffered);
+	end_reply(FALSE);
+	if (was_parked)
+	{
+		logify(LOG_INFO, "session resumed\n");
+		char frame[] = { sizeof("attached"), 'a', 't', 't', 'a', 'c', 'h', 'e', 'd', '\0' };
+		write(TM_TO_SV_CMD, frame, sizeof(frame));
+	}
+}
+
+/*
+ * The first line a client gets, so it knows which session to resume.
+ */
+void greet(int resumed)
+{
+	fprintify(CL_OUT, "session %s%s\n", cur->token, resumed ? " resumed":"");
+	if (!resumed)
+		end_reply(FALSE);
+}
+
+/*
+ * Sends output to the client without blocking, queueing what can't be sent
+ * yet behind what is already queued. While the session is detached, output
+ * goes into its buffer as long as there is room.
+ */
+void client_write(const char* buff, int len)
+{
+	if (cur->parked)
+	{
+		write(CL_OUT, buff, len);
+		return;
+	}
+	if (!cur->outq_len)
+	{
+		int r = send(CL_OUT, buff, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r == -1 && errno != EAGAIN && errno != EINTR)
+			return; // the client is gone; reading from it will say so
+		if (r > 0)
+		{
+			buff += r;
+			len -= r;
+		}
+		if (len == 0)
+			return;
+	}
+	if (cur->outq_len + len > OUTQ_LIMIT)
+	{
+		if (cur->overflow_policy == OVERFLOW_DISCONNECT)
+		{
+			logify(LOG_WARN, "client isn't reading its output; disconnecting it\n");
+			cur->outq_len = 0;
+			shutdown(CL_IN, SHUT_RDWR);
+			park();
+			return;
+		}
+		if (!cur->outq_dropping)
+		{
+			logify(LOG_WARN, "client isn't reading its output; dropping it\n");
+			cur->outq_dropping = TRUE;
+			const char note[] = "\n[output dropped: not read fast enough]\n";
+			queue_output(note, sizeof(note) - 1);
+		}
+		return;
+	}
+	queue_output(buff, len);
+}
+
+/*
+ * Ends the reply to a client cmd. The end of a reply is never dropped, so that
+ * the client doesn't wait for it forever.
+ */
+void end_reply(int failed)
+{
+	char end[] = { FAILED_RESULT, END_OF_RESULT };
+	if (cur->outq_dropping && !cur->parked)
+		queue_output(end + !failed, 2 - !failed);
+	else
+		client_write(end + !failed, 2 - !failed);
+}
+
+void queue_output(const char* buff, int len)
+{
+	if (cur->outq_len + len > cur->outq_size)
+	{
+		cur->outq_size = 2 * (cur->outq_len + len);
+		cur->outq = realloc(cur->outq, cur->outq_size);
+	}
+	memcpy(cur->outq + cur->outq_len, buff, len);
+	cur->outq_len += len;
+}
+
+/*
+ * Sends as much of the queue as the socket takes, once it's writable again.
+ */
+void flush_output()
+{
+	int r = send(CL_OUT, cur->outq, cur->outq_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (r == -1 && errno != EAGAIN && errno != EINTR)
+	{
+		cur->outq_len = 0; // the client is gone; reading from it will say so
+		return;
+	}
+	if (r > 0)
+	{
+		trace(TR_FLUSH, 'i', r, NULL);
+		cur->outq_len -= r;
+		memmove(cur->outq, cur->outq + r, cur->outq_len);
+	}
+	if (!cur->outq_len)
+		cur->outq_dropping = FALSE;
+}
+
+/*
+ * overflow drop | disconnect: what happens to a client whose queued output
+ * reaches OUTQ_LIMIT.
+ */
+void set_overflow(char* param)
+{
+	if (param && !strcasecmp(param, "drop"))
+		cur->overflow_policy = OVERFLOW_DROP;
+	else if (param && !strcasecmp(param, "disconnect"))
+		cur->overflow_policy = OVERFLOW_DISCONNECT;
+	else if (param)
+	{
+		failify("Usage: overflow [drop %s disconnect]\n", VERTICAL_LINE);
+		return;
+	}
+	printify("Output a client doesn't read beyond %d KiB is %s.\n", OUTQ_LIMIT / 1024,
+		(cur->overflow_policy == OVERFLOW_DROP) ? "dropped":"a reason to disconnect it");
+}
+
+/*
+ * echo <stamp> [server]: sends back the client's stamp, for the client's ping
+ * to time the round trip. With server, the echo goes by way of the server:
+ * the TM adds when it sent it on, the server when it read it, and the client
+ * gets back echo <stamp> <ns to the server> <ns back from the server>. The
+ * TM and server share a clock, so the two directions can be told apart.
+ */
+void echo(char* param)
+{
+	uint64_t now = monotonic_ns();
+	unsigned long long sent, seen;
+	char stamp[MAX_INPUT];
+	if (infd == SV_TO_TM_CMD && cur->ping_sent && param && 
+		sscanf(param, "%s %llu %llu", stamp, &sent, &seen) == 3 && sent == cur->ping_sent)
+	{
+		// the server's echo of the one the TM sent on; it ends the client's
+		// reply. Any other echo from the server (cl) is answered like the client's.
+		cur->ping_sent = 0;
+		reply_elsewhere = TRUE;
+		if (cur->parked)
+			return;
+		outfd = CL_OUT;
+		printify("echo %s %llu %llu\n", stamp, seen - sent, (unsigned long long) now - seen);
+		end_reply(FALSE);
+		return;
+	}
+	char* text = param ? strtok(param, " "):NULL;
+	char* via = text ? strtok(NULL, " "):NULL;
+	// a ping of the server is for clients; the server's own would come back to the client
+	if (!text || (via && (strcasecmp(via, "server") || infd == SV_TO_TM_CMD)))
+	{
+		failify("Usage: echo <text> [server]\n");
+		return;
+	}
+	if (!via)
+	{
+		printify("echo %s\n", text);
+		return;
+	}
+	char frame[LENGTH_BYTES + MAX_INPUT + 32];
+	int len = snprintf(frame + LENGTH_BYTES, sizeof(frame) - LENGTH_BYTES, "echo %s %llu", text, (unsigned long long) now) + 1;
+	frame[0] = len;
+	write(TM_TO_SV_CMD, frame, LENGTH_BYTES + len);
+	cur->ping_sent = now;
+	reply_elsewhere = TRUE;
+}
+
+/*
+ * Sends len bytes as they are, to where printify() would.
+ */
+void write_out(const char* buff, int len)
+{
+	if (outfd == CL_OUT)
+		client_write(buff, len);
+	else if (write(outfd, buff, len) == -1 && errno != EAGAIN)
+		perrorize("TM: write_out: write", errno);
 }
 
 void printify(const char* str, ...)
@@ -697,10 +3738,19 @@ void printify(const char* str, ...)
 	va_list args;
 	va_start(args, str);
 
-	if (write(outfd, buff, vsnprintf(buff, BUFF_SIZE, str, args)) == -1)
+	int len = vsnprintf(buff, BUFF_SIZE, str, args);
+	if (len >= BUFF_SIZE)
+		len = BUFF_SIZE - 1;
+	if (outfd == CL_OUT)
+		client_write(buff, len);
+	else if (write(outfd, buff, len) == -1 && errno != EAGAIN)
 	{
-		perrorize("TM: printify: write", errno);
-		if (errno == EFAULT)
+		// not perrorize(): errfd is likely the fd that just failed
+		int eno = errno;
+		cmd_failed = TRUE;
+		if (eno != EPIPE) // the server's gone, or is ending the session
+			logify(LOG_ERROR, "TM: printify: write: %s\n", strerror(eno));
+		if (eno == EFAULT)
 		{
 			exit_gracefully(0);
 		}
@@ -709,6 +3759,23 @@ void printify(const char* str, ...)
 	va_end(args);
 }
 
+/*
+ * Prints like printify(), and marks the cmd being handled as failed.
+ */
+void failify(const char* str, ...)
+{
+	char buff[BUFF_SIZE];
+
+	va_list args;
+	va_start(args, str);
+
+	cmd_failed = TRUE;
+	vsnprintf(buff, BUFF_SIZE, str, args);
+	printify("%s", buff);
+
+	va_end(args);
+}
+
 void fprintify(int fd, const char* str, ...)
 {
 	char buff[BUFF_SIZE];
@@ -716,10 +3783,18 @@ void fprintify(int fd, const char* str, ...)
 	va_list args;
 	va_start(args, str);
 
-	if (write(fd, buff, vsnprintf(buff, BUFF_SIZE, str, args)) == -1)
+	int len = vsnprintf(buff, BUFF_SIZE, str, args);
+	if (len >= BUFF_SIZE)
+		len = BUFF_SIZE - 1;
+	if (fd == CL_OUT)
+		client_write(buff, len);
+	else if (write(fd, buff, len) == -1 && errno != EAGAIN)
 	{
-		perrorize("TM: printify: write", errno);
-		if (errno == EFAULT)
+		int eno = errno;
+		cmd_failed = TRUE;
+		if (eno != EPIPE)
+			logify(LOG_ERROR, "TM: printify: write: %s\n", strerror(eno));
+		if (eno == EFAULT)
 		{
 			exit_gracefully(0);
 		}
@@ -730,6 +3805,25 @@ void fprintify(int fd, const char* str, ...)
 
 void perrorize(char* str, int eno)
 {
+	cmd_failed = TRUE;
 	fprintify(errfd, "%s: %s\n", str, strerror(eno));
-	fsync(outfd);
+	logify(LOG_ERROR, "%s: %s\n", str, strerror(eno));
+}
+
+void logify(int level, const char* str, ...)
+{
+	char buff[BUFF_SIZE];
+
+	va_list args;
+	va_start(args, str);
+
+	int len;
+	if (shared && cur)
+		len = snprintf(buff, BUFF_SIZE, "%dtm %d/%d: ", level, getpid(), cur->id);
+	else
+		len = snprintf(buff, BUFF_SIZE, "%dtm %d: ", level, getpid());
+	len += vsnprintf(buff + len, BUFF_SIZE - len, str, args);
+	send(LOG_FD, buff, (len < BUFF_SIZE) ? len:BUFF_SIZE - 1, MSG_DONTWAIT);
+
+	va_end(args);
 }